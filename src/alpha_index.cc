@@ -0,0 +1,178 @@
+//
+//  alpha_index.cc
+//  wu_collage_advanced
+//
+//  Sorted pool of aspect ratios with logarithmic-time removal, used to
+//  dispatch images to tree leaves.
+//
+
+#include "alpha_index.h"
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+
+// With approximate pairs, up to this many available entries are still
+// scanned exactly.
+static const int kExactPairNum = 64;
+// Above it, this many first-image candidates are sampled evenly over the
+// ranks, each one paired with its best partner by a binary search.
+static const int kPairSampleNum = 8;
+// The sampled search stops once a pair is within this relative distance of
+// the target, which is far below a pixel on any realistic canvas.
+static const float kPairTolerance = 1e-3f;
+
+void AlphaIndex::Build(const std::vector<float>& sorted_alpha) {
+  alpha_ = sorted_alpha;
+  num_ = static_cast<int>(alpha_.size());
+  alpha_recip_.resize(num_);
+  for (int i = 0; i < num_; ++i) {
+    alpha_recip_[i] = 1 / alpha_[i];
+  }
+  Reset();
+}
+
+void AlphaIndex::Reset() {
+  next_.resize(num_ + 1);
+  prev_.resize(num_ + 1);
+  for (int i = 0; i <= num_; ++i) {
+    next_[i] = i;
+    prev_[i] = i;
+  }
+  remain_num_ = num_;
+}
+
+void AlphaIndex::Remove(int rank) {
+  assert((rank >= 0) && (rank < num_) && (next_[rank] == rank));
+  next_[rank] = rank + 1;
+  prev_[rank + 1] = rank;
+  --remain_num_;
+}
+
+int AlphaIndex::NextAvailable(int pos) const {
+  if (pos < 0) pos = 0;
+  if (pos >= num_) return -1;
+  // Follow the links with path halving.
+  while (next_[pos] != pos) {
+    next_[pos] = next_[next_[pos]];
+    pos = next_[pos];
+  }
+  return (pos == num_) ? -1 : pos;
+}
+
+int AlphaIndex::PrevAvailable(int pos) const {
+  if (pos < 0) return -1;
+  if (pos >= num_) pos = num_ - 1;
+  int shifted = pos + 1;
+  while (prev_[shifted] != shifted) {
+    prev_[shifted] = prev_[prev_[shifted]];
+    shifted = prev_[shifted];
+  }
+  return shifted - 1;
+}
+
+void AlphaIndex::FindNeighbors(float alpha, int exclude,
+                               int& lower, int& upper) const {
+  int pos = static_cast<int>(std::lower_bound(alpha_.begin(), alpha_.end(),
+                                              alpha) - alpha_.begin());
+  upper = NextAvailable(pos);
+  if ((upper != -1) && (upper == exclude)) upper = NextAvailable(upper + 1);
+  lower = PrevAvailable(pos - 1);
+  if ((lower != -1) && (lower == exclude)) lower = PrevAvailable(lower - 1);
+}
+
+int AlphaIndex::FindNearest(float expect_alpha) const {
+  if (remain_num_ == 0) return -1;
+  int lower = -1;
+  int upper = -1;
+  FindNeighbors(expect_alpha, -1, lower, upper);
+  if (lower == -1) return upper;
+  if (upper == -1) return lower;
+  if (fabs(alpha_[upper] - expect_alpha) < fabs(alpha_[lower] - expect_alpha))
+    return upper;
+  return lower;
+}
+
+bool AlphaIndex::FindPairSum(float expect_alpha,
+                             int& rank_1, int& rank_2) const {
+  return FindPair(false, expect_alpha, rank_1, rank_2);
+}
+
+bool AlphaIndex::FindPairRecipSum(float expect_alpha_recip,
+                                  int& rank_1, int& rank_2) const {
+  return FindPair(true, expect_alpha_recip, rank_1, rank_2);
+}
+
+bool AlphaIndex::FindPair(bool use_recip, float target,
+                          int& rank_1, int& rank_2) const {
+  if (remain_num_ < 2) return false;
+  const std::vector<float>& value = use_recip ? alpha_recip_ : alpha_;
+  int best_i = -1;
+  int best_j = -1;
+  float min_diff = -1;
+
+  if (!approximate_pairs_ || (remain_num_ <= kExactPairNum)) {
+    // Two pointers over the available ranks, low walking up and high down
+    // the values. Reciprocals descend with the rank, so their walk goes the
+    // other way.
+    int low = use_recip ? PrevAvailable(num_ - 1) : NextAvailable(0);
+    int high = use_recip ? NextAvailable(0) : PrevAvailable(num_ - 1);
+    while (use_recip ? (low > high) : (low < high)) {
+      float sum = value[low] + value[high];
+      float diff = fabs(sum - target);
+      if ((min_diff < 0) || (diff < min_diff)) {
+        min_diff = diff;
+        best_i = low;
+        best_j = high;
+      }
+      if (sum > target) {
+        high = use_recip ? NextAvailable(high + 1) : PrevAvailable(high - 1);
+      } else if (sum < target) {
+        low = use_recip ? PrevAvailable(low - 1) : NextAvailable(low + 1);
+      } else {
+        break;
+      }
+    }
+  } else {
+    // Try the entry matching half of the target first, it usually pairs
+    // with a similar-sized partner almost exactly. Then sample candidates at
+    // evenly spaced ranks.
+    int candidates[kPairSampleNum + 1];
+    candidates[0] = FindNearest(use_recip ? 2 / target : target / 2);
+    for (int s = 0; s < kPairSampleNum; ++s) {
+      int pos = static_cast<int>(
+          static_cast<long long>(num_ - 1) * s / (kPairSampleNum - 1));
+      int cand = NextAvailable(pos);
+      if (cand == -1) cand = PrevAvailable(pos);
+      candidates[s + 1] = cand;
+    }
+    float tolerance = target * kPairTolerance;
+    for (int c = 0; c <= kPairSampleNum; ++c) {
+      int i = candidates[c];
+      float need = target - value[i];
+      int partners[2] = {-1, -1};
+      if (use_recip && (need <= 0)) {
+        // Even the widest partner overshoots, take the widest one.
+        partners[0] = PrevAvailable(num_ - 1);
+        if (partners[0] == i) partners[0] = PrevAvailable(i - 1);
+      } else {
+        FindNeighbors(use_recip ? 1 / need : need, i,
+                      partners[0], partners[1]);
+      }
+      for (int p = 0; p < 2; ++p) {
+        int j = partners[p];
+        if (j == -1) continue;
+        float diff = fabs(value[i] + value[j] - target);
+        if ((min_diff < 0) || (diff < min_diff)) {
+          min_diff = diff;
+          best_i = i;
+          best_j = j;
+        }
+      }
+      if (min_diff <= tolerance) break;
+    }
+  }
+  if ((best_i == -1) || (best_j == -1)) return false;
+  rank_1 = std::min(best_i, best_j);
+  rank_2 = std::max(best_i, best_j);
+  return true;
+}
@@ -0,0 +1,98 @@
+//
+//  alpha_index.h
+//  wu_collage_advanced
+//
+//  Sorted pool of aspect ratios with logarithmic-time removal, used to
+//  dispatch images to tree leaves.
+//
+
+#ifndef __wu_collage_advanced__alpha_index__
+#define __wu_collage_advanced__alpha_index__
+
+#include <vector>
+
+// Entries are addressed by their rank in the sorted aspect ratio array.
+// Removed entries stay in the array as tombstones. Each tombstone links to
+// the next (and previous) rank that may still be available, and lookups
+// compress these links as they follow them (as in union-find), so skipping
+// runs of removed entries costs amortized near-constant time. Finding the
+// nearest aspect ratio is a binary search plus two such lookups, and nothing
+// is ever moved around.
+//
+// The pair searches are not logarithmic by default: the closest pair sum
+// over a changing set has no exact sublinear search, so they stay O(n) per
+// pair, and a tree generation that dispatches its images in pairs is O(n^2).
+// Only set_approximate_pairs makes them O(log n).
+class AlphaIndex {
+public:
+  AlphaIndex() : num_(0), remain_num_(0), approximate_pairs_(false) {}
+
+  // Build the index from aspect ratios sorted in ascending order.
+  // All the entries are available afterwards.
+  void Build(const std::vector<float>& sorted_alpha);
+  // Make all the entries available again, O(n) without reallocation.
+  void Reset();
+  // Remove the entry with the given rank. It must be available.
+  void Remove(int rank);
+  // By default the pair searches walk all the available entries and return
+  // the best pair, O(n) each. With approximate_pairs, once more than 64
+  // entries are available they only try a few candidates, each with its best
+  // partner found by binary search: O(log n), but the pair may not be the
+  // closest, so the layouts change. Off by default.
+  void set_approximate_pairs(bool approximate_pairs) {
+    approximate_pairs_ = approximate_pairs;
+  }
+
+  // Number of available entries.
+  int remain_num() const {
+    return remain_num_;
+  }
+  bool approximate_pairs() const {
+    return approximate_pairs_;
+  }
+  float alpha(int rank) const {
+    return alpha_[rank];
+  }
+  float alpha_recip(int rank) const {
+    return alpha_recip_[rank];
+  }
+
+  // Rank of the available entry whose aspect ratio is closest to
+  // expect_alpha, or -1 if the index is empty.
+  int FindNearest(float expect_alpha) const;
+  // Find two available entries whose aspect ratios sum up closest to
+  // expect_alpha (vertical cut). rank_1 < rank_2.
+  bool FindPairSum(float expect_alpha, int& rank_1, int& rank_2) const;
+  // Find two available entries whose reciprocal aspect ratios sum up closest
+  // to expect_alpha_recip (horizontal cut). rank_1 < rank_2.
+  bool FindPairRecipSum(float expect_alpha_recip,
+                        int& rank_1, int& rank_2) const;
+
+private:
+  // First available rank >= pos, or -1.
+  int NextAvailable(int pos) const;
+  // Last available rank <= pos, or -1.
+  int PrevAvailable(int pos) const;
+  // Available neighbours around alpha in rank order, skipping exclude.
+  // lower is the last one below alpha, upper the first one >= alpha.
+  void FindNeighbors(float alpha, int exclude, int& lower, int& upper) const;
+  // Shared pair search. If use_recip, the pair is matched on the reciprocal
+  // aspect ratios.
+  bool FindPair(bool use_recip, float target, int& rank_1, int& rank_2) const;
+
+  // Sorted aspect ratios and their reciprocals.
+  std::vector<float> alpha_;
+  std::vector<float> alpha_recip_;
+  // next_[i] == i if rank i is available, otherwise a rank > i to continue
+  // the search from. next_[num_] is a sentinel. The links are compressed
+  // during lookups, hence mutable.
+  mutable std::vector<int> next_;
+  // The same towards lower ranks, shifted by one: prev_[i + 1] describes
+  // rank i and prev_[0] is a sentinel.
+  mutable std::vector<int> prev_;
+  int num_;
+  int remain_num_;
+  bool approximate_pairs_;
+};
+
+#endif /* defined(__wu_collage_advanced__alpha_index__) */
@@ -0,0 +1,154 @@
+//
+//  band_writer.cc
+//  wu_collage_advanced
+//
+//  Consumers of a collage rendered band by band, from top to bottom.
+//
+
+#include "band_writer.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include <errno.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace {
+
+bool MakeDirectory(const std::string& path) {
+  if ((mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST)) return true;
+  COLLAGE_LOG(kLogError) << "mkdir " << path;
+  return false;
+}
+
+}  // namespace
+
+PpmBandWriter::~PpmBandWriter() {
+  if (file_ != NULL) fclose(file_);
+}
+
+bool PpmBandWriter::Begin(int canvas_width, int canvas_height) {
+  file_ = fopen(output_path_.c_str(), "wb");
+  if (file_ == NULL) {
+    COLLAGE_LOG(kLogError) << "PpmBandWriter " << output_path_;
+    return false;
+  }
+  fprintf(file_, "P6\n%d %d\n255\n", canvas_width, canvas_height);
+  return true;
+}
+
+bool PpmBandWriter::WriteBand(const cv::Mat& band) {
+  if (file_ == NULL) return false;
+  StatTimer timer(kStatEncode);
+  // PPM stores RGB.
+  cv::cvtColor(band, rgb_, cv::COLOR_BGR2RGB);
+  size_t row_bytes = rgb_.cols * rgb_.elemSize();
+  for (int y = 0; y < rgb_.rows; ++y) {
+    if (fwrite(rgb_.ptr<unsigned char>(y), 1, row_bytes, file_) != row_bytes)
+      return false;
+  }
+  return true;
+}
+
+bool PpmBandWriter::Finish() {
+  if (file_ == NULL) return false;
+  bool success = (fclose(file_) == 0);
+  file_ = NULL;
+  return success;
+}
+
+bool DziBandWriter::Begin(int canvas_width, int canvas_height) {
+  // Level max_level_ is the first one whose larger side is 1 when halving
+  // max_level_ times.
+  max_level_ = 0;
+  while ((1 << max_level_) < std::max(canvas_width, canvas_height)) {
+    ++max_level_;
+  }
+  levels_.resize(max_level_ + 1);
+  cv::Size size(canvas_width, canvas_height);
+  for (int level = max_level_; level >= 0; --level) {
+    levels_[level].size_ = size;
+    levels_[level].pending_.create(tile_size_, size.width, CV_8UC3);
+    levels_[level].filled_ = 0;
+    levels_[level].tile_row_ = 0;
+    size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+  }
+
+  std::string files_dir = output_base_ + "_files";
+  if (!MakeDirectory(files_dir)) return false;
+  for (int level = 0; level <= max_level_; ++level) {
+    std::ostringstream level_dir;
+    level_dir << files_dir << "/" << level;
+    if (!MakeDirectory(level_dir.str())) return false;
+  }
+  std::ofstream dzi((output_base_ + ".dzi").c_str());
+  if (!dzi) {
+    COLLAGE_LOG(kLogError) << "DziBandWriter " << output_base_;
+    return false;
+  }
+  dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+      << "TileSize=\"" << tile_size_ << "\" Overlap=\"0\" Format=\""
+      << format_ << "\">\n"
+      << "  <Size Width=\"" << canvas_width << "\" Height=\""
+      << canvas_height << "\"/>\n"
+      << "</Image>\n";
+  return dzi.good();
+}
+
+bool DziBandWriter::WriteBand(const cv::Mat& band) {
+  return AddRows(max_level_, band);
+}
+
+bool DziBandWriter::Finish() {
+  // Flush the partial last tile row of every level, from the top down, so
+  // that each level has received all its rows before it is flushed.
+  for (int level = max_level_; level >= 0; --level) {
+    if ((levels_[level].filled_ > 0) && !FlushLevel(level)) return false;
+  }
+  return true;
+}
+
+bool DziBandWriter::AddRows(int level, const cv::Mat& rows) {
+  Level& cur = levels_[level];
+  int start = 0;
+  while (start < rows.rows) {
+    int count = std::min(rows.rows - start, tile_size_ - cur.filled_);
+    rows.rowRange(start, start + count).copyTo(
+        cur.pending_.rowRange(cur.filled_, cur.filled_ + count));
+    cur.filled_ += count;
+    start += count;
+    if ((cur.filled_ == tile_size_) && !FlushLevel(level)) return false;
+  }
+  return true;
+}
+
+bool DziBandWriter::FlushLevel(int level) {
+  Level& cur = levels_[level];
+  cv::Mat rows = cur.pending_.rowRange(0, cur.filled_);
+  for (int x = 0, col = 0; x < cur.size_.width; x += tile_size_, ++col) {
+    cv::Rect tile_rect(x, 0, std::min(tile_size_, cur.size_.width - x),
+                       cur.filled_);
+    std::ostringstream tile_path;
+    tile_path << output_base_ << "_files/" << level << "/" << col << "_"
+              << cur.tile_row_ << "." << format_;
+    StatTimer timer(kStatEncode);
+    if (!cv::imwrite(tile_path.str(), rows(tile_rect))) {
+      COLLAGE_LOG(kLogError) << "DziBandWriter " << tile_path.str();
+      return false;
+    }
+  }
+  ++cur.tile_row_;
+  cur.filled_ = 0;
+  if (level == 0) return true;
+  // tile_size_ is even for all but the last tile row, so the halves of
+  // consecutive tile rows line up with the level below.
+  cv::Mat half;
+  {
+    StatTimer timer(kStatResize);
+    cv::resize(rows, half, cv::Size(levels_[level - 1].size_.width,
+                                    (rows.rows + 1) / 2), 0, 0, cv::INTER_AREA);
+  }
+  return AddRows(level - 1, half);
+}
@@ -0,0 +1,90 @@
+//
+//  band_writer.h
+//  wu_collage_advanced
+//
+//  Consumers of a collage rendered band by band, from top to bottom.
+//
+
+#ifndef __wu_collage_advanced__band_writer__
+#define __wu_collage_advanced__band_writer__
+
+#include <assert.h>
+#include <opencv2/opencv.hpp>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Receives the rows of a canvas in order. Bands may have any height; all of
+// them together cover the canvas exactly once.
+class BandWriter {
+public:
+  virtual ~BandWriter() {}
+  // Called once before the first band.
+  virtual bool Begin(int canvas_width, int canvas_height) = 0;
+  // band is CV_8UC3 and canvas_width wide.
+  virtual bool WriteBand(const cv::Mat& band) = 0;
+  // Called once after the last band.
+  virtual bool Finish() = 0;
+};
+
+// Streams the canvas into a binary PPM (P6) file, which has no size limit and
+// needs no more memory than one band.
+class PpmBandWriter : public BandWriter {
+public:
+  explicit PpmBandWriter(const std::string& output_path)
+      : output_path_(output_path), file_(NULL) {}
+  virtual ~PpmBandWriter();
+  virtual bool Begin(int canvas_width, int canvas_height);
+  virtual bool WriteBand(const cv::Mat& band);
+  virtual bool Finish();
+
+private:
+  std::string output_path_;
+  FILE* file_;
+  cv::Mat rgb_;
+};
+
+// Builds a Deep Zoom (DZI) tile pyramid while the bands stream by:
+// output_base.dzi describes the image, output_base_files/<level>/<col>_<row>
+// hold the tiles. Level max_level is the canvas, every level below is half
+// the size of the one above (rounded up), down to 1x1.
+// Each level only buffers one row of tiles, so memory stays around two
+// tile rows of the canvas width. tile_size must be even, so that two tile
+// rows of a level halve into exactly one of the level below.
+class DziBandWriter : public BandWriter {
+public:
+  DziBandWriter(const std::string& output_base, int tile_size = 254,
+                const std::string& format = "jpg")
+      : output_base_(output_base), tile_size_(tile_size), format_(format),
+        max_level_(0) {
+    assert((tile_size > 0) && (tile_size % 2 == 0));
+  }
+  virtual bool Begin(int canvas_width, int canvas_height);
+  virtual bool WriteBand(const cv::Mat& band);
+  virtual bool Finish();
+
+private:
+  class Level {
+  public:
+    cv::Size size_;
+    // Rows received but not yet written as tiles, filled_ of them in use.
+    cv::Mat pending_;
+    int filled_;
+    // Index of the next tile row.
+    int tile_row_;
+  };
+  // Append rows to a level, writing full tile rows and passing them
+  // downscaled to the level below.
+  bool AddRows(int level, const cv::Mat& rows);
+  // Write the filled_ pending rows of a level as one row of tiles and pass
+  // them on to the level below.
+  bool FlushLevel(int level);
+
+  std::string output_base_;
+  int tile_size_;
+  std::string format_;
+  int max_level_;
+  std::vector<Level> levels_;
+};
+
+#endif /* defined(__wu_collage_advanced__band_writer__) */
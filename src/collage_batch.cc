@@ -0,0 +1,211 @@
+//
+//  collage_batch.cc
+//  wu_collage_advanced
+//
+//  Non-interactive batch mode: many collages in one process.
+//
+
+#include "collage_batch.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "wu_collage_advanced.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <thread>
+
+// Memory for the layouts shared by the jobs of a batch.
+static const size_t kBatchLayoutCacheBytes = 16 << 20;
+
+namespace {
+
+double ElapsedMs(const std::chrono::steady_clock::time_point& start) {
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return (str.size() >= suffix.size()) &&
+         (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+// .ppm and .dzi outputs are rendered band by band and never hold the whole
+// canvas, so they suit canvases of any size. Other formats go through
+// cv::imwrite.
+bool WriteCollageImage(const CollageAdvanced& collage,
+                       const std::string& image_path) {
+  if (EndsWith(image_path, ".ppm")) {
+    PpmBandWriter ppm(image_path);
+    std::vector<BandWriter*> writers(1, &ppm);
+    return collage.OutputCollageBands(writers);
+  }
+  if (EndsWith(image_path, ".dzi")) {
+    DziBandWriter dzi(image_path.substr(0, image_path.size() - 4));
+    std::vector<BandWriter*> writers(1, &dzi);
+    return collage.OutputCollageBands(writers);
+  }
+  cv::Mat canvas = collage.OutputCollageImage();
+  StatTimer timer(kStatEncode);
+  return cv::imwrite(image_path, canvas);
+}
+
+}  // namespace
+
+CollageBatch::CollageBatch(int thread_num, size_t tile_cache_bytes,
+                           const std::string& tile_cache_dir,
+                           const std::string& layout_cache_dir)
+    : tile_cache_(tile_cache_bytes, tile_cache_dir),
+      layout_cache_(kBatchLayoutCacheBytes, layout_cache_dir) {
+  if (thread_num < 1)
+    thread_num = static_cast<int>(std::thread::hardware_concurrency());
+  thread_num_ = (thread_num < 1) ? 1 : thread_num;
+}
+
+bool CollageBatch::ReadManifest(const std::string& manifest_path) {
+  std::ifstream manifest(manifest_path.c_str());
+  if (!manifest) {
+    COLLAGE_LOG(kLogError) << "ReadManifest";
+    return false;
+  }
+  std::string line;
+  int line_num = 0;
+  while (std::getline(manifest, line)) {
+    ++line_num;
+    std::istringstream fields(line);
+    BatchJob job;
+    if (!(fields >> job.image_list_) || (job.image_list_[0] == '#')) continue;
+    std::string image_path;
+    std::string seed;
+    if (!(fields >> job.canvas_width_ >> job.expect_alpha_ >> job.thresh_ >>
+          job.html_path_) ||
+        (job.canvas_width_ <= 0) || (job.expect_alpha_ <= 0) ||
+        (job.thresh_ <= 1)) {
+      COLLAGE_LOG(kLogError) << "ReadManifest line " << line_num;
+      return false;
+    }
+    if (fields >> image_path) job.image_path_ = image_path;
+    if (fields >> seed) {
+      job.has_seed_ = true;
+      job.random_seed_ = strtoull(seed.c_str(), NULL, 10);
+    }
+    if (job.html_path_ == "-") job.html_path_.clear();
+    if (job.image_path_ == "-") job.image_path_.clear();
+    jobs_.push_back(job);
+  }
+  return true;
+}
+
+int CollageBatch::Run(std::ostream& report) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  results_.assign(jobs_.size(), BatchResult());
+  // Seeds are drawn up front, so a job's layout does not depend on which
+  // thread happens to run it.
+  for (int i = 0; i < jobs_.size(); ++i) {
+    results_[i].random_seed_ = jobs_[i].has_seed_ ? jobs_[i].random_seed_ :
+                                                    CollageRandom::DefaultSeed();
+  }
+  std::atomic<int> next_job(0);
+  int worker_num = std::min(thread_num_, static_cast<int>(jobs_.size()));
+  std::vector<std::thread> workers;
+  for (int t = 0; t < worker_num; ++t) {
+    workers.push_back(std::thread([&]() {
+      for (int i = next_job++; i < jobs_.size(); i = next_job++) {
+        RunJob(jobs_[i], results_[i]);
+        ReportJob(report, i);
+      }
+    }));
+  }
+  for (int t = 0; t < worker_num; ++t) {
+    workers[t].join();
+  }
+
+  int failed_num = 0;
+  for (int i = 0; i < results_.size(); ++i) {
+    if (!results_[i].success_) ++failed_num;
+  }
+  report << "batch\tjobs=" << jobs_.size() << "\tfailed=" << failed_num
+         << "\tthreads=" << worker_num
+         << "\timages_probed=" << size_cache_.probe_num()
+         << "\ttile_hits=" << tile_cache_.hit_num()
+         << "\ttile_disk_hits=" << tile_cache_.disk_hit_num()
+         << "\ttile_decodes=" << tile_cache_.miss_num()
+         << "\tlayout_hits="
+         << layout_cache_.hit_num() + layout_cache_.disk_hit_num()
+         << "\tlayout_misses=" << layout_cache_.miss_num()
+         << "\ttotal_ms=" << ElapsedMs(start) << std::endl;
+  return failed_num;
+}
+
+void CollageBatch::RunJob(const BatchJob& job, BatchResult& result) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  // Step 1: image sizes, from the shared cache.
+  std::vector<std::string> image_paths;
+  std::vector<cv::Size> image_sizes;
+  if (!size_cache_.ReadImageList(job.image_list_, image_paths, image_sizes) ||
+      image_paths.empty()) {
+    result.total_ms_ = ElapsedMs(start);
+    return;
+  }
+  CollageAdvanced collage(image_paths, image_sizes, job.canvas_width_,
+                          result.random_seed_);
+  collage.set_layout_cache(&layout_cache_);
+  result.image_num_ = collage.image_num();
+  result.load_ms_ = ElapsedMs(start);
+
+  // Step 2: layout. Every job is single-threaded, the jobs themselves keep
+  // the cores busy.
+  std::chrono::steady_clock::time_point step = std::chrono::steady_clock::now();
+  int success = collage.CreateCollage(job.expect_alpha_, job.thresh_,
+                                      result.tree_generation_,
+                                      result.adjust_iteration_);
+  result.layout_ms_ = ElapsedMs(step);
+  if (success == -1) {
+    result.total_ms_ = ElapsedMs(start);
+    return;
+  }
+  result.canvas_height_ = collage.canvas_height();
+  result.canvas_alpha_ = collage.canvas_alpha();
+  result.success_ = true;
+
+  // Step 3: outputs.
+  if (!job.html_path_.empty()) {
+    step = std::chrono::steady_clock::now();
+    result.success_ = collage.OutputCollageHtml(job.html_path_);
+    result.html_ms_ = ElapsedMs(step);
+  }
+  if (!job.image_path_.empty()) {
+    step = std::chrono::steady_clock::now();
+    collage.set_tile_cache(&tile_cache_);
+    if (!WriteCollageImage(collage, job.image_path_)) {
+      COLLAGE_LOG(kLogError) << "imwrite " << job.image_path_;
+      result.success_ = false;
+    }
+    result.render_ms_ = ElapsedMs(step);
+  }
+  result.total_ms_ = ElapsedMs(start);
+}
+
+void CollageBatch::ReportJob(std::ostream& report, int job_ind) {
+  const BatchJob& job = jobs_[job_ind];
+  const BatchResult& result = results_[job_ind];
+  std::lock_guard<std::mutex> lock(report_mutex_);
+  report << "job " << job_ind << "\t" << (result.success_ ? "ok" : "failed")
+         << "\tlist=" << job.image_list_
+         << "\timages=" << result.image_num_
+         << "\tcanvas=" << job.canvas_width_ << "x" << result.canvas_height_
+         << "\talpha=" << result.canvas_alpha_
+         << "\ttree_generation=" << result.tree_generation_
+         << "\tadjust_iteration=" << result.adjust_iteration_
+         << "\tseed=" << result.random_seed_
+         << "\tload_ms=" << result.load_ms_
+         << "\tlayout_ms=" << result.layout_ms_
+         << "\thtml_ms=" << result.html_ms_
+         << "\trender_ms=" << result.render_ms_
+         << "\ttotal_ms=" << result.total_ms_ << std::endl;
+}
@@ -0,0 +1,113 @@
+//
+//  collage_batch.h
+//  wu_collage_advanced
+//
+//  Non-interactive batch mode: many collages in one process.
+//
+
+#ifndef __wu_collage_advanced__collage_batch__
+#define __wu_collage_advanced__collage_batch__
+
+#include "image_size_cache.h"
+#include "layout_cache.h"
+#include "tile_cache.h"
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// One collage to produce. Outputs whose path is empty are not written.
+// An image_path ending in .ppm or .dzi is rendered band by band (the latter
+// as a Deep Zoom pyramid), any other one is written with cv::imwrite.
+class BatchJob {
+public:
+  BatchJob() : canvas_width_(0), expect_alpha_(1), thresh_(1.1f),
+      has_seed_(false), random_seed_(0) {}
+  std::string image_list_;
+  int canvas_width_;
+  float expect_alpha_;
+  float thresh_;
+  std::string html_path_;
+  std::string image_path_;
+  bool has_seed_;          // Otherwise every job gets a fresh seed.
+  uint64_t random_seed_;
+};
+
+class BatchResult {
+public:
+  BatchResult() : success_(false), image_num_(0), canvas_height_(-1),
+      canvas_alpha_(-1), tree_generation_(0), adjust_iteration_(0),
+      random_seed_(0), load_ms_(0), layout_ms_(0), html_ms_(0),
+      render_ms_(0), total_ms_(0) {}
+  bool success_;
+  int image_num_;
+  int canvas_height_;
+  float canvas_alpha_;
+  int tree_generation_;
+  int adjust_iteration_;
+  uint64_t random_seed_;
+  // Wall time of each step in milliseconds.
+  double load_ms_;
+  double layout_ms_;
+  double html_ms_;
+  double render_ms_;
+  double total_ms_;
+};
+
+// Runs the jobs of a manifest concurrently. Image sizes are shared between
+// all jobs through one ImageSizeCache, so photos appearing in several lists
+// are opened once per batch. Rendered tiles go through one TileCache, so a
+// photo rendered by several jobs is decoded once as long as it stays cached.
+// Layouts go through one LayoutCache, so a job repeating the images and
+// parameters of an earlier one skips the tree search, whatever its seed.
+class CollageBatch {
+public:
+  // thread_num < 1 uses one thread per core. The tile cache holds up to
+  // tile_cache_bytes of pixels, and is persisted in tile_cache_dir if given.
+  // Layouts are persisted in layout_cache_dir if given.
+  explicit CollageBatch(int thread_num,
+                        size_t tile_cache_bytes = 256 << 20,
+                        const std::string& tile_cache_dir = "",
+                        const std::string& layout_cache_dir = "");
+
+  // The manifest has one job per row:
+  //   image_list canvas_width expect_alpha thresh html_path [image_path [seed]]
+  // separated by white space. "-" skips an output. Empty rows and rows
+  // starting with '#' are ignored.
+  bool ReadManifest(const std::string& manifest_path);
+  // Image sizes are looked up in image_index (not owned) before opening the
+  // images.
+  void set_image_index(const ImageIndex* image_index) {
+    size_cache_.set_image_index(image_index);
+  }
+  void AddJob(const BatchJob& job) {
+    jobs_.push_back(job);
+  }
+  // Run all the jobs. A line with the result and timing of every job is
+  // written to report as soon as it finishes, followed by a summary.
+  // Returns the number of failed jobs.
+  int Run(std::ostream& report);
+
+  const std::vector<BatchJob>& jobs() const {
+    return jobs_;
+  }
+  const std::vector<BatchResult>& results() const {
+    return results_;
+  }
+
+private:
+  void RunJob(const BatchJob& job, BatchResult& result);
+  void ReportJob(std::ostream& report, int job_ind);
+
+  std::vector<BatchJob> jobs_;
+  std::vector<BatchResult> results_;
+  ImageSizeCache size_cache_;
+  TileCache tile_cache_;
+  LayoutCache layout_cache_;
+  int thread_num_;
+  // Serializes the report lines.
+  std::mutex report_mutex_;
+};
+
+#endif /* defined(__wu_collage_advanced__collage_batch__) */
@@ -0,0 +1,661 @@
+//
+//  collage_bench.cc
+//  wu_collage_advanced
+//
+//  Benchmark for the layout and rendering phases. Every phase is timed on
+//  its own over synthetic aspect ratio distributions (or a real image list),
+//  and one JSON object per (distribution, image number, thresh, phase) is
+//  written to stdout.
+//
+//  Usage: collage_bench [--sizes=10,100,...] [--thresh=1.1,1.5,2]
+//                       [--dist=uniform,bimodal,heavy] [--reps=n]
+//                       [--alpha=1] [--width=1000] [--threads=1]
+//                       [--seed=n] [--list=image_list] [--html=path]
+//                       [--candidates=k] [--build_threads=1]
+//                       [--approximate_pairs=1]
+//
+//  The batch phases evaluate k copies of the generated tree with random
+//  split types, with TreeBatch and then one tree at a time. The *_recursive
+//  phases time recursive versions of the library's traversals on the same
+//  tree, and the chain phase lays out a tree as deep as it has leaves. The
+//  refine phase runs CollageTree::Refine from the adjusted tree. Up to
+//  16 images, the table phase picks the closest TopologyTable entry (the
+//  create phase then usually takes it too, without searching).
+//  --build_threads=k generates every tree on k threads (see
+//  CollageTree::set_build_thread_num), in the generate phase and the search.
+//  --approximate_pairs=0 matches the leaf pairs exactly (the library
+//  default, see AlphaIndex::set_approximate_pairs); it is on here because
+//  the exact search makes the default 100k and 1M sizes impractical.
+//  With --list the images in the list are used instead of the synthetic
+//  distributions, and the rendering phase is measured as well.
+//
+
+#include "wu_collage_advanced.h"
+#include "collage_log.h"
+#include "image_probe.h"
+#include "topology_table.h"
+#include "tree_batch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// Every allocation of the process goes through here, so that each phase can
+// report how many allocations it made.
+static std::atomic<long long> g_alloc_num(0);
+static std::atomic<long long> g_alloc_bytes(0);
+
+void* operator new(std::size_t size) {
+  ++g_alloc_num;
+  g_alloc_bytes += static_cast<long long>(size);
+  void* ptr = malloc(size ? size : 1);
+  if (ptr == NULL) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+namespace {
+
+// Samples of one phase under one configuration.
+class PhaseStats {
+public:
+  PhaseStats() : alloc_num_(0), alloc_bytes_(0) {}
+  void Add(double usec, long long alloc_num, long long alloc_bytes) {
+    usec_.push_back(usec);
+    alloc_num_ += alloc_num;
+    alloc_bytes_ += alloc_bytes;
+  }
+  bool empty() const {
+    return usec_.empty();
+  }
+  std::vector<double> usec_;
+  long long alloc_num_;
+  long long alloc_bytes_;
+};
+
+// Measures the time and the allocations between its construction and Stop().
+class PhaseTimer {
+public:
+  PhaseTimer() : start_(std::chrono::steady_clock::now()),
+      alloc_num_(g_alloc_num), alloc_bytes_(g_alloc_bytes) {}
+  void Stop(PhaseStats& stats) const {
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    stats.Add(elapsed.count(), g_alloc_num - alloc_num_,
+              g_alloc_bytes - alloc_bytes_);
+  }
+private:
+  std::chrono::steady_clock::time_point start_;
+  long long alloc_num_;
+  long long alloc_bytes_;
+};
+
+// Nearest-rank percentile of sorted samples.
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  int rank = static_cast<int>(ceil(p / 100 * sorted.size())) - 1;
+  if (rank < 0) rank = 0;
+  if (rank >= sorted.size()) rank = static_cast<int>(sorted.size()) - 1;
+  return sorted[rank];
+}
+
+double Mean(const std::vector<double>& samples) {
+  if (samples.empty()) return 0;
+  double sum = 0;
+  for (int i = 0; i < samples.size(); ++i) {
+    sum += samples[i];
+  }
+  return sum / samples.size();
+}
+
+// "name":{"p50":..,"p90":..,"p99":..,"max":..,"mean":..}
+std::string SummaryJson(const std::string& name, std::vector<double> samples,
+                        const char* unit) {
+  std::sort(samples.begin(), samples.end());
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "\"%s\":{\"min%s\":%.3f,\"p50%s\":%.3f,\"p90%s\":%.3f,"
+           "\"p99%s\":%.3f,\"max%s\":%.3f,\"mean%s\":%.3f}",
+           name.c_str(),
+           unit, samples.empty() ? 0 : samples.front(),
+           unit, Percentile(samples, 50), unit, Percentile(samples, 90),
+           unit, Percentile(samples, 99),
+           unit, samples.empty() ? 0 : samples.back(),
+           unit, Mean(samples));
+  return buf;
+}
+
+// One benchmark configuration.
+class BenchConfig {
+public:
+  std::string dist_;
+  int image_num_;
+  float thresh_;
+};
+
+void PrintPhase(const BenchConfig& config, const std::string& phase,
+                const PhaseStats& stats, const std::string& extra) {
+  if (stats.empty()) return;
+  int reps = static_cast<int>(stats.usec_.size());
+  std::ostringstream line;
+  line << "{\"dist\":\"" << config.dist_ << "\",\"n\":" << config.image_num_
+       << ",\"thresh\":" << config.thresh_ << ",\"phase\":\"" << phase
+       << "\",\"reps\":" << reps << ","
+       << SummaryJson("time", stats.usec_, "_us")
+       << ",\"allocs\":" << stats.alloc_num_ / reps
+       << ",\"alloc_bytes\":" << stats.alloc_bytes_ / reps;
+  if (!extra.empty()) line << "," << extra;
+  line << "}";
+  printf("%s\n", line.str().c_str());
+  fflush(stdout);
+}
+
+bool AlphaLess(const AlphaUnit& m, const AlphaUnit& n) {
+  return m.alpha_ < n.alpha_;
+}
+
+// Recursive versions of CollageTree::CalculateAlpha and CalculatePositions,
+// kept here as the reference for their iterative implementations.
+float RecursiveAlpha(CollageTree& tree, int node) {
+  TreeNode& cur = tree.node(node);
+  if (cur.is_leaf_) return cur.alpha_;
+  float left_alpha = RecursiveAlpha(tree, cur.left_child_);
+  float right_alpha = RecursiveAlpha(tree, cur.right_child_);
+  if (cur.split_type_ == 'v') {
+    cur.alpha_ = left_alpha + right_alpha;
+  } else {
+    cur.alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
+  }
+  return cur.alpha_;
+}
+
+void RecursivePositions(CollageTree& tree, int node) {
+  tree.CalculatePosition(node);
+  const TreeNode& cur = tree.node(node);
+  if (cur.left_child_ != -1) RecursivePositions(tree, cur.left_child_);
+  if (cur.right_child_ != -1) RecursivePositions(tree, cur.right_child_);
+}
+
+// Pre-order code (see CollageTree::Encode) of a caterpillar: every inner
+// node has a leaf on its left, so the depth is the image number.
+void ChainCode(int image_num, std::vector<int>& code) {
+  code.clear();
+  for (int i = 0; i + 1 < image_num; ++i) {
+    code.push_back((i % 2) ? -1 : -2);
+    code.push_back(i);
+  }
+  code.push_back(image_num - 1);
+}
+
+void PlaceChildren(CollageTree& tree, float canvas_width) {
+  TreeNode& root = tree.node(tree.tree_root());
+  root.position_.width_ = canvas_width;
+  root.position_.height_ = canvas_width / root.alpha_;
+  tree.CalculateAllPositions();
+}
+
+double UniformReal(CollageRandom& random) {
+  return (random.Next() + 0.5) / 4294967296.0;
+}
+
+// Synthetic image sizes. All images are 1000 pixels high.
+//   uniform: aspect ratio uniform in [0.5, 2].
+//   bimodal: 3:2 landscapes and 2:3 portraits, with 5% jitter.
+//   heavy:   mostly 4:3 photos with a Pareto tail of panoramas, a third of
+//            them standing (tall), capped at 20:1.
+bool SyntheticSizes(const std::string& dist, int image_num, uint64_t seed,
+                    std::vector<cv::Size>& sizes) {
+  CollageRandom random(seed);
+  sizes.resize(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    double alpha = 1;
+    if (dist == "uniform") {
+      alpha = 0.5 + 1.5 * UniformReal(random);
+    } else if (dist == "bimodal") {
+      alpha = (random.Uniform(2) == 0) ? 1.5 : 2.0 / 3;
+      alpha *= 0.95 + 0.1 * UniformReal(random);
+    } else if (dist == "heavy") {
+      alpha = std::min(4.0 / 3 * pow(UniformReal(random), -1 / 1.5), 20.0);
+      if (random.Uniform(3) == 0) alpha = 1 / alpha;
+    } else {
+      std::cout << "Error: unknown distribution " << dist << std::endl;
+      return false;
+    }
+    sizes[i] = cv::Size(std::max(1, static_cast<int>(1000 * alpha + 0.5)),
+                        1000);
+  }
+  return true;
+}
+
+// Read the image list, probing the sizes the same way CollageAdvanced does.
+bool ListSizes(const std::string& image_list,
+               std::vector<std::string>& paths,
+               std::vector<cv::Size>& sizes) {
+  std::ifstream input_list(image_list.c_str());
+  if (!input_list) {
+    std::cout << "Error: ListSizes" << std::endl;
+    return false;
+  }
+  std::string img_path;
+  while (std::getline(input_list, img_path)) {
+    if (img_path.empty()) continue;
+    int width = 0;
+    int height = 0;
+    if (!ProbeImageSize(img_path, width, height)) {
+      cv::Mat img = cv::imread(img_path.c_str());
+      if (img.empty()) continue;
+      width = img.cols;
+      height = img.rows;
+    }
+    paths.push_back(img_path);
+    sizes.push_back(cv::Size(width, height));
+  }
+  return !paths.empty();
+}
+
+class BenchOptions {
+public:
+  BenchOptions() : expect_alpha_(1), canvas_width_(1000), thread_num_(1),
+      reps_(0), seed_(1), html_path_("/tmp/collage_bench.html"),
+      candidate_num_(64), build_thread_num_(1), approximate_pairs_(true) {
+    int sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+    image_nums_.assign(sizes, sizes + 6);
+    float thresh[] = {1.1f, 1.5f, 2.0f};
+    threshes_.assign(thresh, thresh + 3);
+    dists_.push_back("uniform");
+    dists_.push_back("bimodal");
+    dists_.push_back("heavy");
+  }
+  std::vector<int> image_nums_;
+  std::vector<float> threshes_;
+  std::vector<std::string> dists_;
+  float expect_alpha_;
+  int canvas_width_;
+  int thread_num_;
+  int reps_;             // 0: chosen from the image number.
+  uint64_t seed_;
+  std::string list_;
+  std::string html_path_;
+  int candidate_num_;
+  int build_thread_num_;
+  bool approximate_pairs_;
+};
+
+std::vector<std::string> SplitList(const std::string& value) {
+  std::vector<std::string> items;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) items.push_back(item);
+  }
+  return items;
+}
+
+bool ParseOptions(int argc, const char* argv[], BenchOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if ((arg.compare(0, 2, "--") != 0) || (eq == std::string::npos)) {
+      std::cout << "Error: bad argument " << arg << std::endl;
+      return false;
+    }
+    std::string key = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    std::vector<std::string> items = SplitList(value);
+    if (key == "sizes") {
+      options.image_nums_.clear();
+      for (int j = 0; j < items.size(); ++j) {
+        options.image_nums_.push_back(atoi(items[j].c_str()));
+      }
+    } else if (key == "thresh") {
+      options.threshes_.clear();
+      for (int j = 0; j < items.size(); ++j) {
+        options.threshes_.push_back(static_cast<float>(atof(items[j].c_str())));
+      }
+    } else if (key == "dist") {
+      options.dists_ = items;
+    } else if (key == "reps") {
+      options.reps_ = atoi(value.c_str());
+    } else if (key == "alpha") {
+      options.expect_alpha_ = static_cast<float>(atof(value.c_str()));
+    } else if (key == "width") {
+      options.canvas_width_ = atoi(value.c_str());
+    } else if (key == "threads") {
+      options.thread_num_ = atoi(value.c_str());
+    } else if (key == "seed") {
+      options.seed_ = strtoull(value.c_str(), NULL, 10);
+    } else if (key == "list") {
+      options.list_ = value;
+    } else if (key == "html") {
+      options.html_path_ = value;
+    } else if (key == "candidates") {
+      options.candidate_num_ = atoi(value.c_str());
+    } else if (key == "build_threads") {
+      options.build_thread_num_ = atoi(value.c_str());
+    } else if (key == "approximate_pairs") {
+      options.approximate_pairs_ = (atoi(value.c_str()) != 0);
+    } else {
+      std::cout << "Error: unknown option " << key << std::endl;
+      return false;
+    }
+  }
+  for (int i = 0; i < options.image_nums_.size(); ++i) {
+    if (options.image_nums_[i] < 2) {
+      std::cout << "Error: sizes must be at least 2" << std::endl;
+      return false;
+    }
+  }
+  for (int i = 0; i < options.threshes_.size(); ++i) {
+    if (options.threshes_[i] <= 1) {
+      std::cout << "Error: thresh must be greater than 1" << std::endl;
+      return false;
+    }
+  }
+  return (options.expect_alpha_ > 0) && (options.canvas_width_ > 0) &&
+         (options.thread_num_ >= 1) && (options.candidate_num_ >= 1) &&
+         (options.build_thread_num_ >= 1);
+}
+
+// Run all the phases reps times over one image set.
+void RunConfig(const BenchOptions& options, const BenchConfig& config,
+               const std::vector<std::string>& paths,
+               const std::vector<cv::Size>& sizes, bool render) {
+  int reps = options.reps_;
+  if (reps <= 0) reps = std::max(3, std::min(50, 200000 / config.image_num_));
+
+  // The tree phases run on CollageTree directly, with the same sorted input
+  // CollageAdvanced prepares for it.
+  std::vector<AlphaUnit> alpha_vec(sizes.size());
+  for (int i = 0; i < sizes.size(); ++i) {
+    alpha_vec[i].image_ind_ = i;
+    alpha_vec[i].alpha_ = static_cast<float>(sizes[i].width) / sizes[i].height;
+    alpha_vec[i].alpha_recip_ = static_cast<float>(sizes[i].height) /
+                                sizes[i].width;
+  }
+  std::sort(alpha_vec.begin(), alpha_vec.end(), AlphaLess);
+  std::vector<float> sorted_alpha(alpha_vec.size());
+  for (int i = 0; i < alpha_vec.size(); ++i) {
+    sorted_alpha[i] = alpha_vec[i].alpha_;
+  }
+  AlphaIndex alpha_index;
+  alpha_index.Build(sorted_alpha);
+  alpha_index.set_approximate_pairs(options.approximate_pairs_);
+  CollageAdvanced collage(paths, sizes, options.canvas_width_);
+  collage.set_build_thread_num(options.build_thread_num_);
+  // The trees of the generate phase share one pool, as in the search.
+  std::shared_ptr<WorkerPool> build_pool;
+  if (options.build_thread_num_ > 1)
+    build_pool = std::make_shared<WorkerPool>(options.build_thread_num_);
+  collage.set_approximate_pairs(options.approximate_pairs_);
+
+  PhaseStats generate_stats;
+  PhaseStats adjust_stats;
+  PhaseStats refine_stats;
+  PhaseStats position_stats;
+  PhaseStats alpha_stats;
+  PhaseStats alpha_recursive_stats;
+  PhaseStats position_recursive_stats;
+  PhaseStats chain_stats;
+  PhaseStats table_stats;
+  PhaseStats batch_stats;
+  PhaseStats batch_scalar_stats;
+  PhaseStats create_stats;
+  PhaseStats html_stats;
+  PhaseStats render_stats;
+  std::vector<double> adjust_iters;
+  std::vector<double> tree_generations;
+  std::vector<double> adjust_iterations;
+  int adjust_in_range = 0;
+  int refine_in_range = 0;
+  int table_in_range = 0;
+  int batch_mismatches = 0;
+  // TreeBatch holds two floats per node and candidate, skip it when that
+  // gets out of hand.
+  bool run_batch = static_cast<long long>(config.image_num_) *
+                   options.candidate_num_ <= (16 << 20);
+  int create_failures = 0;
+  float lower_bound = options.expect_alpha_ / config.thresh_;
+  float upper_bound = options.expect_alpha_ * config.thresh_;
+  uint64_t seed = options.seed_;
+
+  for (int r = 0; r < reps; ++r) {
+    uint64_t rep_seed = CollageRandom::SplitMix64(seed);
+    // One guided tree generation and its aspect ratio.
+    CollageTree tree;
+    tree.Init(&alpha_vec, alpha_index, rep_seed);
+    tree.set_build_pool(build_pool);
+    {
+      PhaseTimer timer;
+      tree.GenerateTree(options.expect_alpha_);
+      tree.CalculateAlpha(tree.tree_root());
+      timer.Stop(generate_stats);
+    }
+    // Root aspect ratios of candidate_num_ variants of that tree with random
+    // split types, all at once and then one by one.
+    if (run_batch) {
+      CollageRandom random(rep_seed);
+      TreeBatch batch;
+      batch.Init(tree, options.candidate_num_);
+      for (int c = 0; c < batch.candidate_num(); ++c) {
+        for (int i = 0; i < batch.inner_nodes().size(); ++i) {
+          batch.set_split_type(c, i, random.Uniform(2) ? 'v' : 'h');
+        }
+      }
+      std::vector<float> root_alphas;
+      float ratio = 0;
+      {
+        PhaseTimer timer;
+        batch.Evaluate(root_alphas);
+        TreeBatch::Closest(root_alphas, options.expect_alpha_, ratio);
+        timer.Stop(batch_stats);
+      }
+      CollageTree scalar_tree = tree;
+      std::vector<float> scalar_alphas(batch.candidate_num());
+      {
+        PhaseTimer timer;
+        for (int c = 0; c < batch.candidate_num(); ++c) {
+          batch.Store(c, scalar_tree);
+          scalar_alphas[c] = scalar_tree.CalculateAlpha(scalar_tree.tree_root());
+        }
+        TreeBatch::Closest(scalar_alphas, options.expect_alpha_, ratio);
+        timer.Stop(batch_scalar_stats);
+      }
+      if (scalar_alphas != root_alphas) ++batch_mismatches;
+    }
+    // Adjustment of that tree alone, without re-generation.
+    {
+      PhaseTimer timer;
+      float canvas_alpha = tree.node(tree.tree_root()).alpha_;
+      int iter = 0;
+      while (((canvas_alpha < lower_bound) || (canvas_alpha > upper_bound)) &&
+             (iter < MAX_ITER_NUM)) {
+        tree.node(tree.tree_root()).alpha_expect_ = options.expect_alpha_;
+        bool changed = tree.AdjustAlpha(tree.tree_root(), config.thresh_);
+        canvas_alpha = tree.UpdateAlpha();
+        ++iter;
+        if (!changed) break;
+      }
+      timer.Stop(adjust_stats);
+      adjust_iters.push_back(iter);
+      if ((canvas_alpha >= lower_bound) && (canvas_alpha <= upper_bound))
+        ++adjust_in_range;
+    }
+    // Local search from where the adjustment stopped, on a copy.
+    {
+      CollageTree refined = tree;
+      PhaseTimer timer;
+      bool in_range = refined.Refine(options.expect_alpha_, config.thresh_,
+                                     REFINE_MOVE_NUM * config.image_num_);
+      timer.Stop(refine_stats);
+      if (in_range) ++refine_in_range;
+    }
+    // Tile positions.
+    {
+      PhaseTimer timer;
+      PlaceChildren(tree, static_cast<float>(options.canvas_width_));
+      timer.Stop(position_stats);
+    }
+    // Full aspect ratio passes over the adjusted tree, iterative and
+    // recursive.
+    {
+      PhaseTimer timer;
+      tree.CalculateAlpha(tree.tree_root());
+      timer.Stop(alpha_stats);
+    }
+    {
+      PhaseTimer timer;
+      RecursiveAlpha(tree, tree.tree_root());
+      timer.Stop(alpha_recursive_stats);
+    }
+    {
+      TreeNode& root = tree.node(tree.tree_root());
+      PhaseTimer timer;
+      if (root.left_child_ != -1) RecursivePositions(tree, root.left_child_);
+      if (root.right_child_ != -1) RecursivePositions(tree, root.right_child_);
+      timer.Stop(position_recursive_stats);
+    }
+    // The deepest possible tree, only the iterative traversals survive it.
+    {
+      std::vector<int> code;
+      ChainCode(config.image_num_, code);
+      CollageTree chain;
+      chain.Init(&alpha_vec, alpha_index, rep_seed);
+      PhaseTimer timer;
+      chain.Decode(code);
+      chain.CalculateAlpha(chain.tree_root());
+      PlaceChildren(chain, static_cast<float>(options.canvas_width_));
+      timer.Stop(chain_stats);
+    }
+    // The closest entry of the topology table, for small image numbers.
+    if (config.image_num_ <= kMaxTableImages) {
+      float table_alpha = 0;
+      {
+        PhaseTimer timer;
+        TopologyTable::Closest(config.image_num_, &sorted_alpha[0],
+                               options.expect_alpha_, table_alpha);
+        timer.Stop(table_stats);
+      }
+      if ((table_alpha >= lower_bound) && (table_alpha <= upper_bound))
+        ++table_in_range;
+    }
+    // The complete search, with its retries.
+    int tree_generation = 0;
+    int adjust_iteration = 0;
+    int result = -1;
+    collage.set_random_seed(rep_seed);
+    {
+      PhaseTimer timer;
+      result = collage.CreateCollage(options.expect_alpha_, config.thresh_,
+                                     tree_generation, adjust_iteration,
+                                     options.thread_num_);
+      timer.Stop(create_stats);
+    }
+    tree_generations.push_back(tree_generation);
+    adjust_iterations.push_back(adjust_iteration);
+    if (result == -1) {
+      ++create_failures;
+    } else {
+      PhaseTimer html_timer;
+      collage.OutputCollageHtml(options.html_path_);
+      html_timer.Stop(html_stats);
+      if (render) {
+        PhaseTimer render_timer;
+        collage.OutputCollageImage();
+        render_timer.Stop(render_stats);
+      }
+    }
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), ",\"in_range\":%d", adjust_in_range);
+  PrintPhase(config, "generate", generate_stats, "");
+  PrintPhase(config, "adjust", adjust_stats,
+             SummaryJson("iterations", adjust_iters, "") + buf);
+  snprintf(buf, sizeof(buf), "\"in_range\":%d", refine_in_range);
+  PrintPhase(config, "refine", refine_stats, buf);
+  PrintPhase(config, "positions", position_stats, "");
+  PrintPhase(config, "positions_recursive", position_recursive_stats, "");
+  PrintPhase(config, "alpha", alpha_stats, "");
+  PrintPhase(config, "alpha_recursive", alpha_recursive_stats, "");
+  PrintPhase(config, "chain", chain_stats, "");
+  snprintf(buf, sizeof(buf), "\"in_range\":%d", table_in_range);
+  PrintPhase(config, "table", table_stats, buf);
+  snprintf(buf, sizeof(buf), ",\"candidates\":%d,\"mismatches\":%d",
+           options.candidate_num_, batch_mismatches);
+  PrintPhase(config, "batch", batch_stats, buf + 1);
+  PrintPhase(config, "batch_scalar", batch_scalar_stats, buf + 1);
+  snprintf(buf, sizeof(buf), ",\"failures\":%d", create_failures);
+  PrintPhase(config, "create", create_stats,
+             SummaryJson("total_tree_generation", tree_generations, "") + "," +
+             SummaryJson("total_adjust_iteration", adjust_iterations, "") +
+             buf);
+  PrintPhase(config, "html", html_stats, "");
+  PrintPhase(config, "render", render_stats, "");
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cout << "Usage: collage_bench [--sizes=10,100,...] "
+              << "[--thresh=1.1,1.5,2] [--dist=uniform,bimodal,heavy] "
+              << "[--reps=n] [--alpha=1] [--width=1000] [--threads=1] "
+              << "[--seed=n] [--list=image_list] [--html=path] "
+              << "[--candidates=k] [--build_threads=1] "
+              << "[--approximate_pairs=1]" << std::endl;
+    return 1;
+  }
+  // The library diagnostics go to stderr, so that stdout holds nothing but
+  // the JSON lines.
+  CollageLog::set_sink(&std::cerr);
+
+  if (!options.list_.empty()) {
+    std::vector<std::string> paths;
+    std::vector<cv::Size> sizes;
+    if (!ListSizes(options.list_, paths, sizes)) return 1;
+    for (int t = 0; t < options.threshes_.size(); ++t) {
+      BenchConfig config;
+      config.dist_ = options.list_;
+      config.image_num_ = static_cast<int>(paths.size());
+      config.thresh_ = options.threshes_[t];
+      RunConfig(options, config, paths, sizes, true);
+    }
+    return 0;
+  }
+
+  for (int d = 0; d < options.dists_.size(); ++d) {
+    for (int n = 0; n < options.image_nums_.size(); ++n) {
+      int image_num = options.image_nums_[n];
+      std::vector<cv::Size> sizes;
+      if (!SyntheticSizes(options.dists_[d], image_num,
+                          options.seed_ + image_num, sizes)) return 1;
+      std::vector<std::string> paths(image_num);
+      for (int i = 0; i < image_num; ++i) {
+        std::ostringstream path;
+        path << "synthetic/" << i << ".jpg";
+        paths[i] = path.str();
+      }
+      for (int t = 0; t < options.threshes_.size(); ++t) {
+        BenchConfig config;
+        config.dist_ = options.dists_[d];
+        config.image_num_ = image_num;
+        config.thresh_ = options.threshes_[t];
+        RunConfig(options, config, paths, sizes, false);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+//
+//  collage_index.cc
+//  wu_collage_advanced
+//
+//  Build or refresh an image size index over directory trees.
+//
+//  Usage: collage_index index_file dir [dir ...] [--threads=n]
+//
+//  If index_file exists, the entries of unchanged files are taken over from
+//  it and only new or modified images are probed.
+//
+
+#include "image_index.h"
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+int main(int argc, const char* argv[]) {
+  std::string index_path;
+  std::vector<std::string> roots;
+  int thread_num = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      thread_num = atoi(arg.c_str() + 10);
+    } else if (index_path.empty()) {
+      index_path = arg;
+    } else {
+      roots.push_back(arg);
+    }
+  }
+  if (index_path.empty() || roots.empty()) {
+    std::cout << "Usage: collage_index index_file dir [dir ...] [--threads=n]"
+              << std::endl;
+    return -1;
+  }
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  ImageIndex previous;
+  bool refresh = previous.Open(index_path);
+  int probed_num = 0;
+  if (!ImageIndex::Build(roots, index_path, thread_num,
+                         refresh ? &previous : NULL, &probed_num)) {
+    return -1;
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  ImageIndex index;
+  if (!index.Open(index_path)) return -1;
+  std::cout << (refresh ? "refreshed " : "built ") << index_path << ": "
+            << index.entry_num() << " images, " << probed_num << " probed, "
+            << elapsed.count() << " ms" << std::endl;
+  return 0;
+}
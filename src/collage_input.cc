@@ -0,0 +1,107 @@
+//
+//  collage_input.cc
+//  wu_collage_advanced
+//
+//  Collage images given as files, encoded buffers, decoded images or handles.
+//
+
+#include "collage_input.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "image_probe.h"
+#include <iostream>
+
+CollageInput CollageInput::FromPath(const std::string& path) {
+  CollageInput input;
+  input.kind_ = kPath;
+  input.name_ = path;
+  return input;
+}
+
+CollageInput CollageInput::FromBuffer(const void* data, size_t size,
+                                      const std::string& name) {
+  CollageInput input;
+  input.kind_ = kBuffer;
+  input.name_ = name;
+  input.data_ = static_cast<const unsigned char*>(data);
+  input.size_ = size;
+  return input;
+}
+
+CollageInput CollageInput::FromMat(const cv::Mat& image,
+                                   const std::string& name) {
+  CollageInput input;
+  input.kind_ = kMat;
+  input.name_ = name;
+  input.image_ = image;
+  return input;
+}
+
+CollageInput CollageInput::FromHandle(int width, int height, uint64_t handle,
+                                      const std::string& name) {
+  CollageInput input;
+  input.kind_ = kHandle;
+  input.name_ = name;
+  input.handle_ = handle;
+  input.width_ = width;
+  input.height_ = height;
+  return input;
+}
+
+bool CollageInput::ReadSize(const ImageIndex* image_index,
+                            int& width, int& height) const {
+  if (kind_ == kPath) {
+    if ((image_index != NULL) && image_index->Lookup(name_, width, height))
+      return true;
+    if (ProbeImageSize(name_, width, height)) return true;
+    StatTimer timer(kStatDecode);
+    cv::Mat img = cv::imread(name_.c_str());
+    if (img.empty()) return false;
+    width = img.cols;
+    height = img.rows;
+    return true;
+  } else if (kind_ == kBuffer) {
+    if (ProbeImageSize(data_, size_, width, height)) return true;
+    if ((data_ == NULL) || (size_ == 0)) return false;
+    StatTimer timer(kStatDecode);
+    cv::Mat img = cv::imdecode(cv::Mat(1, static_cast<int>(size_), CV_8UC1,
+                                       const_cast<unsigned char*>(data_)),
+                               cv::IMREAD_COLOR);
+    if (img.empty()) return false;
+    width = img.cols;
+    height = img.rows;
+    return true;
+  } else if (kind_ == kMat) {
+    width = image_.cols;
+    height = image_.rows;
+  } else {
+    width = width_;
+    height = height_;
+  }
+  return (width > 0) && (height > 0);
+}
+
+cv::Mat CollageInput::Read(const cv::Size& tile_size, TileCache* tile_cache,
+                           const PixelProvider& provider) const {
+  if (kind_ == kPath) {
+    return ReadTileImage(name_, tile_size, tile_cache);
+  } else if (kind_ == kBuffer) {
+    if ((data_ == NULL) || (size_ == 0)) return cv::Mat();
+    int width = 0;
+    int height = 0;
+    ProbeImageSize(data_, size_, width, height);
+    // The Mat header wraps the buffer, nothing is copied before decoding.
+    cv::Mat encoded(1, static_cast<int>(size_), CV_8UC1,
+                    const_cast<unsigned char*>(data_));
+    StatTimer timer(kStatDecode);
+    return cv::imdecode(encoded,
+                        ReducedReadFlag(cv::Size(width, height), tile_size));
+  } else if (kind_ == kMat) {
+    return image_;
+  }
+  if (!provider) {
+    COLLAGE_LOG(kLogError) << "no PixelProvider for " << name_;
+    return cv::Mat();
+  }
+  return provider(handle_, tile_size);
+}
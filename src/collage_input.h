@@ -0,0 +1,83 @@
+//
+//  collage_input.h
+//  wu_collage_advanced
+//
+//  Collage images given as files, encoded buffers, decoded images or handles.
+//
+
+#ifndef __wu_collage_advanced__collage_input__
+#define __wu_collage_advanced__collage_input__
+
+#include "image_index.h"
+#include "tile_cache.h"
+#include <functional>
+#include <opencv2/opencv.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Returns the pixels of the image behind a handle, at least tile_size if the
+// source allows (larger is fine, it is resized down), or an empty Mat. It is
+// called from several threads at once.
+typedef std::function<cv::Mat(uint64_t handle, const cv::Size& tile_size)>
+    PixelProvider;
+
+// One image of a collage. Nothing is copied: a buffer must stay valid and
+// unchanged while the collage uses it, and a Mat shares its pixels.
+// The name is only used in the HTML and JSON outputs.
+class CollageInput {
+public:
+  enum Kind {
+    kPath,
+    kBuffer,
+    kMat,
+    kHandle
+  };
+
+  // An image file, read with cv::imread or through the tile cache.
+  static CollageInput FromPath(const std::string& path);
+  // An encoded image (any format cv::imdecode reads) of size bytes.
+  static CollageInput FromBuffer(const void* data, size_t size,
+                                 const std::string& name = "");
+  // A decoded image, BGR or BGRA or gray, 8-bit, 16-bit or floating point
+  // in [0, 1]. It is converted to 8-bit BGR tile by tile when rendered.
+  static CollageInput FromMat(const cv::Mat& image,
+                              const std::string& name = "");
+  // An image of known size whose pixels come from the PixelProvider of the
+  // collage, only when it is rendered.
+  static CollageInput FromHandle(int width, int height, uint64_t handle,
+                                 const std::string& name = "");
+
+  // Read the image size: from the index or the file header for a path, the
+  // header for a buffer, and with a full decode when these fail.
+  // Returns false if the image cannot be read.
+  bool ReadSize(const ImageIndex* image_index, int& width, int& height) const;
+  // The pixels for a tile of tile_size. tile_cache is only used for paths
+  // and provider only for handles; either may be empty.
+  cv::Mat Read(const cv::Size& tile_size, TileCache* tile_cache,
+               const PixelProvider& provider) const;
+
+  Kind kind() const {
+    return kind_;
+  }
+  // The path of a file, the given name otherwise.
+  const std::string& name() const {
+    return name_;
+  }
+
+private:
+  CollageInput() : kind_(kPath), data_(NULL), size_(0), handle_(0),
+                   width_(0), height_(0) {}
+
+  Kind kind_;
+  std::string name_;
+  const unsigned char* data_;
+  size_t size_;
+  cv::Mat image_;
+  uint64_t handle_;
+  // Known size of a handle.
+  int width_;
+  int height_;
+};
+
+#endif /* defined(__wu_collage_advanced__collage_input__) */
@@ -0,0 +1,1565 @@
+//
+//  collage_layout.cc
+//  wu_collage_advanced
+//
+//  Collage layout from image aspect ratios only, without OpenCV.
+//
+
+#include "collage_layout.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "topology_table.h"
+#include "tree_batch.h"
+#include <algorithm>
+#include <chrono>
+#include <assert.h>
+#include <condition_variable>
+#include <limits.h>
+#include <math.h>
+#include <mutex>
+#include <thread>
+
+bool less_than(AlphaUnit m, AlphaUnit n) {
+  return m.alpha_ < n.alpha_;
+}
+
+namespace {
+
+// How far (>= 1, as a factor) the aspect ratio of tree is from expect_alpha.
+float AlphaRatio(const CollageTree& tree, float expect_alpha) {
+  float alpha = tree.node(tree.tree_root()).alpha_;
+  return (alpha > expect_alpha) ? alpha / expect_alpha : expect_alpha / alpha;
+}
+
+// Copy tree to best_tree if it is closer to expect_alpha than best_ratio, or
+// if best_tree is still empty.
+void KeepBest(const CollageTree& tree, float expect_alpha,
+              CollageTree& best_tree, float& best_ratio) {
+  float ratio = AlphaRatio(tree, expect_alpha);
+  if ((best_tree.tree_root() != -1) && (ratio >= best_ratio)) return;
+  best_tree = tree;
+  best_ratio = ratio;
+}
+
+bool SameRect(const FloatRect& a, const FloatRect& b) {
+  return (a.x_ == b.x_) && (a.y_ == b.y_) && (a.width_ == b.width_) &&
+         (a.height_ == b.height_);
+}
+
+}  // namespace
+
+bool CollageLayout::SearchLimit::Reached() const {
+  if ((cancel_ != NULL) && *cancel_) return true;
+  return std::chrono::steady_clock::now() >= deadline_;
+}
+
+void CollageLayout::AddImage(int width, int height) {
+  AlphaUnit new_unit;
+  new_unit.image_ind_ = static_cast<int>(image_alpha_vec_.size());
+  new_unit.alpha_ = static_cast<float>(width) / height;
+  new_unit.alpha_recip_ = static_cast<float>(height) / width;
+  image_alpha_vec_.push_back(new_unit);
+}
+
+void CollageLayout::AddImage(float alpha) {
+  assert(alpha > 0);
+  AlphaUnit new_unit;
+  new_unit.image_ind_ = static_cast<int>(image_alpha_vec_.size());
+  new_unit.alpha_ = alpha;
+  new_unit.alpha_recip_ = 1 / alpha;
+  image_alpha_vec_.push_back(new_unit);
+}
+
+void CollageLayout::SetAlphas(const float* alphas, int image_num) {
+  image_alpha_vec_.clear();
+  image_alpha_vec_.reserve(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    AddImage(alphas[i]);
+  }
+}
+
+// Create one tree, without adjustment.
+bool CollageLayout::CreateLayout(const float expect_alpha) {
+  assert(expect_alpha > 0);
+  
+  // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
+  BuildAlphaIndex();
+  // Step 2: Generate a guided binary tree by using divide-and-conquer.
+  uint64_t seed = random_seed_;
+  tree_.Init(&image_alpha_vec_, alpha_index_, CollageRandom::SplitMix64(seed));
+  tree_.set_build_pool(build_pool_);
+  tree_.GenerateTree(expect_alpha);
+  // Step 3: Calculate the actual aspect ratio for the generated collage.
+  tree_.CalculateAlpha(tree_.tree_root());
+  alpha_update_num_ = tree_.alpha_update_num();
+  // Step 4: Get the position for the nodes in the binary tree.
+  CalculateCanvas();
+  return true;
+}
+
+// If we use CreateLayout(expect_alpha), the generated collage may have strange aspect ratio such as
+// too big or too small, which seems to be difficult to be shown. We let the user to
+// input their expected aspect ratio and fast adjust to make the result aspect ratio
+// close to the user defined one.
+// The thresh here controls the closeness between the result aspect ratio and the expect
+// aspect ratio. e.g. expect_alpha is 1, thresh is 2. The result aspect ratio is around
+// [1 / 2, 1 * 2] = [0.5, 2].
+// We also define MAX_ITER_NUM = 100,
+// If max iteration number is reached and we cannot find a good result aspect ratio,
+// this function returns -1.
+int CollageLayout::CreateLayout(const float expect_alpha,
+                                const float thresh,
+                                int& total_tree_generation,
+                                int& total_adjust_iteration,
+                                int thread_num,
+                                bool keep_closest) {
+  return SearchLayout(expect_alpha, thresh, total_tree_generation,
+                      total_adjust_iteration, thread_num, keep_closest, NULL);
+}
+
+// Same search, bounded by a deadline (and cancel). Every thread keeps a copy
+// of the closest tree it has seen, so there is a result to return when time
+// runs out. The deadline is checked between tree generations and adjustment
+// iterations, a single step is never interrupted.
+int CollageLayout::CreateLayoutWithin(const float expect_alpha,
+                                      const float thresh,
+                                      long long time_budget_us,
+                                      int& total_tree_generation,
+                                      int& total_adjust_iteration,
+                                      int thread_num,
+                                      const std::atomic<bool>* cancel) {
+  SearchLimit limit;
+  limit.deadline_ = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(time_budget_us);
+  limit.cancel_ = cancel;
+  return SearchLayout(expect_alpha, thresh, total_tree_generation,
+                      total_adjust_iteration, thread_num, false, &limit);
+}
+
+int CollageLayout::SearchLayout(const float expect_alpha,
+                                const float thresh,
+                                int& total_tree_generation,
+                                int& total_adjust_iteration,
+                                int thread_num,
+                                bool keep_closest,
+                                const SearchLimit* limit) {
+  assert(thresh > 1);
+  assert(expect_alpha > 0);
+  assert(thread_num >= 1);
+  // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
+  BuildAlphaIndex();
+  if (use_topology_table_ && UseTopologyTable(expect_alpha, thresh)) {
+    total_tree_generation = 0;
+    total_adjust_iteration = 0;
+    return 1;
+  }
+  LayoutKey key;
+  if (layout_cache_ != NULL) {
+    std::vector<float> sorted_alpha(image_alpha_vec_.size());
+    for (int i = 0; i < image_alpha_vec_.size(); ++i) {
+      sorted_alpha[i] = image_alpha_vec_[i].alpha_;
+    }
+    key = LayoutKey(sorted_alpha, canvas_width_, expect_alpha, thresh);
+    if (UseCachedLayout(key, expect_alpha, thresh)) {
+      total_tree_generation = 0;
+      total_adjust_iteration = 0;
+      return 1;
+    }
+  }
+  // Step 2: Search trees, each with its own node pool and random state.
+  std::atomic<int> tree_gene_budget(MAX_TREE_GENE_NUM);
+  std::atomic<bool> stop(false);
+  std::vector<CollageTree> trees(thread_num);
+  std::vector<int> tree_gene_counter(thread_num, 0);
+  std::vector<int> iter_counter(thread_num, 0);
+  std::vector<char> found(thread_num, 0);
+  // Closest tree of every thread, only kept under a limit.
+  std::vector<CollageTree> best_trees((limit != NULL) ? thread_num : 0);
+  uint64_t seed = random_seed_;
+  for (int t = 0; t < thread_num; ++t) {
+    trees[t].Init(&image_alpha_vec_, alpha_index_,
+                  CollageRandom::SplitMix64(seed));
+    trees[t].set_build_pool(build_pool_);
+  }
+  if (thread_num == 1) {
+    found[0] = SearchTree(trees[0], expect_alpha, thresh, tree_gene_budget,
+                          stop, limit,
+                          (limit != NULL) ? &best_trees[0] : NULL,
+                          tree_gene_counter[0], iter_counter[0]);
+  } else {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_num; ++t) {
+      workers.push_back(std::thread([&, t]() {
+        found[t] = SearchTree(trees[t], expect_alpha, thresh,
+                              tree_gene_budget, stop, limit,
+                              (limit != NULL) ? &best_trees[t] : NULL,
+                              tree_gene_counter[t], iter_counter[t]);
+        // Cancel the other searches as soon as one of them succeeds.
+        if (found[t] && !keep_closest) stop = true;
+      }));
+    }
+    for (int t = 0; t < thread_num; ++t) {
+      workers[t].join();
+    }
+  }
+  
+  // Step 3: Keep the successful tree closest to expect_alpha.
+  int best = -1;
+  float best_ratio = 0;
+  total_tree_generation = 0;
+  total_adjust_iteration = 0;
+  alpha_update_num_ = 0;
+  for (int t = 0; t < thread_num; ++t) {
+    total_tree_generation += tree_gene_counter[t];
+    total_adjust_iteration += iter_counter[t];
+    alpha_update_num_ += trees[t].alpha_update_num();
+    if (!found[t]) continue;
+    float ratio = AlphaRatio(trees[t], expect_alpha);
+    if ((best == -1) || (ratio < best_ratio)) {
+      best = t;
+      best_ratio = ratio;
+    }
+  }
+  int result = 1;
+  if ((best == -1) && (limit != NULL)) {
+    // Out of time: fall back to the closest tree any thread has seen.
+    for (int t = 0; t < thread_num; ++t) {
+      if (best_trees[t].tree_root() == -1) continue;
+      float ratio = AlphaRatio(best_trees[t], expect_alpha);
+      if ((best == -1) || (ratio < best_ratio)) {
+        best = t;
+        best_ratio = ratio;
+      }
+    }
+    if (best != -1) {
+      std::swap(trees[best], best_trees[best]);
+      result = 0;
+    }
+  }
+  if (best == -1) {
+    COLLAGE_LOG(kLogWarning) << "collage generation failed after "
+                             << total_tree_generation << " trees";
+    return -1;
+  }
+  // std::cout << "Canvas generation success!" << std::endl;
+  // std::cout << "Tree generation number is: " << tree_gene_counter << std::endl;
+  // std::cout << "Total iteration number is: " << total_iter_counter << std::endl;
+  // After adjustment, set the position for all the tile images.
+  std::swap(tree_, trees[best]);
+  CalculateCanvas();
+  if ((result == 1) && (layout_cache_ != NULL)) CacheLayout(key);
+  return result;
+}
+
+bool CollageLayout::UseCachedLayout(const LayoutKey& key, float expect_alpha,
+                                    float thresh) {
+  std::vector<int> code;
+  if (!layout_cache_->Get(key, code)) return false;
+  uint64_t seed = random_seed_;
+  tree_.Init(&image_alpha_vec_, alpha_index_, CollageRandom::SplitMix64(seed));
+  if (!tree_.Decode(code)) return false;
+  // The cached tree was found for aspect ratios within a quantization step
+  // of these ones, check it still meets thresh with the real ones.
+  float alpha = tree_.CalculateAlpha(tree_.tree_root());
+  alpha_update_num_ = tree_.alpha_update_num();
+  if ((alpha < expect_alpha / thresh) || (alpha > expect_alpha * thresh))
+    return false;
+  CalculateCanvas();
+  return true;
+}
+
+// The table is searched whole, so the result only depends on the aspect
+// ratios: no random state is drawn.
+bool CollageLayout::UseTopologyTable(float expect_alpha, float thresh) {
+  int image_num = static_cast<int>(image_alpha_vec_.size());
+  if ((image_num < 1) || (image_num > kMaxTableImages)) return false;
+  float sorted_alphas[kMaxTableImages];
+  for (int i = 0; i < image_num; ++i) {
+    sorted_alphas[i] = image_alpha_vec_[i].alpha_;
+  }
+  float alpha = 0;
+  int best = TopologyTable::Closest(image_num, sorted_alphas, expect_alpha,
+                                    alpha);
+  if ((best == -1) || (alpha < expect_alpha / thresh) ||
+      (alpha > expect_alpha * thresh))
+    return false;
+  std::vector<int> code;
+  TopologyTable::Code(TopologyTable::Entries(image_num)[best], image_num,
+                      code);
+  uint64_t seed = random_seed_;
+  tree_.Init(&image_alpha_vec_, alpha_index_, CollageRandom::SplitMix64(seed));
+  if (!tree_.Decode(code)) return false;
+  tree_.CalculateAlpha(tree_.tree_root());
+  alpha_update_num_ = tree_.alpha_update_num();
+  CalculateCanvas();
+  return true;
+}
+
+void CollageLayout::CacheLayout(const LayoutKey& key) {
+  std::vector<int> ranks(image_alpha_vec_.size());
+  for (int i = 0; i < image_alpha_vec_.size(); ++i) {
+    ranks[image_alpha_vec_[i].image_ind_] = i;
+  }
+  std::vector<int> code;
+  tree_.Encode(ranks, code);
+  layout_cache_->Put(key, code);
+}
+
+bool CollageLayout::SearchTree(CollageTree& tree,
+                               float expect_alpha,
+                               float thresh,
+                               std::atomic<int>& tree_gene_budget,
+                               const std::atomic<bool>& stop,
+                               const SearchLimit* limit,
+                               CollageTree* best_tree,
+                               int& tree_gene_counter,
+                               int& total_iter_counter) {
+  float lower_bound = expect_alpha / thresh;
+  float upper_bound = expect_alpha * thresh;
+  total_iter_counter = 1;
+  int iter_counter = 1;
+  tree_gene_counter = 0;
+  // Scratch space of PickCuts, reused by every generated tree.
+  TreeBatch batch;
+  // Step 1: Generate a guided binary tree by using divide-and-conquer.
+  if (tree_gene_budget.fetch_sub(1) <= 0) return false;
+  tree.GenerateTree(expect_alpha);
+  ++tree_gene_counter;
+  // Step 2: Calculate the actual aspect ratio for the generated collage.
+  float canvas_alpha = tree.CalculateAlpha(tree.tree_root());
+  if ((canvas_alpha < lower_bound) || (canvas_alpha > upper_bound))
+    canvas_alpha = tree.PickCuts(expect_alpha, cut_candidate_num_, batch);
+  float best_ratio = 0;
+  if (best_tree != NULL) KeepBest(tree, expect_alpha, *best_tree, best_ratio);
+  // Closest ratio of the current tree, and the iterations since it improved.
+  float tree_ratio = AlphaRatio(tree, expect_alpha);
+  int stall_counter = 0;
+  
+  while ((canvas_alpha < lower_bound) || (canvas_alpha > upper_bound)) {
+    if (stop) return false;
+    if ((limit != NULL) && limit->Reached()) return false;
+    // Call the following function to adjust the aspect ratio from top to down.
+    
+    /*************************************************************************/
+    bool changed = false;
+    {
+      StatTimer timer(kStatAdjust);
+      tree.node(tree.tree_root()).alpha_expect_ = expect_alpha;
+      changed = tree.AdjustAlpha(tree.tree_root(), thresh);
+      // Calculate actual aspect ratio again, only along the changed paths.
+      canvas_alpha = tree.UpdateAlpha();
+    }
+    if (best_tree != NULL) KeepBest(tree, expect_alpha, *best_tree, best_ratio);
+    ++iter_counter;
+    ++total_iter_counter;
+    float ratio = AlphaRatio(tree, expect_alpha);
+    if (ratio < tree_ratio) {
+      tree_ratio = ratio;
+      stall_counter = 0;
+    } else {
+      ++stall_counter;
+    }
+    // With refinement, an adjustment that keeps oscillating without getting
+    // closer is not worth the remaining iterations.
+    bool stalled = use_refinement_ && (stall_counter >= REFINE_STALL_NUM);
+    if ((iter_counter > MAX_ITER_NUM) || (!changed) || stalled) {
+      if (stalled) {
+        COLLAGE_LOG(kLogDebug) << "no progress after iteration: "
+                               << iter_counter;
+      } else if (changed) {
+        COLLAGE_LOG(kLogDebug) << "max iteration number reached...";
+      } else {
+        COLLAGE_LOG(kLogDebug) << "tree structure unchanged after iteration: "
+                               << iter_counter;
+      }
+      iter_counter = 1;
+      ++total_iter_counter;
+      // Local moves around the stalled tree are much cheaper than a new
+      // tree, and keep the progress made so far.
+      if (use_refinement_) {
+        bool refined = false;
+        {
+          StatTimer timer(kStatRefine);
+          refined = tree.Refine(expect_alpha, thresh,
+                                REFINE_MOVE_NUM *
+                                static_cast<int>(tree.tree_leaves().size()));
+        }
+        canvas_alpha = tree.node(tree.tree_root()).alpha_;
+        if (best_tree != NULL) KeepBest(tree, expect_alpha, *best_tree, best_ratio);
+        if (refined) break;
+      }
+      // We should generate binary tree again
+     /*************************************************************************/
+
+      // The budget is shared by all the searching threads.
+      if ((limit != NULL) && limit->Reached()) return false;
+      if (tree_gene_budget.fetch_sub(1) <= 0) return false;
+      tree.GenerateTree(expect_alpha);
+      canvas_alpha = tree.CalculateAlpha(tree.tree_root());
+      if ((canvas_alpha < lower_bound) || (canvas_alpha > upper_bound))
+        canvas_alpha = tree.PickCuts(expect_alpha, cut_candidate_num_, batch);
+      if (best_tree != NULL) KeepBest(tree, expect_alpha, *best_tree, best_ratio);
+      ++tree_gene_counter;
+      tree_ratio = AlphaRatio(tree, expect_alpha);
+      stall_counter = 0;
+    }
+  }
+  return true;
+}
+
+// Set the canvas size from the root's aspect ratio, then get the position
+// for the nodes in the binary tree.
+void CollageLayout::CalculateCanvas() {
+  StatTimer timer(kStatPositions);
+  PlaceRoot();
+  tree_.CalculateAllPositions();
+}
+
+void CollageLayout::PlaceRoot() {
+  TreeNode& root = tree_.node(tree_.tree_root());
+  canvas_alpha_ = root.alpha_;
+  // Converting a height beyond the int range would be undefined.
+  float height = canvas_width_ / canvas_alpha_;
+  canvas_height_ = (height < INT_MAX) ? static_cast<int>(height) : INT_MAX;
+  root.position_.x_ = 0;
+  root.position_.y_ = 0;
+  root.position_.height_ = canvas_height_;
+  root.position_.width_ = canvas_width_;
+}
+
+bool CollageLayout::InsertImage(int width, int height,
+                                std::vector<int>& changed_images) {
+  return InsertImage(static_cast<float>(width) / height, changed_images);
+}
+
+// Every leaf and cut is tried, each costing one walk to the root. The
+// candidate keeping the root aspect ratio closest to the current one keeps
+// the canvas height, and so most of the tiles, where they are.
+bool CollageLayout::InsertImage(float alpha, std::vector<int>& changed_images) {
+  assert(alpha > 0);
+  if (canvas_alpha_ == -1) {
+    COLLAGE_LOG(kLogError) << "InsertImage before CreateLayout";
+    return false;
+  }
+  const std::vector<int>& leaves = tree_.tree_leaves();
+  int best_leaf = -1;
+  char best_split_type = 'v';
+  float best_change = 0;
+  for (int i = 0; i < leaves.size(); ++i) {
+    for (int j = 0; j < 2; ++j) {
+      char split_type = (j == 0) ? 'v' : 'h';
+      float change = fabs(log(tree_.InsertedRootAlpha(leaves[i], split_type,
+                                                      alpha) / canvas_alpha_));
+      if ((best_leaf == -1) || (change < best_change)) {
+        best_leaf = leaves[i];
+        best_split_type = split_type;
+        best_change = change;
+      }
+    }
+  }
+  int image_ind = image_num();
+  AddImage(alpha);
+  tree_.InsertLeaf(best_leaf, best_split_type, image_ind, alpha);
+  RefreshLayout(best_leaf, changed_images);
+  return true;
+}
+
+bool CollageLayout::RemoveImage(int image_ind,
+                                std::vector<int>& changed_images) {
+  if ((canvas_alpha_ == -1) || (image_ind < 0) ||
+      (image_ind >= image_num()) || (image_num() == 1)) {
+    COLLAGE_LOG(kLogError) << "RemoveImage " << image_ind;
+    return false;
+  }
+  int sibling = tree_.RemoveLeaf(tree_.FindLeaf(image_ind));
+  // Renumber the images after image_ind, in image_alpha_vec_ and the leaves.
+  for (int i = 0; i < image_alpha_vec_.size(); ++i) {
+    if (image_alpha_vec_[i].image_ind_ == image_ind) {
+      image_alpha_vec_.erase(image_alpha_vec_.begin() + i);
+      --i;
+    } else if (image_alpha_vec_[i].image_ind_ > image_ind) {
+      --image_alpha_vec_[i].image_ind_;
+    }
+  }
+  const std::vector<int>& leaves = tree_.tree_leaves();
+  for (int i = 0; i < leaves.size(); ++i) {
+    TreeNode& leaf = tree_.node(leaves[i]);
+    if (leaf.image_ind_ > image_ind) --leaf.image_ind_;
+  }
+  RefreshLayout(sibling, changed_images);
+  // Positions are copied along, the layout does not change.
+  tree_.CompactPool();
+  return true;
+}
+
+void CollageLayout::RefreshLayout(int node, std::vector<int>& changed_images) {
+  tree_.UpdateAlpha();
+  alpha_update_num_ = tree_.alpha_update_num();
+  std::vector<int> changed_leaves;
+  FloatRect old_position = tree_.node(tree_.tree_root()).position_;
+  PlaceRoot();
+  const TreeNode& root = tree_.node(tree_.tree_root());
+  if (root.is_leaf_ && !SameRect(root.position_, old_position))
+    changed_leaves.push_back(tree_.tree_root());
+  tree_.RefreshPositions(node, changed_leaves);
+  changed_images.clear();
+  for (int i = 0; i < changed_leaves.size(); ++i) {
+    changed_images.push_back(tree_.node(changed_leaves[i]).image_ind_);
+  }
+  std::sort(changed_images.begin(), changed_images.end());
+}
+
+void CollageLayout::LeafRects(std::vector<FloatRect>& rects) const {
+  assert(canvas_alpha_ != -1);
+  rects.resize(image_alpha_vec_.size());
+  const std::vector<int>& leaves = tree_.tree_leaves();
+  for (int i = 0; i < leaves.size(); ++i) {
+    const TreeNode& leaf = tree_.node(leaves[i]);
+    rects[leaf.image_ind_] = leaf.position_;
+  }
+}
+
+// Sort image_alpha_vec_ by aspect ratio and index it for dispatching.
+void CollageLayout::BuildAlphaIndex() {
+  std::sort(image_alpha_vec_.begin(), image_alpha_vec_.end(), less_than);
+  std::vector<float> sorted_alpha(image_alpha_vec_.size());
+  for (int i = 0; i < image_alpha_vec_.size(); ++i) {
+    sorted_alpha[i] = image_alpha_vec_[i].alpha_;
+  }
+  alpha_index_.Build(sorted_alpha);
+}
+
+// Calculate aspect ratio for all the inner nodes below node.
+// The return value is the aspect ratio for the node.
+// The inner nodes are collected in pre-order with an explicit stack, so
+// walking that list backwards meets every child before its parent. Stack use
+// does not depend on the tree depth.
+float CollageTree::CalculateAlpha(int node) {
+  if ((node == tree_root_) && (removed_node_num_ == 0)) {
+    // The whole tree is the whole pool, where parents precede their
+    // children: a backwards scan needs no stack at all.
+    for (int i = static_cast<int>(tree_nodes_.size()) - 1; i >= 0; --i) {
+      TreeNode& cur = tree_nodes_[i];
+      if (cur.is_leaf_) continue;
+      float left_alpha = tree_nodes_[cur.left_child_].alpha_;
+      float right_alpha = tree_nodes_[cur.right_child_].alpha_;
+      ++alpha_update_num_;
+      if (cur.split_type_ == 'v') {
+        cur.alpha_ = left_alpha + right_alpha;
+      } else if (cur.split_type_ == 'h') {
+        cur.alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
+      } else {
+        COLLAGE_LOG(kLogError) << "CalculateAlpha";
+        return -1;
+      }
+    }
+    return tree_nodes_[node].alpha_;
+  }
+  traversal_.clear();
+  node_stack_.assign(1, node);
+  while (!node_stack_.empty()) {
+    int ind = node_stack_.back();
+    node_stack_.pop_back();
+    const TreeNode& cur = tree_nodes_[ind];
+    if (cur.is_leaf_) continue;
+    traversal_.push_back(ind);
+    node_stack_.push_back(cur.right_child_);
+    node_stack_.push_back(cur.left_child_);
+  }
+  for (int i = static_cast<int>(traversal_.size()) - 1; i >= 0; --i) {
+    TreeNode& cur = tree_nodes_[traversal_[i]];
+    float left_alpha = tree_nodes_[cur.left_child_].alpha_;
+    float right_alpha = tree_nodes_[cur.right_child_].alpha_;
+    ++alpha_update_num_;
+    if (cur.split_type_ == 'v') {
+      cur.alpha_ = left_alpha + right_alpha;
+    } else if (cur.split_type_ == 'h') {
+      cur.alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
+    } else {
+      COLLAGE_LOG(kLogError) << "CalculateAlpha";
+      traversal_.clear();
+      return -1;
+    }
+  }
+  traversal_.clear();
+  // For a leaf, this is just the image's aspect ratio.
+  return tree_nodes_[node].alpha_;
+}
+
+// Only the nodes whose split type flipped in AdjustAlpha, and their
+// ancestors, can change their aspect ratio. Collect the union of their paths
+// to the root and recompute just those nodes, each one once.
+float CollageTree::UpdateAlpha() {
+  if (alpha_marks_.size() < tree_nodes_.size())
+    alpha_marks_.resize(tree_nodes_.size(), 0);
+  update_nodes_.clear();
+  for (int i = 0; i < dirty_nodes_.size(); ++i) {
+    // Stop at the first node already collected, its ancestors are too.
+    for (int node = dirty_nodes_[i];
+         (node != -1) && !alpha_marks_[node];
+         node = tree_nodes_[node].parent_) {
+      alpha_marks_[node] = 1;
+      update_nodes_.push_back(node);
+    }
+  }
+  dirty_nodes_.clear();
+  if (update_nodes_.size() * 8 > tree_nodes_.size()) {
+    // Most of the tree is affected, a plain traversal is cheaper than sorting.
+    for (int i = 0; i < update_nodes_.size(); ++i) {
+      alpha_marks_[update_nodes_[i]] = 0;
+    }
+    return CalculateAlpha(tree_root_);
+  }
+  // Parents are created before their children in the pool, so descending
+  // index order recomputes every child before its parent.
+  std::sort(update_nodes_.begin(), update_nodes_.end(), std::greater<int>());
+  for (int i = 0; i < update_nodes_.size(); ++i) {
+    TreeNode& cur = tree_nodes_[update_nodes_[i]];
+    alpha_marks_[update_nodes_[i]] = 0;
+    float left_alpha = tree_nodes_[cur.left_child_].alpha_;
+    float right_alpha = tree_nodes_[cur.right_child_].alpha_;
+    if (cur.split_type_ == 'v') {
+      cur.alpha_ = left_alpha + right_alpha;
+    } else {
+      cur.alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
+    }
+    ++alpha_update_num_;
+  }
+  return tree_nodes_[tree_root_].alpha_;
+}
+
+// Simulated annealing whose cost is the distance of the root aspect ratio
+// to expect_alpha in log space. The temperature starts at the half width of
+// the accepted range and cools geometrically to a hundredth of it, where the
+// search is a plain descent. A rejected move is undone by applying it again.
+bool CollageTree::Refine(float expect_alpha, float thresh, int move_num) {
+  assert(thresh > 1);
+  float lower_bound = expect_alpha / thresh;
+  float upper_bound = expect_alpha * thresh;
+  float alpha = tree_nodes_[tree_root_].alpha_;
+  if ((alpha >= lower_bound) && (alpha <= upper_bound)) return true;
+  if (tree_nodes_[tree_root_].is_leaf_ || (move_num <= 0)) return false;
+  // The moves keep the sets of inner nodes and leaves.
+  traversal_.clear();
+  node_stack_.assign(1, tree_root_);
+  while (!node_stack_.empty()) {
+    int ind = node_stack_.back();
+    node_stack_.pop_back();
+    const TreeNode& cur = tree_nodes_[ind];
+    if (cur.is_leaf_) continue;
+    traversal_.push_back(ind);
+    node_stack_.push_back(cur.right_child_);
+    node_stack_.push_back(cur.left_child_);
+  }
+  int inner_num = static_cast<int>(traversal_.size());
+  int leaf_num = static_cast<int>(tree_leaves_.size());
+  float cost = fabsf(logf(alpha / expect_alpha));
+  float temperature = logf(thresh);
+  float cooling = powf(0.01f, 1.0f / move_num);
+  bool rotated = false;
+  for (int m = 0; m < move_num; ++m, temperature *= cooling) {
+    int move = Random(3);
+    int first = -1;
+    int second = -1;
+    if (move == 0) {
+      first = traversal_[Random(inner_num)];
+    } else if (move == 1) {
+      first = tree_leaves_[Random(leaf_num)];
+      second = tree_leaves_[Random(leaf_num)];
+      if (tree_nodes_[first].alpha_ == tree_nodes_[second].alpha_) continue;
+    } else {
+      first = traversal_[Random(inner_num)];
+      if (first == tree_root_) continue;
+    }
+    // Apply the move, or undo it on the second pass.
+    for (int pass = 0; pass < 2; ++pass) {
+      if (move == 0) {
+        TreeNode& cur = tree_nodes_[first];
+        cur.split_type_ = (cur.split_type_ == 'v') ? 'h' : 'v';
+      } else if (move == 1) {
+        TreeNode& a = tree_nodes_[first];
+        TreeNode& b = tree_nodes_[second];
+        std::swap(a.image_ind_, b.image_ind_);
+        std::swap(a.alpha_, b.alpha_);
+        std::swap(a.alpha_expect_, b.alpha_expect_);
+      } else {
+        Rotate(first);
+      }
+      // Below their common ancestor the two paths are disjoint, so the
+      // second walk sees the first one's result and fixes the rest.
+      alpha = UpdatePath(first);
+      if (second != -1) alpha = UpdatePath(second);
+      if (pass == 1) break;
+      float new_cost = fabsf(logf(alpha / expect_alpha));
+      if ((new_cost <= cost) ||
+          (random_.UniformFloat() < expf((cost - new_cost) / temperature))) {
+        cost = new_cost;
+        if (move == 2) rotated = true;
+        break;
+      }
+    }
+    if ((alpha >= lower_bound) && (alpha <= upper_bound)) break;
+  }
+  traversal_.clear();
+  if (rotated) Reorder();
+  alpha = tree_nodes_[tree_root_].alpha_;
+  return (alpha >= lower_bound) && (alpha <= upper_bound);
+}
+
+// Candidate 0 is the tree as it is, so a tree is never made worse, and ties
+// keep it (Closest takes the first one).
+float CollageTree::PickCuts(float expect_alpha, int candidate_num,
+                            TreeBatch& batch) {
+  if (tree_nodes_[tree_root_].is_leaf_ || (candidate_num < 2))
+    return tree_nodes_[tree_root_].alpha_;
+  batch.Init(*this, candidate_num);
+  int inner_num = static_cast<int>(batch.inner_nodes().size());
+  for (int c = 1; c < candidate_num; ++c) {
+    int flip_num = 1 + Random(CUT_FLIP_NUM);
+    for (int f = 0; f < flip_num; ++f) {
+      int inner_ind = Random(inner_num);
+      char split_type = batch.split_type(c, inner_ind);
+      batch.set_split_type(c, inner_ind, (split_type == 'v') ? 'h' : 'v');
+    }
+  }
+  batch.Evaluate(batch_alphas_);
+  float ratio = 0;
+  int best = TreeBatch::Closest(batch_alphas_, expect_alpha, ratio);
+  if (best <= 0) return tree_nodes_[tree_root_].alpha_;
+  batch.Store(best, *this);
+  return CalculateAlpha(tree_root_);
+}
+
+// Top-down Calculate the image positions in the colage.
+// Same forward scan idea as CalculateAlpha, every parent is placed before
+// its children.
+bool CollageTree::CalculateAllPositions() {
+  if (removed_node_num_ != 0) {
+    const TreeNode& root = tree_nodes_[tree_root_];
+    if (root.is_leaf_) return true;
+    return CalculatePositions(root.left_child_) &&
+           CalculatePositions(root.right_child_);
+  }
+  for (int i = 0; i < tree_nodes_.size(); ++i) {
+    if ((i != tree_root_) && !CalculatePosition(i)) return false;
+  }
+  return true;
+}
+
+// Pre-order with an explicit stack: a node is placed before its children.
+bool CollageTree::CalculatePositions(int node) {
+  node_stack_.assign(1, node);
+  while (!node_stack_.empty()) {
+    int ind = node_stack_.back();
+    node_stack_.pop_back();
+    if (!CalculatePosition(ind)) {
+      node_stack_.clear();
+      return false;
+    }
+    const TreeNode& cur = tree_nodes_[ind];
+    if (cur.right_child_ != -1) node_stack_.push_back(cur.right_child_);
+    if (cur.left_child_ != -1) node_stack_.push_back(cur.left_child_);
+  }
+  return true;
+}
+
+bool CollageTree::CalculatePosition(int node) {
+  TreeNode& cur = tree_nodes_[node];
+  const TreeNode& parent = tree_nodes_[cur.parent_];
+  // Step 1: calculate height & width.
+  if (parent.split_type_ == 'v') {
+    // Vertical cut, height unchanged.
+    cur.position_.height_ = parent.position_.height_;
+    if (cur.child_type_ == 'l') {
+      cur.position_.width_ = cur.position_.height_ * cur.alpha_;
+    } else if (cur.child_type_ == 'r') {
+      cur.position_.width_ = parent.position_.width_ -
+      tree_nodes_[parent.left_child_].position_.width_;
+    } else {
+      COLLAGE_LOG(kLogError) << "CalculatePositions step 0";
+      return false;
+    }
+  } else if (parent.split_type_ == 'h') {
+    // Horizontal cut, width unchanged.
+    cur.position_.width_ = parent.position_.width_;
+    if (cur.child_type_ == 'l') {
+      cur.position_.height_ = cur.position_.width_ / cur.alpha_;
+    } else if (cur.child_type_ == 'r') {
+      cur.position_.height_ = parent.position_.height_ -
+      tree_nodes_[parent.left_child_].position_.height_;
+    }
+  } else {
+    COLLAGE_LOG(kLogError) << "CalculatePositions step 1";
+    return false;
+  }
+  
+  // Step 2: calculate x & y.
+  if (cur.child_type_ == 'l') {
+    // If it is left child, use its parent's x & y.
+    cur.position_.x_ = parent.position_.x_;
+    cur.position_.y_ = parent.position_.y_;
+  } else if (cur.child_type_ == 'r') {
+    if (parent.split_type_ == 'v') {
+      // y (row) unchanged, x (colmn) changed.
+      cur.position_.y_ = parent.position_.y_;
+      cur.position_.x_ = parent.position_.x_ +
+      parent.position_.width_ -
+      cur.position_.width_;
+    } else if (parent.split_type_ == 'h') {
+      // x (column) unchanged, y (row) changed.
+      cur.position_.x_ = parent.position_.x_;
+      cur.position_.y_ = parent.position_.y_ +
+      parent.position_.height_ -
+      cur.position_.height_;
+    } else {
+      COLLAGE_LOG(kLogError) << "CalculatePositions step 2 - 1";
+    }
+  } else {
+    COLLAGE_LOG(kLogError) << "CalculatePositions step 2 - 2";
+    return false;
+  }
+  return true;
+}
+
+int CollageTree::FindLeaf(int image_ind) const {
+  for (int i = 0; i < tree_leaves_.size(); ++i) {
+    if (tree_nodes_[tree_leaves_[i]].image_ind_ == image_ind)
+      return tree_leaves_[i];
+  }
+  return -1;
+}
+
+// The old leaf moves to a new pool node and leaf itself becomes the inner
+// node, so parents keep smaller indices than their children.
+void CollageTree::InsertLeaf(int leaf, char split_type, int image_ind,
+                             float alpha) {
+  assert(tree_nodes_[leaf].is_leaf_);
+  int old_leaf = NewTreeNode(leaf, 'l');
+  int new_leaf = NewTreeNode(leaf, 'r');
+  tree_nodes_[old_leaf] = tree_nodes_[leaf];
+  tree_nodes_[old_leaf].parent_ = leaf;
+  tree_nodes_[old_leaf].child_type_ = 'l';
+  TreeNode& added = tree_nodes_[new_leaf];
+  added.alpha_ = alpha;
+  added.alpha_expect_ = alpha;
+  added.image_ind_ = image_ind;
+  TreeNode& inner = tree_nodes_[leaf];
+  inner.is_leaf_ = false;
+  inner.split_type_ = split_type;
+  inner.image_ind_ = -1;
+  inner.left_child_ = old_leaf;
+  inner.right_child_ = new_leaf;
+  *std::find(tree_leaves_.begin(), tree_leaves_.end(), leaf) = old_leaf;
+  tree_leaves_.push_back(new_leaf);
+  dirty_nodes_.push_back(leaf);
+}
+
+// The sibling has a larger index than the parent it replaces, so the index
+// order is kept.
+int CollageTree::RemoveLeaf(int leaf) {
+  int parent = tree_nodes_[leaf].parent_;
+  if (parent == -1) return -1;
+  const TreeNode& old_parent = tree_nodes_[parent];
+  int sibling = (old_parent.left_child_ == leaf) ? old_parent.right_child_ :
+                                                   old_parent.left_child_;
+  int grand_parent = old_parent.parent_;
+  tree_nodes_[sibling].parent_ = grand_parent;
+  tree_nodes_[sibling].child_type_ = old_parent.child_type_;
+  if (grand_parent == -1) {
+    tree_root_ = sibling;
+  } else {
+    TreeNode& grand = tree_nodes_[grand_parent];
+    if (grand.left_child_ == parent) {
+      grand.left_child_ = sibling;
+    } else {
+      grand.right_child_ = sibling;
+    }
+    dirty_nodes_.push_back(grand_parent);
+  }
+  tree_leaves_.erase(std::find(tree_leaves_.begin(), tree_leaves_.end(),
+                               leaf));
+  removed_node_num_ += 2;
+  return sibling;
+}
+
+bool CollageTree::CompactPool() {
+  assert(dirty_nodes_.empty());
+  if (removed_node_num_ * POOL_COMPACT_FRACTION <=
+      static_cast<int>(tree_nodes_.size()))
+    return false;
+  Reorder();
+  return true;
+}
+
+// Walk from leaf to the root, combining the new aspect ratio with the
+// current one of each sibling, the same way UpdateAlpha would.
+float CollageTree::InsertedRootAlpha(int leaf, char split_type,
+                                     float alpha) const {
+  float leaf_alpha = tree_nodes_[leaf].alpha_;
+  float cur_alpha = (split_type == 'v') ? leaf_alpha + alpha :
+                    (leaf_alpha * alpha) / (leaf_alpha + alpha);
+  int child = leaf;
+  for (int node = tree_nodes_[leaf].parent_; node != -1;
+       child = node, node = tree_nodes_[node].parent_) {
+    const TreeNode& cur = tree_nodes_[node];
+    float sibling_alpha = (cur.left_child_ == child) ?
+        tree_nodes_[cur.right_child_].alpha_ :
+        tree_nodes_[cur.left_child_].alpha_;
+    if (cur.split_type_ == 'v') {
+      cur_alpha = cur_alpha + sibling_alpha;
+    } else {
+      cur_alpha = (cur_alpha * sibling_alpha) / (cur_alpha + sibling_alpha);
+    }
+  }
+  return cur_alpha;
+}
+
+// Subtrees off the marked path whose rectangle is unchanged are skipped:
+// their aspect ratios did not change either, so nothing inside them moved.
+void CollageTree::RefreshPositions(int node, std::vector<int>& changed_leaves) {
+  if (alpha_marks_.size() < tree_nodes_.size())
+    alpha_marks_.resize(tree_nodes_.size(), 0);
+  update_nodes_.clear();
+  for (int cur = node; cur != -1; cur = tree_nodes_[cur].parent_) {
+    alpha_marks_[cur] = 1;
+    update_nodes_.push_back(cur);
+  }
+  std::vector<int> stack(1, tree_root_);
+  while (!stack.empty()) {
+    const TreeNode& cur = tree_nodes_[stack.back()];
+    stack.pop_back();
+    if (cur.is_leaf_) continue;
+    int children[2] = {cur.left_child_, cur.right_child_};
+    for (int i = 0; i < 2; ++i) {
+      FloatRect old_position = tree_nodes_[children[i]].position_;
+      CalculatePosition(children[i]);
+      bool moved = !SameRect(tree_nodes_[children[i]].position_,
+                             old_position);
+      if (moved && tree_nodes_[children[i]].is_leaf_)
+        changed_leaves.push_back(children[i]);
+      if (moved || alpha_marks_[children[i]]) stack.push_back(children[i]);
+    }
+  }
+  for (int i = 0; i < update_nodes_.size(); ++i) {
+    alpha_marks_[update_nodes_[i]] = 0;
+  }
+}
+
+void CollageTree::Init(const std::vector<AlphaUnit>* image_alpha_vec,
+                       const AlphaIndex& alpha_index,
+                       uint64_t random_seed) {
+  image_alpha_vec_ = image_alpha_vec;
+  alpha_index_ = alpha_index;
+  random_.Seed(random_seed);
+  tree_root_ = -1;
+  alpha_update_num_ = 0;
+}
+
+void CollageTree::set_build_thread_num(int build_thread_num) {
+  build_pool_.reset();
+  if (build_thread_num > 1)
+    build_pool_ = std::make_shared<WorkerPool>(build_thread_num);
+}
+
+// Pre-order walk with an explicit stack; the right child is pushed first so
+// the left subtree is emitted first.
+void CollageTree::Encode(const std::vector<int>& ranks,
+                         std::vector<int>& code) const {
+  code.clear();
+  code.reserve(tree_nodes_.size());
+  if (tree_root_ == -1) return;
+  std::vector<int> stack(1, tree_root_);
+  while (!stack.empty()) {
+    const TreeNode& cur = tree_nodes_[stack.back()];
+    stack.pop_back();
+    if (cur.is_leaf_) {
+      code.push_back(ranks[cur.image_ind_]);
+    } else {
+      code.push_back((cur.split_type_ == 'v') ? -1 : -2);
+      stack.push_back(cur.right_child_);
+      stack.push_back(cur.left_child_);
+    }
+  }
+}
+
+bool CollageTree::Decode(const std::vector<int>& code) {
+  int image_num = static_cast<int>(image_alpha_vec_->size());
+  if (code.size() != 2 * image_num - 1) return false;
+  tree_nodes_.clear();
+  tree_nodes_.reserve(code.size());
+  removed_node_num_ = 0;
+  tree_leaves_.clear();
+  tree_leaves_.reserve(image_num);
+  dirty_nodes_.clear();
+  std::vector<char> used(image_num, 0);
+  tree_root_ = -1;
+  // Nodes are created in pre-order, so a parent still gets a smaller pool
+  // index than its children. The stack holds the inner nodes still waiting
+  // for a child; the right child is pushed first so the left one comes next.
+  node_stack_.clear();
+  int pos = 0;
+  for (pos = 0; pos < code.size(); ++pos) {
+    int value = code[pos];
+    int parent = -1;
+    char child_type = 'N';
+    if (pos > 0) {
+      // A complete tree before the end of the code.
+      if (node_stack_.empty()) break;
+      parent = node_stack_.back() >> 1;
+      child_type = (node_stack_.back() & 1) ? 'r' : 'l';
+      node_stack_.pop_back();
+    }
+    int node = NewTreeNode(parent, child_type);
+    if (parent == -1) {
+      tree_root_ = node;
+    } else if (child_type == 'l') {
+      tree_nodes_[parent].left_child_ = node;
+    } else {
+      tree_nodes_[parent].right_child_ = node;
+    }
+    if (value >= 0) {
+      if ((value >= used.size()) || used[value]) break;
+      used[value] = 1;
+      const AlphaUnit& unit = (*image_alpha_vec_)[value];
+      tree_nodes_[node].is_leaf_ = true;
+      tree_nodes_[node].alpha_ = unit.alpha_;
+      tree_nodes_[node].image_ind_ = unit.image_ind_;
+      tree_leaves_.push_back(node);
+      continue;
+    }
+    if ((value != -1) && (value != -2)) break;
+    tree_nodes_[node].is_leaf_ = false;
+    tree_nodes_[node].split_type_ = (value == -1) ? 'v' : 'h';
+    node_stack_.push_back((node << 1) | 1);
+    node_stack_.push_back(node << 1);
+  }
+  if ((pos != code.size()) || !node_stack_.empty()) {
+    node_stack_.clear();
+    tree_root_ = -1;
+    return false;
+  }
+  return true;
+}
+
+// Take a fresh node from the pool and return its index.
+int CollageTree::NewTreeNode(int parent, char child_type) {
+  tree_nodes_.push_back(TreeNode());
+  TreeNode& node = tree_nodes_.back();
+  node.parent_ = parent;
+  node.child_type_ = child_type;
+  return static_cast<int>(tree_nodes_.size()) - 1;
+}
+
+float CollageTree::UpdatePath(int node) {
+  for (int ind = node; ind != -1; ind = tree_nodes_[ind].parent_) {
+    TreeNode& cur = tree_nodes_[ind];
+    if (cur.is_leaf_) continue;
+    float left_alpha = tree_nodes_[cur.left_child_].alpha_;
+    float right_alpha = tree_nodes_[cur.right_child_].alpha_;
+    if (cur.split_type_ == 'v') {
+      cur.alpha_ = left_alpha + right_alpha;
+    } else {
+      cur.alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
+    }
+    ++alpha_update_num_;
+  }
+  return tree_nodes_[tree_root_].alpha_;
+}
+
+void CollageTree::Rotate(int node) {
+  int parent = tree_nodes_[node].parent_;
+  assert(parent != -1);
+  const TreeNode& upper = tree_nodes_[parent];
+  const TreeNode& lower = tree_nodes_[node];
+  if (upper.right_child_ == node) {
+    int a = upper.left_child_;
+    int b = lower.left_child_;
+    int c = lower.right_child_;
+    Link(parent, node, 'l');
+    Link(parent, c, 'r');
+    Link(node, a, 'l');
+    Link(node, b, 'r');
+  } else {
+    int a = lower.left_child_;
+    int b = lower.right_child_;
+    int c = upper.right_child_;
+    Link(parent, a, 'l');
+    Link(parent, node, 'r');
+    Link(node, b, 'l');
+    Link(node, c, 'r');
+  }
+}
+
+void CollageTree::Link(int parent, int child, char child_type) {
+  TreeNode& cur = tree_nodes_[child];
+  cur.parent_ = parent;
+  cur.child_type_ = child_type;
+  if (child_type == 'l') {
+    tree_nodes_[parent].left_child_ = child;
+  } else {
+    tree_nodes_[parent].right_child_ = child;
+  }
+}
+
+// Collect the nodes in pre-order, then copy them with their links mapped to
+// the new indices.
+void CollageTree::Reorder() {
+  traversal_.clear();
+  node_stack_.assign(1, tree_root_);
+  while (!node_stack_.empty()) {
+    int ind = node_stack_.back();
+    node_stack_.pop_back();
+    traversal_.push_back(ind);
+    const TreeNode& cur = tree_nodes_[ind];
+    if (cur.is_leaf_) continue;
+    node_stack_.push_back(cur.right_child_);
+    node_stack_.push_back(cur.left_child_);
+  }
+  // update_nodes_ serves as the map from old to new indices.
+  update_nodes_.assign(tree_nodes_.size(), -1);
+  for (int i = 0; i < traversal_.size(); ++i) {
+    update_nodes_[traversal_[i]] = i;
+  }
+  std::vector<TreeNode> nodes(traversal_.size());
+  tree_leaves_.clear();
+  for (int i = 0; i < traversal_.size(); ++i) {
+    TreeNode& cur = nodes[i];
+    cur = tree_nodes_[traversal_[i]];
+    if (cur.parent_ != -1) cur.parent_ = update_nodes_[cur.parent_];
+    if (cur.is_leaf_) {
+      tree_leaves_.push_back(i);
+    } else {
+      cur.left_child_ = update_nodes_[cur.left_child_];
+      cur.right_child_ = update_nodes_[cur.right_child_];
+    }
+  }
+  // assign() keeps the pool's capacity for the next GenerateTree.
+  tree_nodes_.assign(nodes.begin(), nodes.end());
+  tree_root_ = 0;
+  removed_node_num_ = 0;
+  traversal_.clear();
+  update_nodes_.clear();
+}
+
+void CollageTree::GenerateTree(float expect_alpha) {
+  StatTimer timer(kStatGenerate);
+  int image_num = static_cast<int>(image_alpha_vec_->size());
+  removed_node_num_ = 0;
+  dirty_nodes_.clear();
+  if ((build_pool_ != NULL) && (image_num >= 2 * BUILD_TASK_IMAGES)) {
+    // Every node and leaf slot is overwritten by its task, so the pool of
+    // the last generation is reused as it is. The subtrees dispatch their
+    // own images, alpha_index_ stays untouched.
+    tree_nodes_.resize(2 * image_num - 1);
+    tree_leaves_.resize(image_num);
+    tree_root_ = ParallelTree(expect_alpha);
+    return;
+  }
+  // A full binary tree with image_num leaves has 2 * image_num - 1 nodes.
+  // clear() keeps the capacity, so after the first generation the pool is
+  // reset without touching the allocator.
+  tree_nodes_.clear();
+  tree_nodes_.reserve(2 * image_num);
+  tree_leaves_.clear();
+  tree_leaves_.reserve(image_num);
+  // Make every image available for dispatching again.
+  alpha_index_.Reset();
+  
+  // Generate a new tree by using divide-and-conquer.
+  tree_root_ = GuidedTree(expect_alpha, expect_alpha, image_num);
+  // After guided tree generation, all the images have been dispatched to leaves.
+  assert(alpha_index_.remain_num() == 0);
+  return;
+}
+
+// The pool is laid out in pre-order: a subtree with n leaves has 2 * n - 1
+// nodes, so the node of a task with n images comes first, its left subtree
+// (n / 2 images) right after it and its right subtree after that. Every task
+// thus knows where its nodes and leaves go, and writes them there itself.
+// The threads share one stack of tasks: a task with more than
+// BUILD_TASK_IMAGES images makes its node and pushes its two halves, a
+// smaller one builds its whole subtree.
+int CollageTree::ParallelTree(float root_alpha) {
+  int image_num = static_cast<int>(image_alpha_vec_->size());
+  std::vector<BuildTask> tasks(1);
+  BuildTask& root = tasks[0];
+  root.parent_ = -1;
+  root.child_type_ = 'N';
+  root.expect_alpha_ = root_alpha;
+  root.ranks_.resize(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    root.ranks_[i] = i;
+  }
+  root.random_seed_ = static_cast<uint64_t>(random_.Next()) << 32;
+  root.random_seed_ |= random_.Next();
+  root.node_offset_ = 0;
+  root.leaf_offset_ = 0;
+  
+  std::mutex mutex;
+  std::condition_variable task_ready;
+  // Tasks queued or running. The build is over when it drops to 0.
+  int pending_num = 1;
+  bool failed = false;
+  build_pool_->Run([&]() {
+    BuildTask task;
+    BuildTask halves[2];
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      task_ready.wait(lock, [&]() {
+        return !tasks.empty() || (pending_num == 0);
+      });
+      if (tasks.empty()) return;
+      std::swap(task, tasks.back());
+      tasks.pop_back();
+      lock.unlock();
+      bool success = true;
+      bool split = (task.ranks_.size() > BUILD_TASK_IMAGES);
+      if (split) {
+        SplitTask(task, root_alpha, halves);
+      } else {
+        success = BuildSubtree(task, root_alpha);
+      }
+      lock.lock();
+      if (split) {
+        // The left half goes on top, as in GuidedTree.
+        tasks.push_back(BuildTask());
+        std::swap(tasks.back(), halves[1]);
+        tasks.push_back(BuildTask());
+        std::swap(tasks.back(), halves[0]);
+        pending_num += 2;
+      }
+      if (!success) failed = true;
+      --pending_num;
+      task_ready.notify_all();
+    }
+  });
+  if (failed) {
+    COLLAGE_LOG(kLogError) << "ParallelTree";
+    return -1;
+  }
+  return 0;
+}
+
+// Same split type rule as GuidedTree, drawn from the task's own seed, so
+// the tree does not depend on which thread runs which task.
+void CollageTree::SplitTask(const BuildTask& task, float root_alpha,
+                            BuildTask* halves) {
+  CollageRandom random(task.random_seed_);
+  int v_h = random.Uniform(2);
+  if (task.expect_alpha_ > root_alpha * 2) v_h = 1;
+  if (task.expect_alpha_ < root_alpha / 2) v_h = 0;
+  int image_num = static_cast<int>(task.ranks_.size());
+  int left_num = image_num / 2;
+  TreeNode& inner = tree_nodes_[task.node_offset_];
+  inner = TreeNode();
+  inner.is_leaf_ = false;
+  inner.split_type_ = (v_h == 1) ? 'v' : 'h';
+  inner.parent_ = task.parent_;
+  inner.child_type_ = task.child_type_;
+  inner.left_child_ = task.node_offset_ + 1;
+  inner.right_child_ = task.node_offset_ + 2 * left_num;
+  for (int side = 0; side < 2; ++side) {
+    BuildTask& half = halves[side];
+    half.parent_ = task.node_offset_;
+    half.child_type_ = (side == 0) ? 'l' : 'r';
+    half.expect_alpha_ = (v_h == 1) ? task.expect_alpha_ / 2 :
+                                      task.expect_alpha_ * 2;
+    half.random_seed_ = static_cast<uint64_t>(random.Next()) << 32;
+    half.random_seed_ |= random.Next();
+    half.ranks_.clear();
+  }
+  halves[0].node_offset_ = inner.left_child_;
+  halves[0].leaf_offset_ = task.leaf_offset_;
+  halves[1].node_offset_ = inner.right_child_;
+  halves[1].leaf_offset_ = task.leaf_offset_ + left_num;
+  // Image i goes left when (i + 1) * left_num / image_num steps up, which
+  // spreads the left images evenly over the sorted ranks.
+  halves[0].ranks_.reserve(left_num);
+  halves[1].ranks_.reserve(image_num - left_num);
+  for (long long i = 0; i < image_num; ++i) {
+    if ((i + 1) * left_num / image_num != i * left_num / image_num) {
+      halves[0].ranks_.push_back(task.ranks_[i]);
+    } else {
+      halves[1].ranks_.push_back(task.ranks_[i]);
+    }
+  }
+}
+
+// The subtree is built by a scratch tree over the task's images alone, whose
+// own image_alpha_vec_ keeps the original image numbers.
+bool CollageTree::BuildSubtree(const BuildTask& task, float root_alpha) {
+  int image_num = static_cast<int>(task.ranks_.size());
+  std::vector<AlphaUnit> alpha_vec(image_num);
+  std::vector<float> sorted_alpha(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    alpha_vec[i] = (*image_alpha_vec_)[task.ranks_[i]];
+    sorted_alpha[i] = alpha_vec[i].alpha_;
+  }
+  CollageTree sub;
+  sub.image_alpha_vec_ = &alpha_vec;
+  sub.alpha_index_.Build(sorted_alpha);
+  sub.alpha_index_.set_approximate_pairs(alpha_index_.approximate_pairs());
+  sub.random_.Seed(task.random_seed_);
+  sub.tree_nodes_.reserve(2 * image_num);
+  sub.tree_leaves_.reserve(image_num);
+  // GuidedTree creates the subtree's root first.
+  if (sub.GuidedTree(root_alpha, task.expect_alpha_, image_num) != 0)
+    return false;
+  for (int i = 0; i < sub.tree_nodes_.size(); ++i) {
+    TreeNode& cur = tree_nodes_[task.node_offset_ + i];
+    cur = sub.tree_nodes_[i];
+    if (i == 0) {
+      cur.parent_ = task.parent_;
+      cur.child_type_ = task.child_type_;
+    } else {
+      cur.parent_ += task.node_offset_;
+    }
+    if (!cur.is_leaf_) {
+      cur.left_child_ += task.node_offset_;
+      cur.right_child_ += task.node_offset_;
+    }
+  }
+  for (int i = 0; i < sub.tree_leaves_.size(); ++i) {
+    tree_leaves_[task.leaf_offset_ + i] =
+        sub.tree_leaves_[i] + task.node_offset_;
+  }
+  return true;
+}
+
+// Divide-and-conquer tree generation, one subtree per entry of an explicit
+// stack. The right half is pushed before the left one, so subtrees are built
+// in the same pre-order (and the random split types drawn in the same order)
+// as a recursive left-then-right construction would.
+int CollageTree::GuidedTree(float root_alpha, float expect_alpha,
+                            int image_num) {
+  guide_stack_.clear();
+  GuideFrame root_frame;
+  root_frame.parent_ = -1;
+  root_frame.child_type_ = 'N';
+  root_frame.expect_alpha_ = expect_alpha;
+  root_frame.image_num_ = image_num;
+  guide_stack_.push_back(root_frame);
+  int root = -1;
+  while (!guide_stack_.empty()) {
+    GuideFrame frame = guide_stack_.back();
+    guide_stack_.pop_back();
+    if (alpha_index_.remain_num() == 0) {
+      COLLAGE_LOG(kLogError) << "GuidedTree 0";
+      guide_stack_.clear();
+      return -1;
+    }
+    
+    // Create a new TreeNode and hang it under its parent.
+    int node = NewTreeNode(frame.parent_, frame.child_type_);
+    if (frame.parent_ == -1) {
+      root = node;
+    } else if (frame.child_type_ == 'l') {
+      tree_nodes_[frame.parent_].left_child_ = node;
+    } else {
+      tree_nodes_[frame.parent_].right_child_ = node;
+    }
+    
+    if (frame.image_num_ == 1) {
+      // Set the new node.
+      TreeNode& leaf = tree_nodes_[node];
+      leaf.is_leaf_ = true;
+      // Find the best fit aspect ratio.
+      bool success = FindOneImage(frame.expect_alpha_,
+                                  leaf.alpha_,
+                                  leaf.image_ind_);
+      if (!success) {
+        COLLAGE_LOG(kLogError) << "GuidedTree 1";
+        guide_stack_.clear();
+        return -1;
+      }
+      tree_leaves_.push_back(node);
+    } else if (frame.image_num_ == 2) {
+      // Set the new node.
+      int l_child = NewTreeNode(node, 'l');
+      int r_child = NewTreeNode(node, 'r');
+      TreeNode& inner = tree_nodes_[node];
+      TreeNode& l_leaf = tree_nodes_[l_child];
+      TreeNode& r_leaf = tree_nodes_[r_child];
+      inner.is_leaf_ = false;
+      inner.left_child_ = l_child;
+      inner.right_child_ = r_child;
+      l_leaf.is_leaf_ = true;
+      r_leaf.is_leaf_ = true;
+      // Find the best fit aspect ratio with two nodes.
+      // As well as the split type for node.
+      bool success = FindTwoImages(frame.expect_alpha_,
+                                   inner.split_type_,
+                                   l_leaf.alpha_,
+                                   l_leaf.image_ind_,
+                                   r_leaf.alpha_,
+                                   r_leaf.image_ind_);
+      if (!success) {
+        COLLAGE_LOG(kLogError) << "GuidedTree 2";
+        guide_stack_.clear();
+        return -1;
+      }
+      tree_leaves_.push_back(l_child);
+      tree_leaves_.push_back(r_child);
+    } else {
+      tree_nodes_[node].is_leaf_ = false;
+      float new_exp_alpha = 0;
+      // Random split type.
+      int v_h = Random(2);
+      if (frame.expect_alpha_ > root_alpha * 2) v_h = 1;
+      if (frame.expect_alpha_ < root_alpha / 2) v_h = 0;
+      if (v_h == 1) {
+        tree_nodes_[node].split_type_ = 'v';
+        new_exp_alpha = frame.expect_alpha_ / 2;
+      } else {
+        tree_nodes_[node].split_type_ = 'h';
+        new_exp_alpha = frame.expect_alpha_ * 2;
+      }
+      GuideFrame child_frame;
+      child_frame.parent_ = node;
+      child_frame.expect_alpha_ = new_exp_alpha;
+      child_frame.child_type_ = 'r';
+      child_frame.image_num_ = frame.image_num_ - frame.image_num_ / 2;
+      guide_stack_.push_back(child_frame);
+      child_frame.child_type_ = 'l';
+      child_frame.image_num_ = frame.image_num_ / 2;
+      guide_stack_.push_back(child_frame);
+    }
+  }
+  return root;
+}
+
+// Find the best-match aspect ratio image among the undispatched ones.
+// find_img_alpha is the best-match alpha value.
+// After finding the best-match one, it is removed from alpha_index_,
+// which means that we have dispatched one image with a tree leaf.
+bool CollageTree::FindOneImage(float expect_alpha,
+                               float& find_img_alpha,
+                               int& find_img_ind) {
+  if (alpha_index_.remain_num() == 0) return false;
+  // Ranks in alpha_index_ follow the sorted image_alpha_vec_.
+  int finder = alpha_index_.FindNearest(expect_alpha);
+  const std::vector<AlphaUnit>& alpha_vec = *image_alpha_vec_;
+  
+  // Dispatch image to leaf node.
+  find_img_alpha = alpha_vec[finder].alpha_;
+  find_img_ind = alpha_vec[finder].image_ind_;
+  // Remove the find result from alpha_index_.
+  alpha_index_.Remove(finder);
+  return true;
+}
+
+// Find the best fit aspect ratio (two images) among the undispatched ones.
+// find_split_type returns 'h' or 'v'.
+// If it is 'h', the parent node is horizontally split, and 'v' for vertically
+// split. After finding the two images, they are removed from alpha_index_,
+// which means we have dispatched two images.
+bool CollageTree::FindTwoImages(float expect_alpha,
+                                char& find_split_type,
+                                float& find_img_alpha_1,
+                                int& find_img_ind_1,
+                                float& find_img_alpha_2,
+                                int& find_img_ind_2) {
+  if (alpha_index_.remain_num() < 2) return false;
+  const std::vector<AlphaUnit>& alpha_vec = *image_alpha_vec_;
+  // There are two situations:
+  // [1]: parent node is vertival cut.
+  int best_v_i = -1;
+  int best_v_j = -1;
+  alpha_index_.FindPairSum(expect_alpha, best_v_i, best_v_j);
+  // [2]: parent node is horizontal cut;
+  int best_h_i = -1;
+  int best_h_j = -1;
+  alpha_index_.FindPairRecipSum(1 / expect_alpha, best_h_i, best_h_j);
+  
+  // Find the best-match from the above two situations.
+  float real_alpha_v = alpha_vec[best_v_i].alpha_ + alpha_vec[best_v_j].alpha_;
+  float real_alpha_h = (alpha_vec[best_h_i].alpha_ * alpha_vec[best_h_j].alpha_) /
+  (alpha_vec[best_h_i].alpha_ + alpha_vec[best_h_j].alpha_);
+  
+  float ratio_diff_v = -1;
+  float ratio_diff_h = -1;
+  if (real_alpha_v > expect_alpha) {
+    ratio_diff_v = real_alpha_v / expect_alpha;
+  } else {
+    ratio_diff_v = expect_alpha / real_alpha_v;
+  }
+  if (real_alpha_h > expect_alpha) {
+    ratio_diff_h = real_alpha_h / expect_alpha;
+  } else {
+    ratio_diff_h = expect_alpha / real_alpha_h;
+  }
+
+  assert(best_h_i < best_h_j);
+  assert(best_v_i < best_v_j);
+  
+  int best_i = best_v_i;
+  int best_j = best_v_j;
+  if (ratio_diff_v <= ratio_diff_h) {
+    find_split_type = 'v';
+  } else {
+    find_split_type = 'h';
+    best_i = best_h_i;
+    best_j = best_h_j;
+  }
+  find_img_ind_1 = alpha_vec[best_i].image_ind_;
+  find_img_alpha_1 = alpha_vec[best_i].alpha_;
+  find_img_alpha_2 = alpha_vec[best_j].alpha_;
+  find_img_ind_2 = alpha_vec[best_j].image_ind_;
+  alpha_index_.Remove(best_i);
+  alpha_index_.Remove(best_j);
+  return true;
+}
+
+// Pre-order with an explicit stack (right child pushed first), so the nodes
+// are visited, and flipped nodes queued, in the recursive order.
+bool CollageTree::AdjustAlpha(int node, float thresh) {
+  assert(thresh > 1);
+  if (node == -1) return false;
+  bool changed = false;
+  float thresh_2 = 1 + (thresh - 1) / 2;
+  node_stack_.assign(1, node);
+  while (!node_stack_.empty()) {
+    int ind = node_stack_.back();
+    node_stack_.pop_back();
+    TreeNode& cur = tree_nodes_[ind];
+    if (cur.is_leaf_) continue;
+    TreeNode& l_child = tree_nodes_[cur.left_child_];
+    TreeNode& r_child = tree_nodes_[cur.right_child_];
+    
+    if (cur.alpha_ > cur.alpha_expect_ * thresh_2) {
+      // Too big actual aspect ratio.
+      if (cur.split_type_ == 'v') {
+        changed = true;
+        dirty_nodes_.push_back(ind);
+      }
+      cur.split_type_ = 'h';
+      l_child.alpha_expect_ = cur.alpha_expect_ * 2;
+      r_child.alpha_expect_ = cur.alpha_expect_ * 2;
+    } else if (cur.alpha_ < cur.alpha_expect_ / thresh_2 ) {
+      // Too small actual aspect ratio.
+      if (cur.split_type_ == 'h') {
+        changed = true;
+        dirty_nodes_.push_back(ind);
+      }
+      cur.split_type_ = 'v';
+      l_child.alpha_expect_ = cur.alpha_expect_ / 2;
+      r_child.alpha_expect_ = cur.alpha_expect_ / 2;
+    } else {
+      // Aspect ratio is okay.
+      if (cur.split_type_ == 'h') {
+        l_child.alpha_expect_ = cur.alpha_expect_ * 2;
+        r_child.alpha_expect_ = cur.alpha_expect_ * 2;
+      } else if (cur.split_type_ == 'v') {
+        l_child.alpha_expect_ = cur.alpha_expect_ / 2;
+        r_child.alpha_expect_ = cur.alpha_expect_ / 2;
+      } else {
+        COLLAGE_LOG(kLogError) << "AdjustAlpha";
+        node_stack_.clear();
+        return false;
+      }
+    }
+    node_stack_.push_back(cur.right_child_);
+    node_stack_.push_back(cur.left_child_);
+  }
+  return changed;
+}
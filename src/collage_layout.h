@@ -0,0 +1,531 @@
+//
+//  collage_layout.h
+//  wu_collage_advanced
+//
+//  Collage layout from image aspect ratios only, without OpenCV.
+//
+
+#ifndef __wu_collage_advanced__collage_layout__
+#define __wu_collage_advanced__collage_layout__
+
+#include "alpha_index.h"
+#include "collage_random.h"
+#include "layout_cache.h"
+#include "worker_pool.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+#define MAX_ITER_NUM 100      // Max number of aspect ratio adjustment.
+#define MAX_TREE_GENE_NUM 10000  // Max number of tree re-generation.
+#define REFINE_MOVE_NUM 8     // Local moves per leaf to refine a stalled tree.
+#define REFINE_STALL_NUM 10   // Adjustments without progress before refining.
+#define BUILD_TASK_IMAGES 4096  // Max images per task of a parallel build.
+#define CUT_CANDIDATE_NUM 32  // Cut variants scored after each tree generation.
+#define CUT_FLIP_NUM 4        // Max cuts flipped in one variant.
+#define POOL_COMPACT_FRACTION 4  // Pool share of removed nodes to compact at.
+
+class FloatRect {
+public:
+  FloatRect () {
+    x_ = 0;
+    y_ = 0;
+    width_ = 0;
+    height_ = 0;
+  }
+  float x_;
+  float y_;
+  float width_;
+  float height_;
+};
+
+class TreeNode {
+public:
+  TreeNode() {
+    child_type_ = 'N';
+    split_type_ = 'N';
+    is_leaf_ = true;
+    alpha_ = 0;
+    alpha_expect_ = 0;
+    position_ = FloatRect();
+    left_child_ = -1;
+    right_child_ = -1;
+    parent_ = -1;
+    image_ind_ = -1;
+  }
+  char child_type_;      // Is this node left child "l" or right child "r".
+  char split_type_;      // If this node is a inner node, we set 'v' or 'h', which indicate
+  // vertical cut or horizontal cut.
+  bool is_leaf_;         // Is this node a leaf node or a inner node.
+  float alpha_expect_;   // If this node is a leaf, we set expected aspect ratio of this node.
+  float alpha_;          // If this node is a leaf, we set actual aspect ratio of this node.
+  FloatRect position_;    // The position of the node on canvas.
+  // Nodes live in a contiguous pool (CollageTree::tree_nodes_), they refer
+  // to each other by pool index. -1 means no such node.
+  int left_child_;
+  int right_child_;
+  int parent_;
+  int image_ind_;        // If this node is a leaf, the index of its image.
+};
+
+
+class AlphaUnit {
+public:
+  int image_ind_;          // The related image index.
+  float alpha_;            // Aspect ratio value.
+  float alpha_recip_;      // Reciprocal sapect ratio value.
+};
+
+class TreeBatch;
+
+// A layout tree together with everything needed to (re-)generate and adjust
+// it: the node pool, the images not yet dispatched and a private random
+// state. Trees share no mutable state apart from their build pool, which is
+// thread-safe, so several of them can be searched on different threads.
+class CollageTree {
+public:
+  CollageTree() : tree_root_(-1), removed_node_num_(0),
+      image_alpha_vec_(NULL), alpha_update_num_(0) {}
+  // image_alpha_vec must be sorted by aspect ratio and alpha_index built over
+  // it. The vector must outlive the tree.
+  void Init(const std::vector<AlphaUnit>* image_alpha_vec,
+            const AlphaIndex& alpha_index,
+            uint64_t random_seed);
+  
+  // Guided binary tree generation. See set_build_thread_num().
+  void GenerateTree(float expect_alpha);
+  // Calculate aspect ratio for all the inner nodes below node (included).
+  // The return value is the aspect ratio for the node.
+  float CalculateAlpha(int node);
+  // Top-down Calculate the image positions in the colage.
+  bool CalculatePositions(int node);
+  // Same for every node below the root, whose position must be set.
+  bool CalculateAllPositions();
+  // The traversals above, AdjustAlpha and the tree generation use explicit
+  // stacks instead of recursion, so any tree depth is safe.
+  // Position of node alone, from its parent's position.
+  bool CalculatePosition(int node);
+  // Top-down adjust aspect ratio for the final collage.
+  // Nodes whose split type flips are queued for UpdateAlpha.
+  bool AdjustAlpha(int node, float thresh);
+  // After AdjustAlpha, recompute the aspect ratios of the flipped nodes and
+  // their ancestors only. Returns the root aspect ratio.
+  float UpdateAlpha();
+  // Local search from the current tree, whose aspect ratios must be up to
+  // date: up to move_num random moves, each flipping the cut of an inner
+  // node, swapping the images of two leaves or rotating an inner node with
+  // its parent, are scored by recomputing the aspect ratios on their paths to
+  // the root only, and kept under a simulated annealing schedule. Stops as
+  // soon as the root aspect ratio is in [expect_alpha / thresh,
+  // expect_alpha * thresh] and returns whether it is.
+  bool Refine(float expect_alpha, float thresh, int move_num);
+  // Multi-start over the cuts of the current tree, whose aspect ratios must
+  // be up to date: candidate_num - 1 variants, each with 1 to CUT_FLIP_NUM
+  // random cuts flipped, are scored in one TreeBatch pass (batch is scratch
+  // space) together with the tree itself, and the tree takes the cuts of the
+  // one closest to expect_alpha. Returns the root aspect ratio.
+  float PickCuts(float expect_alpha, int candidate_num, TreeBatch& batch);
+  // Compact form of the tree, for LayoutCache: the nodes in pre-order, -1
+  // for a vertical cut, -2 for a horizontal cut, and for a leaf the rank of
+  // its image in image_alpha_vec. ranks[image_ind] is that rank.
+  void Encode(const std::vector<int>& ranks, std::vector<int>& code) const;
+  // Rebuild the tree from Encode's output, with the aspect ratios of the
+  // images now in image_alpha_vec. Only the aspect ratios of the leaves are
+  // set, call CalculateAlpha next. Returns false if code does not describe a
+  // tree with one leaf per image.
+  bool Decode(const std::vector<int>& code);
+  
+  // Incremental updates of a laid out tree. InsertLeaf turns leaf into an
+  // inner node of split_type whose left child is the old leaf and whose right
+  // child is a new leaf for image image_ind. RemoveLeaf puts the sibling of
+  // leaf in place of their parent and returns the sibling, or -1 if leaf is
+  // the root. Both queue the inner nodes to recompute for UpdateAlpha; the
+  // nodes RemoveLeaf frees stay in the pool until CompactPool or the next
+  // GenerateTree.
+  void InsertLeaf(int leaf, char split_type, int image_ind, float alpha);
+  int RemoveLeaf(int leaf);
+  // Once more than 1 / POOL_COMPACT_FRACTION of the pool is unused, drop
+  // those nodes and renumber the rest in pre-order, so a long run of
+  // insertions and removals keeps the pool bounded and the whole-tree passes
+  // get their plain scans back. Node indices change (the root becomes 0), so
+  // nothing may be pending for UpdateAlpha. Returns whether it compacted.
+  bool CompactPool();
+  // Aspect ratio the root would get from InsertLeaf(leaf, split_type, ...,
+  // alpha), without changing the tree.
+  float InsertedRootAlpha(int leaf, char split_type, float alpha) const;
+  // After a structural change at node and UpdateAlpha, recompute the
+  // positions below the root (whose position must be set) that may have
+  // moved: the path from the root to node, and the subtrees whose rectangle
+  // changed. Leaves whose rectangle changed are appended to changed_leaves.
+  void RefreshPositions(int node, std::vector<int>& changed_leaves);
+  // Pool index of the leaf of image image_ind, or -1.
+  int FindLeaf(int image_ind) const;
+  
+  // Accessors:
+  int tree_root() const {
+    return tree_root_;
+  }
+  // Number of inner node aspect ratio computations since Init().
+  long long alpha_update_num() const {
+    return alpha_update_num_;
+  }
+  TreeNode& node(int ind) {
+    return tree_nodes_[ind];
+  }
+  const TreeNode& node(int ind) const {
+    return tree_nodes_[ind];
+  }
+  const std::vector<int>& tree_leaves() const {
+    return tree_leaves_;
+  }
+  // Pool nodes, those of the tree plus the ones RemoveLeaf left unused.
+  int pool_size() const {
+    return static_cast<int>(tree_nodes_.size());
+  }
+  // With more than one thread and at least 2 * BUILD_TASK_IMAGES images,
+  // GenerateTree runs as tasks on that many threads. Instead of drawing from
+  // all the images left, each half of a node gets its own share of the
+  // node's images, in interleaved strides so that both get the whole range
+  // of aspect ratios, and the halves are built as separate tasks down to
+  // BUILD_TASK_IMAGES images, each with its own random state. The tree
+  // depends on the random seed only, not on the thread number, but differs
+  // from the one-thread tree.
+  //
+  // The threads are started here and kept in a WorkerPool for every later
+  // GenerateTree. Copies of the tree share the pool.
+  void set_build_thread_num(int build_thread_num);
+  // Generate on the threads of build_pool (NULL for one thread), e.g. one
+  // pool shared by all the trees of a CollageLayout.
+  void set_build_pool(const std::shared_ptr<WorkerPool>& build_pool) {
+    build_pool_ = build_pool;
+  }
+  
+private:
+  // Append a node to the pool and return its index.
+  int NewTreeNode(int parent, char child_type);
+  // Recompute the aspect ratios of node (if inner) and its ancestors.
+  // Returns the root aspect ratio.
+  float UpdatePath(int node);
+  // Make node (inner, not the root) take the other side of its parent:
+  // p(a, node(b, c)) becomes p(node(a, b), c) and the other way round, so
+  // calling it twice restores the tree. The split types stay with the nodes.
+  void Rotate(int node);
+  // Link child under parent as its child_type ('l' or 'r') child.
+  void Link(int parent, int child, char child_type);
+  // Renumber the pool in pre-order, dropping unused nodes, after Rotate
+  // broke the parent-before-children order or RemoveLeaf left nodes unused.
+  void Reorder();
+  // A subtree GuidedTree still has to build.
+  class GuideFrame {
+  public:
+    int parent_;
+    char child_type_;
+    float expect_alpha_;
+    int image_num_;
+  };
+  // A subtree of a parallel build: its images (ranks in image_alpha_vec_),
+  // random seed, and where its nodes and leaves go in the pool and in
+  // tree_leaves_.
+  class BuildTask {
+  public:
+    int parent_;
+    char child_type_;
+    float expect_alpha_;
+    std::vector<int> ranks_;
+    uint64_t random_seed_;
+    int node_offset_;
+    int leaf_offset_;
+  };
+  
+  // Divide-and-conquer tree generation of image_num leaves for a subtree of
+  // aspect ratio expect_alpha in a canvas of aspect ratio root_alpha.
+  // Returns the index of the root, or -1.
+  int GuidedTree(float root_alpha, float expect_alpha, int image_num);
+  // GenerateTree on the threads of build_pool_, see set_build_thread_num().
+  // The pool and tree_leaves_ must have their final sizes. Returns the index
+  // of the root, or -1.
+  int ParallelTree(float root_alpha);
+  // Make the inner node of task, which has more than BUILD_TASK_IMAGES
+  // images, and the tasks of its two subtrees in halves[0] (left) and
+  // halves[1] (right).
+  void SplitTask(const BuildTask& task, float root_alpha, BuildTask* halves);
+  // Build task's subtree and copy it into its place in the pool.
+  bool BuildSubtree(const BuildTask& task, float root_alpha);
+  // Find the best-match aspect ratio image among the undispatched ones.
+  // find_img_alpha is the best-match alpha value.
+  // After finding the best-match one, it is removed from alpha_index_,
+  // which means that we have dispatched one image with a tree leaf.
+  bool FindOneImage(float expect_alpha,
+                    float& find_img_alpha,
+                    int& find_img_ind);
+  // Find the best fit aspect ratio (two images) among the undispatched ones.
+  // find_split_type returns 'h' or 'v'.
+  // If it is 'h', the parent node is horizontally split, and 'v' for vertically
+  // split. After finding the two images, they are removed from alpha_index_,
+  // which means we have dispatched two images.
+  bool FindTwoImages(float expect_alpha,
+                     char& find_split_type,
+                     float& find_img_alpha_1,
+                     int& find_img_ind_1,
+                     float& find_img_alpha_2,
+                     int& find_img_ind_2);
+  // Random integer in [0, x).
+  int Random(int x) {
+    return random_.Uniform(x);
+  }
+  
+  // Node pool of the binary tree. It is cleared, not freed, between tree
+  // re-generations. A parent always has a smaller index than its children
+  // (Refine restores that order before returning).
+  std::vector<TreeNode> tree_nodes_;
+  // Pool indices of the leaf nodes of the tree.
+  std::vector<int> tree_leaves_;
+  // Pool index of the root.
+  int tree_root_;
+  // Pool nodes left unused by RemoveLeaf. While there are none, the pool is
+  // exactly the tree, and whole-tree passes simply scan it.
+  int removed_node_num_;
+  // Images sorted by aspect ratio, owned by CollageLayout.
+  const std::vector<AlphaUnit>* image_alpha_vec_;
+  // Images not yet dispatched to leaves, ranked as in image_alpha_vec_.
+  AlphaIndex alpha_index_;
+  // Private random state of this tree.
+  CollageRandom random_;
+  // Nodes flipped by AdjustAlpha since the last UpdateAlpha.
+  std::vector<int> dirty_nodes_;
+  // Scratch space for UpdateAlpha: the nodes to recompute, and a mark per
+  // pool node that is cleared again before UpdateAlpha returns.
+  std::vector<int> update_nodes_;
+  std::vector<char> alpha_marks_;
+  // Scratch stacks of the traversals, kept to reuse their memory. They are
+  // empty between calls.
+  std::vector<int> node_stack_;
+  std::vector<int> traversal_;
+  std::vector<GuideFrame> guide_stack_;
+  // Root aspect ratios of the PickCuts candidates.
+  std::vector<float> batch_alphas_;
+  // See alpha_update_num().
+  long long alpha_update_num_;
+  // See set_build_thread_num(), NULL for one thread.
+  std::shared_ptr<WorkerPool> build_pool_;
+};
+
+// The layout engine on its own. Images are given by their aspect ratios
+// only, and the result is one rectangle per image on a canvas of the given
+// width. Nothing here depends on OpenCV, so layout-only programs link
+// collage_layout alone.
+class CollageLayout {
+public:
+  explicit CollageLayout(int canvas_width = -1,
+                         uint64_t random_seed = CollageRandom::DefaultSeed())
+      : canvas_height_(-1), canvas_alpha_(-1), canvas_width_(canvas_width),
+        random_seed_(random_seed), alpha_update_num_(0),
+        layout_cache_(NULL), use_topology_table_(true),
+        use_refinement_(true), cut_candidate_num_(CUT_CANDIDATE_NUM) {}
+  
+  // Append an image. Images are numbered in the order they are added, that
+  // number is TreeNode::image_ind_ and the index into LeafRects().
+  void AddImage(int width, int height);
+  // Same as above for an image of aspect ratio (width / height) alpha.
+  void AddImage(float alpha);
+  // Replace all the images by alphas[0, image_num).
+  void SetAlphas(const float* alphas, int image_num);
+  
+  // Generate one tree, without adjusting its aspect ratio.
+  bool CreateLayout(const float expect_alpha);
+  // Search a tree whose aspect ratio is in
+  // [expect_alpha / thresh, expect_alpha * thresh], see
+  // CollageAdvanced::CreateCollage. Returns -1 if none was found.
+  int CreateLayout(const float expect_alpha, const float thresh,
+                   int& total_tree_generation,
+                   int& total_adjust_iteration,
+                   int thread_num = 1,
+                   bool keep_closest = false);
+  // Same search under a latency bound: it gives up time_budget_us after the
+  // call (or as soon as *cancel is raised, if given), and then keeps the
+  // tree closest to expect_alpha seen so far. Every thread generates at
+  // least one tree, and steps are not interrupted, so with many images the
+  // call can overrun the budget by about one tree generation.
+  // Returns 1 if the layout is within thresh, 0 if the closest tree was
+  // kept instead, -1 if not a single tree could be generated.
+  int CreateLayoutWithin(const float expect_alpha, const float thresh,
+                         long long time_budget_us,
+                         int& total_tree_generation,
+                         int& total_adjust_iteration,
+                         int thread_num = 1,
+                         const std::atomic<bool>* cancel = NULL);
+  // After CreateLayout, rects[i] is the position of image i on the canvas.
+  void LeafRects(std::vector<FloatRect>& rects) const;
+  
+  // Incremental updates of a created layout, without a new search. The
+  // canvas width is kept, its height follows the new aspect ratio, which may
+  // leave the thresh of the last CreateLayout (call it again to get back in
+  // range). changed_images receives, in increasing order, the images whose
+  // rectangle changed; only their regions need to be redrawn.
+  // InsertImage adds an image (numbered image_num() before the call) next to
+  // the leaf, and with the cut, that changes the canvas aspect ratio least.
+  // Returns false if there is no layout yet.
+  bool InsertImage(int width, int height, std::vector<int>& changed_images);
+  bool InsertImage(float alpha, std::vector<int>& changed_images);
+  // RemoveImage gives the space of image image_ind to its sibling in the
+  // tree. The images after it are renumbered, as when erasing from a vector,
+  // and changed_images holds the new numbers. Returns false if there is no
+  // layout, image_ind is out of range or it is the only image.
+  bool RemoveImage(int image_ind, std::vector<int>& changed_images);
+  
+  // Accessors:
+  int image_num() const {
+    return static_cast<int>(image_alpha_vec_.size());
+  }
+  int canvas_height() const {
+    return canvas_height_;
+  }
+  int canvas_width() const {
+    return canvas_width_;
+  }
+  float canvas_alpha() const {
+    return canvas_alpha_;
+  }
+  uint64_t random_seed() const {
+    return random_seed_;
+  }
+  // See CollageAdvanced::alpha_update_num().
+  long long alpha_update_num() const {
+    return alpha_update_num_;
+  }
+  const CollageTree& tree() const {
+    return tree_;
+  }
+  // The images, sorted by aspect ratio once a layout was created.
+  const std::vector<AlphaUnit>& image_alpha_vec() const {
+    return image_alpha_vec_;
+  }
+  void set_random_seed(const uint64_t random_seed) {
+    random_seed_ = random_seed;
+  }
+  void set_canvas_width(const int canvas_width) {
+    canvas_width_ = canvas_width;
+  }
+  // Cache (not owned) of layouts, consulted by CreateLayout and
+  // CreateLayoutWithin before searching and filled with the layouts they
+  // find within thresh. NULL always searches.
+  void set_layout_cache(LayoutCache* layout_cache) {
+    layout_cache_ = layout_cache;
+  }
+  // With up to kMaxTableImages images, CreateLayout and CreateLayoutWithin
+  // first take the closest entry of TopologyTable (topology_table.h) if it
+  // is within thresh, without any random search. On by default.
+  void set_use_topology_table(bool use_topology_table) {
+    use_topology_table_ = use_topology_table;
+  }
+  // When AdjustAlpha stops changing a tree, gets no closer in
+  // REFINE_STALL_NUM iterations or reaches MAX_ITER_NUM, CollageTree::Refine
+  // first searches around it with REFINE_MOVE_NUM moves per image, and only
+  // if that fails is a new tree generated. On by default.
+  void set_use_refinement(bool use_refinement) {
+    use_refinement_ = use_refinement;
+  }
+  // Every generated tree outside thresh first takes the best of
+  // cut_candidate_num variants of its cuts, see CollageTree::PickCuts.
+  // CUT_CANDIDATE_NUM by default, 1 or less turns it off.
+  void set_cut_candidate_num(int cut_candidate_num) {
+    cut_candidate_num_ = cut_candidate_num;
+  }
+  // Threads generating each tree, see CollageTree::set_build_thread_num.
+  // They are started here and shared by all the trees and searching threads
+  // of the layout until the next call. 1 by default.
+  void set_build_thread_num(int build_thread_num) {
+    build_pool_.reset();
+    if (build_thread_num > 1)
+      build_pool_ = std::make_shared<WorkerPool>(build_thread_num);
+  }
+  // Trade exact pair matching at the leaves for O(log n) lookups, see
+  // AlphaIndex::set_approximate_pairs. The exact default costs O(n) per pair,
+  // so a tree generation is O(n^2) in the image number; from about 10k images
+  // on those searches dominate it. Off by default.
+  void set_approximate_pairs(bool approximate_pairs) {
+    alpha_index_.set_approximate_pairs(approximate_pairs);
+  }
+  
+private:
+  // Deadline and optional cancel flag of CreateLayoutWithin.
+  class SearchLimit {
+  public:
+    SearchLimit() : cancel_(NULL) {}
+    bool Reached() const;
+    std::chrono::steady_clock::time_point deadline_;
+    const std::atomic<bool>* cancel_;
+  };
+  
+  // Sort image_alpha_vec_ and build alpha_index_ over it.
+  void BuildAlphaIndex();
+  // CreateLayout and CreateLayoutWithin. limit may be NULL; if it is not,
+  // the closest tree is kept when no tree gets within thresh in time.
+  int SearchLayout(const float expect_alpha, const float thresh,
+                   int& total_tree_generation,
+                   int& total_adjust_iteration,
+                   int thread_num,
+                   bool keep_closest,
+                   const SearchLimit* limit);
+  // Generate and adjust tree until its aspect ratio is in
+  // [expect_alpha / thresh, expect_alpha * thresh]. Every re-generation
+  // takes one unit from tree_gene_budget, which may be shared between
+  // threads; the search gives up when it runs out, stop is raised or limit
+  // (if not NULL) is reached. If best_tree is not NULL, the tree closest to
+  // expect_alpha seen so far is copied there.
+  // tree_gene_counter and total_iter_counter count as in CreateLayout.
+  bool SearchTree(CollageTree& tree,
+                  float expect_alpha,
+                  float thresh,
+                  std::atomic<int>& tree_gene_budget,
+                  const std::atomic<bool>& stop,
+                  const SearchLimit* limit,
+                  CollageTree* best_tree,
+                  int& tree_gene_counter,
+                  int& total_iter_counter);
+  // Set the canvas size from tree_'s aspect ratio and lay out the tiles.
+  void CalculateCanvas();
+  // Set the canvas size and the root position from tree_'s aspect ratio.
+  void PlaceRoot();
+  // After a structural change of tree_ at node: recompute the aspect ratios
+  // and the positions that depend on it, see InsertImage.
+  void RefreshLayout(int node, std::vector<int>& changed_images);
+  // Look key up in layout_cache_ and, if the cached tree is still within
+  // thresh for the actual aspect ratios, make it tree_ and lay it out.
+  bool UseCachedLayout(const LayoutKey& key, float expect_alpha, float thresh);
+  // For small image numbers: make the closest TopologyTable entry tree_ and
+  // lay it out, if it is within thresh.
+  bool UseTopologyTable(float expect_alpha, float thresh);
+  // Put tree_ into layout_cache_ under key.
+  void CacheLayout(const LayoutKey& key);
+  
+  // Input images' aspect ratios.
+  std::vector<AlphaUnit> image_alpha_vec_;
+  // All the images, ranked as in image_alpha_vec_. Each tree copies it.
+  AlphaIndex alpha_index_;
+  // The resulting layout tree.
+  CollageTree tree_;
+  // Canvas height, computed from the canvas width and aspect ratio.
+  int canvas_height_;
+  // Canvas aspect ratio of the resulting tree.
+  float canvas_alpha_;
+  // Canvas width, decided by the user.
+  int canvas_width_;
+  // Seed for tree generation.
+  uint64_t random_seed_;
+  // See alpha_update_num().
+  long long alpha_update_num_;
+  // See set_layout_cache().
+  LayoutCache* layout_cache_;
+  // See set_use_topology_table().
+  bool use_topology_table_;
+  // See set_use_refinement().
+  bool use_refinement_;
+  // See set_cut_candidate_num().
+  int cut_candidate_num_;
+  // See set_build_thread_num(), NULL for one thread.
+  std::shared_ptr<WorkerPool> build_pool_;
+};
+
+#endif /* defined(__wu_collage_advanced__collage_layout__) */
@@ -0,0 +1,44 @@
+//
+//  collage_log.cc
+//  wu_collage_advanced
+//
+//  Leveled diagnostics of the library.
+//
+
+#include "collage_log.h"
+#include <iostream>
+#include <mutex>
+
+std::atomic<int> CollageLog::max_level_(kLogWarning);
+
+namespace {
+
+std::mutex g_sink_mutex;
+std::ostream* g_sink = &std::cout;
+
+const char* LevelPrefix(int level) {
+  switch (level) {
+    case kLogError:
+      return "Error: ";
+    case kLogWarning:
+      return "Warning: ";
+    case kLogInfo:
+      return "";
+    default:
+      return "Debug: ";
+  }
+}
+
+}  // namespace
+
+// Errors are flushed at once, the other levels leave it to the stream.
+CollageLog::~CollageLog() {
+  std::lock_guard<std::mutex> lock(g_sink_mutex);
+  *g_sink << LevelPrefix(level_) << stream_.str() << '\n';
+  if (level_ == kLogError) g_sink->flush();
+}
+
+void CollageLog::set_sink(std::ostream* sink) {
+  std::lock_guard<std::mutex> lock(g_sink_mutex);
+  g_sink = (sink != NULL) ? sink : &std::cout;
+}
@@ -0,0 +1,79 @@
+//
+//  collage_log.h
+//  wu_collage_advanced
+//
+//  Leveled diagnostics of the library.
+//
+
+#ifndef __wu_collage_advanced__collage_log__
+#define __wu_collage_advanced__collage_log__
+
+#include <atomic>
+#include <ostream>
+#include <sstream>
+
+enum LogLevel {
+  kLogError = 0,
+  kLogWarning = 1,
+  kLogInfo = 2,
+  kLogDebug = 3
+};
+
+// Messages above this level are compiled out, e.g. -DCOLLAGE_LOG_MAX_LEVEL=0
+// keeps the errors only.
+#ifndef COLLAGE_LOG_MAX_LEVEL
+#define COLLAGE_LOG_MAX_LEVEL 3
+#endif
+
+// COLLAGE_LOG(kLogError) << "CalculateAlpha" << node;
+// writes "Error: CalculateAlpha 12" as one line to the log sink. The message
+// is only formatted when its level is enabled: a disabled one costs a
+// relaxed atomic load and a compare, and nothing at all above
+// COLLAGE_LOG_MAX_LEVEL. It is a single expression, so it is safe in an
+// unbraced if / else.
+#define COLLAGE_LOG(level) \
+  (((level) > COLLAGE_LOG_MAX_LEVEL) || !CollageLog::Enabled(level)) ? \
+  (void)0 : CollageLogVoidify() & CollageLog(level).stream()
+
+// One message, written out whole when it is destroyed, so lines from
+// different threads never interleave.
+class CollageLog {
+public:
+  explicit CollageLog(int level) : level_(level) {}
+  ~CollageLog();
+  std::ostream& stream() {
+    return stream_;
+  }
+
+  static bool Enabled(int level) {
+    return level <= max_level_.load(std::memory_order_relaxed);
+  }
+  // Messages up to level are written, kLogWarning by default. -1 silences
+  // everything.
+  static void set_level(int level) {
+    max_level_.store(level, std::memory_order_relaxed);
+  }
+  static int level() {
+    return max_level_.load(std::memory_order_relaxed);
+  }
+  // Where messages go (not owned), std::cout by default.
+  static void set_sink(std::ostream* sink);
+
+private:
+  CollageLog(const CollageLog&) = delete;
+  CollageLog& operator=(const CollageLog&) = delete;
+
+  int level_;
+  std::ostringstream stream_;
+  static std::atomic<int> max_level_;
+};
+
+// Turns the stream expression of COLLAGE_LOG into void, so both branches of
+// its conditional have the same type. & binds looser than << and tighter
+// than ?:.
+class CollageLogVoidify {
+public:
+  void operator&(std::ostream&) {}
+};
+
+#endif /* defined(__wu_collage_advanced__collage_log__) */
@@ -0,0 +1,82 @@
+//
+//  collage_random.h
+//  wu_collage_advanced
+//
+//  Small, fast, seedable random number generator for tree generation.
+//
+
+#ifndef __wu_collage_advanced__collage_random__
+#define __wu_collage_advanced__collage_random__
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+// xoshiro128** generator. Each CollageTree owns one, so concurrent searches
+// never touch shared state, and a layout can be reproduced from its seed.
+class CollageRandom {
+public:
+  explicit CollageRandom(uint64_t seed = 0) {
+    Seed(seed);
+  }
+
+  // Expand a 64-bit seed into the 128-bit state with splitmix64, which also
+  // keeps nearby seeds (e.g. seed + thread index) uncorrelated.
+  void Seed(uint64_t seed) {
+    for (int i = 0; i < 2; ++i) {
+      uint64_t x = SplitMix64(seed);
+      state_[2 * i] = static_cast<uint32_t>(x);
+      state_[2 * i + 1] = static_cast<uint32_t>(x >> 32);
+    }
+  }
+
+  // Next 32 random bits.
+  uint32_t Next() {
+    uint32_t result = RotateLeft(state_[1] * 5, 7) * 9;
+    uint32_t t = state_[1] << 9;
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = RotateLeft(state_[3], 11);
+    return result;
+  }
+
+  // Random integer in [0, x).
+  int Uniform(int x) {
+    return static_cast<int>((static_cast<uint64_t>(Next()) * x) >> 32);
+  }
+
+  // Random float in [0, 1).
+  float UniformFloat() {
+    return static_cast<float>(Next() >> 8) * (1.0f / 16777216.0f);
+  }
+
+  // Advance seed and return the next splitmix64 output.
+  static uint64_t SplitMix64(uint64_t& seed) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // A seed that differs between calls, even for instances created in the
+  // same second.
+  static uint64_t DefaultSeed() {
+    static std::atomic<uint64_t> counter(0);
+    uint64_t seed = static_cast<uint64_t>(time(0)) ^
+                    (static_cast<uint64_t>(clock()) << 32) ^
+                    (counter++ * 0x9E3779B97F4A7C15ULL);
+    return SplitMix64(seed);
+  }
+
+private:
+  static uint32_t RotateLeft(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+
+  uint32_t state_[4];
+};
+
+#endif /* defined(__wu_collage_advanced__collage_random__) */
@@ -0,0 +1,70 @@
+//
+//  collage_rects.cc
+//  wu_collage_advanced
+//
+//  Layout-only collage: aspect ratios in, tile rectangles out. Links
+//  collage_layout alone, without OpenCV.
+//
+
+#include "collage_layout.h"
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+
+int main(int argc, const char * argv[]) {
+  // collage_rects canvas_width expect_alpha thresh [seed] < images
+  // Every input line is "width height" or a single aspect ratio. The output
+  // is the canvas size, then "x y width height" for every image, in input
+  // order.
+  if ((argc < 4) || (argc > 5)) {
+    std::cout << "Usage: collage_rects canvas_width expect_alpha thresh [seed]"
+              << " < images" << std::endl;
+    return -1;
+  }
+  int canvas_width = atoi(argv[1]);
+  float expect_alpha = static_cast<float>(atof(argv[2]));
+  float thresh = static_cast<float>(atof(argv[3]));
+  if ((canvas_width <= 0) || (expect_alpha <= 0) || (thresh <= 1)) {
+    std::cout << "Error: bad canvas_width, expect_alpha or thresh" << std::endl;
+    return -1;
+  }
+  uint64_t random_seed = CollageRandom::DefaultSeed();
+  if (argc == 5) random_seed = strtoull(argv[4], NULL, 10);
+  CollageLayout layout(canvas_width, random_seed);
+  std::string line;
+  int line_num = 0;
+  while (std::getline(std::cin, line)) {
+    ++line_num;
+    std::istringstream fields(line);
+    float width = 0;
+    float height = 0;
+    if (!(fields >> width)) continue;
+    if (!(fields >> height)) height = 1;
+    if ((width <= 0) || (height <= 0)) {
+      std::cout << "Error: bad image size at line " << line_num << std::endl;
+      return -1;
+    }
+    layout.AddImage(width / height);
+  }
+  if (layout.image_num() == 0) {
+    std::cout << "Error: no images" << std::endl;
+    return -1;
+  }
+  int total_tree_generation = 0;
+  int total_adjust_iteration = 0;
+  if (layout.CreateLayout(expect_alpha, thresh, total_tree_generation,
+                          total_adjust_iteration) == -1)
+    return -1;
+  std::vector<FloatRect> rects;
+  layout.LeafRects(rects);
+  std::cout << layout.canvas_width() << " " << layout.canvas_height()
+            << std::endl;
+  for (int i = 0; i < rects.size(); ++i) {
+    std::cout << static_cast<int>(rects[i].x_) << " "
+              << static_cast<int>(rects[i].y_) << " "
+              << static_cast<int>(rects[i].width_) << " "
+              << static_cast<int>(rects[i].height_) << std::endl;
+  }
+  return 0;
+}
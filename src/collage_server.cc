@@ -0,0 +1,400 @@
+//
+//  collage_server.cc
+//  wu_collage_advanced
+//
+//  Long-running collage server on a Unix domain socket.
+//
+
+#include "collage_server.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "wu_collage_advanced.h"
+#include <ctype.h>
+#include <errno.h>
+#include <exception>
+#include <signal.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest request accepted, about 10k image paths.
+static const size_t kMaxRequestBytes = 4 << 20;
+// A client that stalls longer than this while sending its request or
+// reading the answer is dropped, so it cannot hold a worker.
+static const int kSocketTimeoutSec = 10;
+// Memory for the layouts kept between requests.
+static const size_t kServerLayoutCacheBytes = 16 << 20;
+
+namespace {
+
+double ElapsedMs(const std::chrono::steady_clock::time_point& start) {
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Read until the empty line ending the request, the end of the stream or
+// kMaxRequestBytes.
+bool ReadRequest(int fd, std::string& request) {
+  char buf[4096];
+  request.clear();
+  while (request.size() < kMaxRequestBytes) {
+    ssize_t read_num = read(fd, buf, sizeof(buf));
+    if (read_num < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (read_num == 0) return !request.empty();
+    // The empty line may start in the previous chunk.
+    size_t from = request.size();
+    from = (from > 0) ? from - 1 : 0;
+    request.append(buf, read_num);
+    if (request.find("\n\n", from) != std::string::npos) return true;
+  }
+  return false;
+}
+
+bool KnownFormat(const std::string& format) {
+  static const char* formats[] = {"json", "jpg", "jpeg", "png", "ppm", "bmp"};
+  for (int i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+    if (format == formats[i]) return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+CollageServer::CollageServer(int thread_num, int queue_size,
+                             size_t tile_cache_bytes,
+                             const std::string& tile_cache_dir,
+                             const std::string& layout_cache_dir)
+    : tile_cache_(tile_cache_bytes, tile_cache_dir),
+      layout_cache_(kServerLayoutCacheBytes, layout_cache_dir),
+      layout_budget_us_(kServerLayoutBudgetUs), stop_(false), listen_fd_(-1),
+      request_num_(0), served_num_(0), failed_num_(0), rejected_num_(0) {
+  if (thread_num < 1)
+    thread_num = static_cast<int>(std::thread::hardware_concurrency());
+  thread_num_ = (thread_num < 1) ? 1 : thread_num;
+  queue_size_ = (queue_size < 1) ? 1 : queue_size;
+}
+
+CollageServer::~CollageServer() {
+  Stop();
+}
+
+bool CollageServer::Serve(const std::string& socket_path,
+                          std::ostream& report) {
+  // A client going away while its answer is written must not kill the
+  // server.
+  signal(SIGPIPE, SIG_IGN);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    COLLAGE_LOG(kLogError) << "socket path too long " << socket_path;
+    return false;
+  }
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    COLLAGE_LOG(kLogError) << "socket";
+    return false;
+  }
+  unlink(socket_path.c_str());
+  if ((bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) ||
+      (listen(fd, queue_size_ + thread_num_) != 0)) {
+    COLLAGE_LOG(kLogError) << "cannot listen on " << socket_path;
+    close(fd);
+    return false;
+  }
+  listen_fd_ = fd;
+  // Stop may have come before the socket existed.
+  if (stop_) shutdown(fd, SHUT_RDWR);
+  for (int t = 0; t < thread_num_; ++t) {
+    workers_.push_back(std::thread(&CollageServer::WorkerLoop, this,
+                                   std::ref(report)));
+  }
+
+  while (!stop_) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      if (stop_) break;
+      if ((errno == EINTR) || (errno == ECONNABORTED)) continue;
+      COLLAGE_LOG(kLogError) << "accept " << strerror(errno);
+      break;
+    }
+    timeval timeout;
+    timeout.tv_sec = kSocketTimeoutSec;
+    timeout.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    Connection connection;
+    connection.fd_ = client;
+    connection.accept_time_ = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      if (queue_.size() < queue_size_) {
+        queue_.push_back(connection);
+        queue_cond_.notify_one();
+        continue;
+      }
+    }
+    // Full: turn the client away now rather than let the queue grow. What
+    // the client already sent is drained first, closing a socket with
+    // unread data would reset the connection before it reads the answer.
+    char buf[4096];
+    while (recv(client, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+    static const char kBusy[] = "error busy\n";
+    WriteAll(client, kBusy, sizeof(kBusy) - 1);
+    shutdown(client, SHUT_WR);
+    close(client);
+    ++rejected_num_;
+  }
+
+  // Let the workers finish the accepted connections.
+  stop_ = true;
+  queue_cond_.notify_all();
+  for (int t = 0; t < workers_.size(); ++t) {
+    workers_[t].join();
+  }
+  workers_.clear();
+  listen_fd_ = -1;
+  close(fd);
+  unlink(socket_path.c_str());
+  report << "server\trequests=" << request_num_
+         << "\tserved=" << served_num_ << "\tfailed=" << failed_num_
+         << "\trejected=" << rejected_num_
+         << "\timages_probed=" << size_cache_.probe_num()
+         << "\ttile_hits=" << tile_cache_.hit_num()
+         << "\ttile_disk_hits=" << tile_cache_.disk_hit_num()
+         << "\ttile_decodes=" << tile_cache_.miss_num()
+         << "\tlayout_hits="
+         << layout_cache_.hit_num() + layout_cache_.disk_hit_num()
+         << "\tlayout_misses=" << layout_cache_.miss_num() << std::endl;
+  return true;
+}
+
+void CollageServer::Stop() {
+  stop_ = true;
+  int fd = listen_fd_;
+  if (fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+void CollageServer::WorkerLoop(std::ostream& report) {
+  while (true) {
+    Connection connection;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      while (queue_.empty() && !stop_) {
+        queue_cond_.wait(lock);
+      }
+      if (queue_.empty()) return;
+      connection = queue_.front();
+      queue_.pop_front();
+    }
+    HandleConnection(connection, report);
+  }
+}
+
+void CollageServer::HandleConnection(const Connection& connection,
+                                     std::ostream& report) {
+  long long request_ind = request_num_++;
+  double wait_ms = ElapsedMs(connection.accept_time_);
+  std::string text;
+  std::string body;
+  std::string error;
+  ServerRequest request;
+  bool success = false;
+  bool within_thresh = false;
+  if (!ReadRequest(connection.fd_, text)) {
+    error = "cannot read request";
+  } else {
+    std::istringstream input(text);
+    success = ParseRequest(input, request, error) &&
+              Handle(request, body, within_thresh, error);
+  }
+  std::ostringstream header;
+  if (success) {
+    header << "ok " << request.format_ << " " << body.size() << " "
+           << (within_thresh ? "met" : "closest") << "\n";
+  } else {
+    header << "error " << error << "\n";
+  }
+  std::string header_text = header.str();
+  if (!WriteAll(connection.fd_, header_text.data(), header_text.size()) ||
+      !WriteAll(connection.fd_, body.data(), body.size())) {
+    success = false;
+    if (error.empty()) error = "cannot write answer";
+  }
+  close(connection.fd_);
+  if (success) {
+    ++served_num_;
+  } else {
+    ++failed_num_;
+  }
+
+  std::lock_guard<std::mutex> lock(report_mutex_);
+  report << "request " << request_ind << "\t" << (success ? "ok" : "failed")
+         << "\tformat=" << request.format_
+         << "\timages=" << request.image_paths_.size()
+         << "\tbytes=" << body.size()
+         << "\twait_ms=" << wait_ms
+         << "\ttotal_ms=" << ElapsedMs(connection.accept_time_);
+  if (success) report << "\tlayout=" << (within_thresh ? "met" : "closest");
+  if (!error.empty()) report << "\terror=" << error;
+  report << std::endl;
+}
+
+bool CollageServer::ParseRequest(std::istream& input, ServerRequest& request,
+                                 std::string& error) {
+  std::string line;
+  if (!std::getline(input, line)) {
+    error = "empty request";
+    return false;
+  }
+  std::istringstream fields(line);
+  std::string seed;
+  if (!(fields >> request.format_ >> request.canvas_width_ >>
+        request.expect_alpha_ >> request.thresh_) ||
+      (request.canvas_width_ <= 0) || (request.expect_alpha_ <= 0) ||
+      (request.thresh_ <= 1)) {
+    error = "bad request line";
+    return false;
+  }
+  // The layout may end up anywhere within thresh of expect_alpha, so every
+  // height in that range must fit.
+  double max_height = request.canvas_width_ * static_cast<double>(
+      request.thresh_) / request.expect_alpha_;
+  double min_height = request.canvas_width_ / (static_cast<double>(
+      request.thresh_) * request.expect_alpha_);
+  if ((request.canvas_width_ > kServerMaxCanvasSide) ||
+      (max_height > kServerMaxCanvasSide) || (min_height < 1)) {
+    error = "canvas size out of range";
+    return false;
+  }
+  if (!KnownFormat(request.format_)) {
+    error = "unknown format " + request.format_;
+    return false;
+  }
+  if (fields >> seed) {
+    // strtoull alone would take "abc" as 0 and "-1" as the largest seed.
+    char* end = NULL;
+    errno = 0;
+    request.random_seed_ = strtoull(seed.c_str(), &end, 10);
+    if (!isdigit(static_cast<unsigned char>(seed[0])) || (*end != '\0') ||
+        (errno == ERANGE)) {
+      error = "bad request line";
+      return false;
+    }
+    request.has_seed_ = true;
+  }
+  while (std::getline(input, line)) {
+    if (!line.empty() && (line[line.size() - 1] == '\r'))
+      line.erase(line.size() - 1);
+    if (line.empty()) break;
+    request.image_paths_.push_back(line);
+  }
+  if (request.image_paths_.empty()) {
+    error = "no images";
+    return false;
+  }
+  if (request.image_paths_.size() > kServerMaxImages) {
+    error = "too many images";
+    return false;
+  }
+  return true;
+}
+
+bool CollageServer::Handle(const ServerRequest& request, std::string& body,
+                           bool& within_thresh, std::string& error) {
+  within_thresh = false;
+  try {
+    return Answer(request, body, within_thresh, error);
+  } catch (const std::exception& exception) {
+    // cv::Exception is a std::exception as well.
+    body.clear();
+    error = std::string("exception ") + exception.what();
+    return false;
+  }
+}
+
+// Same steps as a CollageBatch job, with the server-wide caches. The layout
+// search is bounded, so a hard image set costs at most the budget.
+bool CollageServer::Answer(const ServerRequest& request, std::string& body,
+                           bool& within_thresh, std::string& error) {
+  std::vector<std::string> image_paths;
+  std::vector<cv::Size> image_sizes;
+  for (int i = 0; i < request.image_paths_.size(); ++i) {
+    int width = 0;
+    int height = 0;
+    if (!size_cache_.GetSize(request.image_paths_[i], width, height))
+      continue;
+    image_paths.push_back(request.image_paths_[i]);
+    image_sizes.push_back(cv::Size(width, height));
+  }
+  if (image_paths.empty()) {
+    error = "no readable image";
+    return false;
+  }
+  uint64_t random_seed = request.has_seed_ ? request.random_seed_ :
+                                             CollageRandom::DefaultSeed();
+  CollageAdvanced collage(image_paths, image_sizes, request.canvas_width_,
+                          random_seed);
+  collage.set_layout_cache(&layout_cache_);
+  int tree_generation = 0;
+  int adjust_iteration = 0;
+  int success = -1;
+  if (layout_budget_us_ > 0) {
+    success = collage.CreateCollageWithin(request.expect_alpha_,
+                                          request.thresh_, layout_budget_us_,
+                                          tree_generation, adjust_iteration);
+  } else {
+    success = collage.CreateCollage(request.expect_alpha_, request.thresh_,
+                                    tree_generation, adjust_iteration);
+  }
+  if (success == -1) {
+    error = "no layout";
+    return false;
+  }
+  within_thresh = (success == 1);
+
+  if (request.format_ == "json") {
+    std::ostringstream json;
+    collage.OutputCollageJson(json);
+    body = json.str();
+    return true;
+  }
+  // Under the budget the closest tree is kept, which may be out of thresh.
+  if ((collage.canvas_height() < 1) ||
+      (collage.canvas_height() > kServerMaxCanvasSide)) {
+    error = "canvas size out of range";
+    return false;
+  }
+  collage.set_tile_cache(&tile_cache_);
+  cv::Mat canvas = collage.OutputCollageImage();
+  std::vector<unsigned char> encoded;
+  StatTimer timer(kStatEncode);
+  if (!cv::imencode("." + request.format_, canvas, encoded)) {
+    error = "cannot encode " + request.format_;
+    return false;
+  }
+  body.assign(encoded.begin(), encoded.end());
+  return true;
+}
@@ -0,0 +1,160 @@
+//
+//  collage_server.h
+//  wu_collage_advanced
+//
+//  Long-running collage server on a Unix domain socket.
+//
+
+#ifndef __wu_collage_advanced__collage_server__
+#define __wu_collage_advanced__collage_server__
+
+#include "image_size_cache.h"
+#include "layout_cache.h"
+#include "tile_cache.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Layout search time of a request, after which the closest tree is kept.
+static const long long kServerLayoutBudgetUs = 200000;
+// Largest canvas width and height (also the one implied by expect_alpha and
+// thresh) and image number a request may ask for.
+static const int kServerMaxCanvasSide = 16384;
+static const int kServerMaxImages = 10000;
+
+// One collage asked for. format is "json" for the layout only, or an image
+// format for cv::imencode ("jpg", "png", "ppm", ...).
+class ServerRequest {
+public:
+  ServerRequest() : canvas_width_(0), expect_alpha_(1), thresh_(1.1f),
+      has_seed_(false), random_seed_(0) {}
+  std::string format_;
+  int canvas_width_;
+  float expect_alpha_;
+  float thresh_;
+  bool has_seed_;          // Otherwise the request gets a fresh seed.
+  uint64_t random_seed_;
+  std::vector<std::string> image_paths_;
+};
+
+// Serves collages to many clients from one process, so image sizes, decoded
+// tiles and layouts stay cached between requests.
+//
+// Protocol, one request per connection:
+//   format canvas_width expect_alpha thresh [seed]
+//   image_path
+//   image_path
+//   ...
+// ended by an empty line (or by closing the write side). seed is a decimal
+// number. The answer is
+//   ok format byte_num met|closest
+// followed by byte_num bytes (the JSON layout, see
+// CollageAdvanced::OutputCollageJson, or the encoded image), or
+//   error message
+// "met" means the canvas aspect ratio is within thresh of expect_alpha.
+// "closest" means the layout search ran out of its budget first and the
+// collage is the closest layout found, which may be far from expect_alpha.
+// Connections are accepted by the thread calling Serve and handed to a fixed
+// pool of workers through a bounded queue. When the queue is full the client
+// is answered "error busy" right away (a client still sending its request
+// may see the connection reset instead), so the requests that are taken
+// keep a predictable latency instead of queueing without bound. Image paths
+// are looked up in the image index, if one is set, before the files are
+// opened.
+class CollageServer {
+public:
+  // thread_num < 1 uses one worker per core. At most queue_size accepted
+  // connections wait for a worker. The caches are as in CollageBatch.
+  CollageServer(int thread_num, int queue_size,
+                size_t tile_cache_bytes = 256 << 20,
+                const std::string& tile_cache_dir = "",
+                const std::string& layout_cache_dir = "");
+  ~CollageServer();
+
+  // Image sizes are looked up in image_index (not owned) before opening the
+  // images.
+  void set_image_index(const ImageIndex* image_index) {
+    size_cache_.set_image_index(image_index);
+  }
+  // Bound of the layout search of every request, see
+  // CollageAdvanced::CreateCollageWithin. <= 0 searches without a bound.
+  void set_layout_budget_us(long long layout_budget_us) {
+    layout_budget_us_ = layout_budget_us;
+  }
+
+  // Listen on socket_path (replacing a stale socket file) and serve until
+  // Stop is called. A line per request is written to report, and a summary
+  // at the end. Returns false if the socket cannot be set up.
+  bool Serve(const std::string& socket_path, std::ostream& report);
+  // Make Serve return after the requests already accepted. Only sets a flag
+  // and shuts the listening socket down, so it may be called from a signal
+  // handler.
+  void Stop();
+
+  // Read a request in the protocol above. Returns false with a message in
+  // error if it is malformed or beyond kServerMaxCanvasSide or
+  // kServerMaxImages.
+  static bool ParseRequest(std::istream& input, ServerRequest& request,
+                           std::string& error);
+  // Produce the answer to request: its body and whether the layout is
+  // within thresh, or false and an error message. Exceptions (e.g. a failed
+  // allocation) become error messages too.
+  bool Handle(const ServerRequest& request, std::string& body,
+              bool& within_thresh, std::string& error);
+
+  // Accessors:
+  long long served_num() const {
+    return served_num_;
+  }
+  long long failed_num() const {
+    return failed_num_;
+  }
+  long long rejected_num() const {
+    return rejected_num_;
+  }
+
+private:
+  // An accepted connection waiting for a worker.
+  class Connection {
+  public:
+    int fd_;
+    std::chrono::steady_clock::time_point accept_time_;
+  };
+
+  void WorkerLoop(std::ostream& report);
+  // Handle without the exception handling.
+  bool Answer(const ServerRequest& request, std::string& body,
+              bool& within_thresh, std::string& error);
+  // Read, handle and answer one connection, then close it.
+  void HandleConnection(const Connection& connection, std::ostream& report);
+
+  ImageSizeCache size_cache_;
+  TileCache tile_cache_;
+  LayoutCache layout_cache_;
+  int thread_num_;
+  int queue_size_;
+  long long layout_budget_us_;
+  // Accepted connections, guarded by queue_mutex_.
+  std::deque<Connection> queue_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cond_;
+  std::vector<std::thread> workers_;
+  std::atomic<bool> stop_;
+  std::atomic<int> listen_fd_;
+  // Serializes the report lines.
+  std::mutex report_mutex_;
+  std::atomic<long long> request_num_;
+  std::atomic<long long> served_num_;
+  std::atomic<long long> failed_num_;
+  std::atomic<long long> rejected_num_;
+};
+
+#endif /* defined(__wu_collage_advanced__collage_server__) */
@@ -0,0 +1,218 @@
+//
+//  collage_stats.cc
+//  wu_collage_advanced
+//
+//  Counters, latency histograms and traces of the pipeline phases.
+//
+
+#include "collage_stats.h"
+#include <mutex>
+#include <vector>
+
+// Trace events kept at most, about 24 MB. Later events are only counted.
+static const size_t kMaxTraceEvents = 1 << 20;
+
+std::atomic<bool> CollageStats::enabled_(false);
+std::atomic<bool> CollageStats::tracing_(false);
+
+namespace {
+
+// The event count is the sum of the buckets.
+class PhaseCounters {
+public:
+  std::atomic<long long> total_ns_;
+  std::atomic<long long> max_ns_;
+  std::atomic<long long> buckets_[kStatBucketNum];
+};
+
+class TraceEvent {
+public:
+  int phase_;
+  int thread_;
+  long long start_ns_;
+  long long duration_ns_;
+};
+
+// Zero initialized as statics.
+PhaseCounters g_counters[kStatPhaseNum];
+
+std::mutex g_trace_mutex;
+std::vector<TraceEvent> g_trace_events;
+std::atomic<long long> g_dropped_events(0);
+std::atomic<int> g_thread_num(0);
+// Trace timestamps count from here.
+const std::chrono::steady_clock::time_point g_epoch =
+    std::chrono::steady_clock::now();
+
+// Small ids in order of the first traced event, easier to read than the
+// native ones.
+int ThreadId() {
+  static thread_local int thread_id = -1;
+  if (thread_id < 0) thread_id = g_thread_num++;
+  return thread_id;
+}
+
+int Bucket(long long ns) {
+  long long us = ns / 1000;
+  int bucket = 0;
+  while ((us > 0) && (bucket < kStatBucketNum - 1)) {
+    us >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+// Upper bound of bucket, in us.
+double BucketLimit(int bucket) {
+  return static_cast<double>(1LL << bucket);
+}
+
+// ns as microseconds with three decimals, exactly.
+void WriteMicros(std::ostream& output, long long ns) {
+  if (ns < 0) ns = 0;
+  char decimals[4] = {static_cast<char>('0' + ns / 100 % 10),
+                      static_cast<char>('0' + ns / 10 % 10),
+                      static_cast<char>('0' + ns % 10), '\0'};
+  output << ns / 1000 << "." << decimals;
+}
+
+}  // namespace
+
+void CollageStats::set_tracing(bool tracing) {
+  tracing_.store(tracing, std::memory_order_relaxed);
+  if (tracing) set_enabled(true);
+}
+
+void CollageStats::Record(StatPhase phase,
+                          const std::chrono::steady_clock::time_point& start,
+                          const std::chrono::steady_clock::time_point& end) {
+  long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      end - start).count();
+  PhaseCounters& counters = g_counters[phase];
+  counters.total_ns_.fetch_add(ns, std::memory_order_relaxed);
+  counters.buckets_[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  long long max_ns = counters.max_ns_.load(std::memory_order_relaxed);
+  while ((ns > max_ns) &&
+         !counters.max_ns_.compare_exchange_weak(max_ns, ns,
+                                                 std::memory_order_relaxed)) {}
+  if (!tracing()) return;
+
+  TraceEvent event;
+  event.phase_ = phase;
+  event.thread_ = ThreadId();
+  event.start_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      start - g_epoch).count();
+  event.duration_ns_ = ns;
+  std::lock_guard<std::mutex> lock(g_trace_mutex);
+  if (g_trace_events.size() < kMaxTraceEvents) {
+    g_trace_events.push_back(event);
+  } else {
+    ++g_dropped_events;
+  }
+}
+
+void CollageStats::Reset() {
+  for (int p = 0; p < kStatPhaseNum; ++p) {
+    PhaseCounters& counters = g_counters[p];
+    counters.total_ns_ = 0;
+    counters.max_ns_ = 0;
+    for (int b = 0; b < kStatBucketNum; ++b) {
+      counters.buckets_[b] = 0;
+    }
+  }
+  std::lock_guard<std::mutex> lock(g_trace_mutex);
+  g_trace_events.clear();
+  g_dropped_events = 0;
+}
+
+void CollageStats::GetSummary(StatPhase phase, Summary& summary) {
+  const PhaseCounters& counters = g_counters[phase];
+  summary.count_ = 0;
+  for (int b = 0; b < kStatBucketNum; ++b) {
+    summary.buckets_[b] = counters.buckets_[b].load(std::memory_order_relaxed);
+    summary.count_ += summary.buckets_[b];
+  }
+  summary.total_us_ =
+      counters.total_ns_.load(std::memory_order_relaxed) / 1000.0;
+  summary.max_us_ = counters.max_ns_.load(std::memory_order_relaxed) / 1000.0;
+  const double ranks[3] = {0.5, 0.9, 0.99};
+  double* percentiles[3] = {&summary.p50_us_, &summary.p90_us_,
+                            &summary.p99_us_};
+  for (int r = 0; r < 3; ++r) {
+    *percentiles[r] = 0;
+    if (summary.count_ == 0) continue;
+    long long rank = static_cast<long long>(ranks[r] * summary.count_);
+    if (rank >= summary.count_) rank = summary.count_ - 1;
+    long long seen = 0;
+    int b = 0;
+    while ((b < kStatBucketNum - 1) && (seen + summary.buckets_[b] <= rank)) {
+      seen += summary.buckets_[b];
+      ++b;
+    }
+    double limit = BucketLimit(b);
+    *percentiles[r] = (limit < summary.max_us_) ? limit : summary.max_us_;
+  }
+}
+
+const char* CollageStats::PhaseName(StatPhase phase) {
+  switch (phase) {
+    case kStatProbe:
+      return "probe";
+    case kStatGenerate:
+      return "generate";
+    case kStatAdjust:
+      return "adjust";
+    case kStatRefine:
+      return "refine";
+    case kStatPositions:
+      return "positions";
+    case kStatDecode:
+      return "decode";
+    case kStatResize:
+      return "resize";
+    case kStatEncode:
+      return "encode";
+    default:
+      return "unknown";
+  }
+}
+
+void CollageStats::WriteJson(std::ostream& output) {
+  output << "{";
+  for (int p = 0; p < kStatPhaseNum; ++p) {
+    Summary summary;
+    GetSummary(static_cast<StatPhase>(p), summary);
+    if (p > 0) output << ",";
+    output << "\n  \"" << PhaseName(static_cast<StatPhase>(p)) << "\": {"
+           << "\"count\": " << summary.count_
+           << ", \"total_us\": " << summary.total_us_
+           << ", \"max_us\": " << summary.max_us_
+           << ", \"p50_us\": " << summary.p50_us_
+           << ", \"p90_us\": " << summary.p90_us_
+           << ", \"p99_us\": " << summary.p99_us_ << ", \"buckets\": [";
+    for (int b = 0; b < kStatBucketNum; ++b) {
+      if (b > 0) output << ", ";
+      output << summary.buckets_[b];
+    }
+    output << "]}";
+  }
+  output << ",\n  \"dropped_trace_events\": " << g_dropped_events << "\n}\n";
+}
+
+void CollageStats::WriteTrace(std::ostream& output) {
+  std::lock_guard<std::mutex> lock(g_trace_mutex);
+  output << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (size_t i = 0; i < g_trace_events.size(); ++i) {
+    const TraceEvent& event = g_trace_events[i];
+    if (i > 0) output << ",";
+    output << "\n{\"name\": \""
+           << PhaseName(static_cast<StatPhase>(event.phase_))
+           << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread_
+           << ", \"ts\": ";
+    WriteMicros(output, event.start_ns_);
+    output << ", \"dur\": ";
+    WriteMicros(output, event.duration_ns_);
+    output << "}";
+  }
+  output << "\n]}\n";
+}
@@ -0,0 +1,106 @@
+//
+//  collage_stats.h
+//  wu_collage_advanced
+//
+//  Counters, latency histograms and traces of the pipeline phases.
+//
+
+#ifndef __wu_collage_advanced__collage_stats__
+#define __wu_collage_advanced__collage_stats__
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+enum StatPhase {
+  kStatProbe = 0,      // Image size from the file header.
+  kStatGenerate,       // One guided tree generation.
+  kStatAdjust,         // One AdjustAlpha iteration, with UpdateAlpha.
+  kStatRefine,         // One local search over a stalled tree.
+  kStatPositions,      // Tile positions of a whole layout.
+  kStatDecode,         // Image decode (full or reduced).
+  kStatResize,         // Tile or pyramid resize.
+  kStatEncode,         // Image encode or write (outputs and caches).
+  kStatPhaseNum
+};
+
+// Latency histogram buckets: bucket 0 is below 1 us, bucket i covers
+// [2^(i-1), 2^i) us.
+static const int kStatBucketNum = 36;
+
+// Process-wide statistics of the phases above, shared by every collage and
+// thread. Both switches are off by default; then a StatTimer costs one
+// relaxed atomic load. When enabled, each timed phase adds to its counter
+// and histogram with a few relaxed atomic increments. With tracing on, every
+// event is kept as well (up to kMaxTraceEvents) for WriteTrace.
+class CollageStats {
+public:
+  // Snapshot of one phase. Percentiles are the upper bounds of histogram
+  // buckets, capped by the maximum.
+  class Summary {
+  public:
+    long long count_;
+    double total_us_;
+    double max_us_;
+    double p50_us_;
+    double p90_us_;
+    double p99_us_;
+    long long buckets_[kStatBucketNum];
+  };
+
+  static void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  // Tracing implies enabled.
+  static void set_tracing(bool tracing);
+  static bool tracing() {
+    return tracing_.load(std::memory_order_relaxed);
+  }
+
+  // Add one event of phase, from start to end.
+  static void Record(StatPhase phase,
+                     const std::chrono::steady_clock::time_point& start,
+                     const std::chrono::steady_clock::time_point& end);
+  // Forget all the counters and trace events.
+  static void Reset();
+  static void GetSummary(StatPhase phase, Summary& summary);
+  static const char* PhaseName(StatPhase phase);
+
+  // One JSON object with a member per phase:
+  //   {"probe":{"count":..,"total_us":..,"max_us":..,"p50_us":..,
+  //    "p90_us":..,"p99_us":..,"buckets":[..]},...}
+  static void WriteJson(std::ostream& output);
+  // The trace events in the Chrome trace event format, for chrome://tracing
+  // or Perfetto.
+  static void WriteTrace(std::ostream& output);
+
+private:
+  static std::atomic<bool> enabled_;
+  static std::atomic<bool> tracing_;
+};
+
+// Times the enclosing scope as one event of phase, when stats are enabled.
+class StatTimer {
+public:
+  explicit StatTimer(StatPhase phase)
+      : phase_(phase), active_(CollageStats::enabled()) {
+    if (active_) start_ = std::chrono::steady_clock::now();
+  }
+  ~StatTimer() {
+    if (active_)
+      CollageStats::Record(phase_, start_, std::chrono::steady_clock::now());
+  }
+
+private:
+  StatTimer(const StatTimer&) = delete;
+  StatTimer& operator=(const StatTimer&) = delete;
+
+  StatPhase phase_;
+  bool active_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif /* defined(__wu_collage_advanced__collage_stats__) */
@@ -0,0 +1,318 @@
+//
+//  image_index.cc
+//  wu_collage_advanced
+//
+//  Persistent on-disk index of image dimensions.
+//
+
+#include "image_index.h"
+#include "collage_log.h"
+#include "image_probe.h"
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// File layout, in host byte order:
+//   IndexHeader
+//   Entry[entry_num], sorted by path (bytewise)
+//   path bytes, entry i's path at pool + path_offset_
+static const char kIndexMagic[4] = {'W', 'C', 'I', 'X'};
+// Version 2 stores modification times in nanoseconds.
+static const uint32_t kIndexVersion = 2;
+
+class IndexHeader {
+public:
+  char magic_[4];
+  uint32_t version_;
+  uint64_t entry_num_;
+  uint64_t pool_size_;
+};
+
+class ImageIndex::Entry {
+public:
+  uint64_t path_offset_;
+  int64_t mtime_;          // Nanoseconds since the epoch.
+  int64_t file_size_;
+  uint32_t path_length_;
+  int32_t width_;          // 0 if the header could not be probed.
+  int32_t height_;
+  uint32_t reserved_;
+};
+
+static_assert(sizeof(IndexHeader) == 24, "unexpected index header layout");
+
+namespace {
+
+bool StatFile(const std::string& path, int64_t& mtime, int64_t& file_size) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+  mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+          st.st_mtim.tv_nsec;
+  file_size = static_cast<int64_t>(st.st_size);
+  return true;
+}
+
+bool HasImageExtension(const std::string& path) {
+  static const char* kExtensions[] = {
+    ".jpg", ".jpeg", ".jpe", ".png", ".webp", ".bmp", ".tif", ".tiff"
+  };
+  size_t dot = path.rfind('.');
+  if ((dot == std::string::npos) || (path.find('/', dot) != std::string::npos))
+    return false;
+  std::string ext = path.substr(dot);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  for (int i = 0; i < sizeof(kExtensions) / sizeof(kExtensions[0]); ++i) {
+    if (ext == kExtensions[i]) return true;
+  }
+  return false;
+}
+
+// Append the image files under dir to paths. Symbolic links to directories
+// are not followed, so the walk always terminates.
+void CollectImages(const std::string& dir, std::vector<std::string>& paths) {
+  DIR* handle = opendir(dir.c_str());
+  if (handle == NULL) {
+    COLLAGE_LOG(kLogError) << "CollectImages " << dir;
+    return;
+  }
+  std::vector<std::string> sub_dirs;
+  struct dirent* item = NULL;
+  while ((item = readdir(handle)) != NULL) {
+    if ((strcmp(item->d_name, ".") == 0) || (strcmp(item->d_name, "..") == 0))
+      continue;
+    std::string path = (dir[dir.size() - 1] == '/') ? dir + item->d_name :
+                                                       dir + "/" + item->d_name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) continue;
+    if (S_ISDIR(st.st_mode)) {
+      sub_dirs.push_back(path);
+    } else if ((S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) &&
+               HasImageExtension(path)) {
+      paths.push_back(path);
+    }
+  }
+  closedir(handle);
+  for (int i = 0; i < sub_dirs.size(); ++i) {
+    CollectImages(sub_dirs[i], paths);
+  }
+}
+
+// An entry under construction, with its path.
+class BuildEntry {
+public:
+  std::string path_;
+  int64_t mtime_;
+  int64_t file_size_;
+  int width_;
+  int height_;
+  bool valid_;
+};
+
+bool BuildEntryLess(const BuildEntry& m, const BuildEntry& n) {
+  return m.path_ < n.path_;
+}
+
+}  // namespace
+
+bool ImageIndex::Open(const std::string& index_path) {
+  static_assert(sizeof(Entry) == 40, "unexpected index entry layout");
+  Close();
+  int fd = open(index_path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(IndexHeader))) {
+    close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  const IndexHeader* header = static_cast<const IndexHeader*>(data);
+  uint64_t entries_size = header->entry_num_ * sizeof(Entry);
+  if ((memcmp(header->magic_, kIndexMagic, 4) != 0) ||
+      (header->version_ != kIndexVersion) ||
+      (header->entry_num_ > size / sizeof(Entry)) ||
+      (header->pool_size_ > size) ||
+      (sizeof(IndexHeader) + entries_size + header->pool_size_ != size)) {
+    COLLAGE_LOG(kLogError) << "ImageIndex::Open " << index_path;
+    munmap(data, size);
+    return false;
+  }
+  // Every path must lie inside the pool, Find reads them unchecked.
+  const Entry* entries = reinterpret_cast<const Entry*>(
+      static_cast<const char*>(data) + sizeof(IndexHeader));
+  for (uint64_t i = 0; i < header->entry_num_; ++i) {
+    if ((entries[i].path_offset_ > header->pool_size_) ||
+        (entries[i].path_length_ > header->pool_size_ -
+                                   entries[i].path_offset_)) {
+      COLLAGE_LOG(kLogError) << "ImageIndex::Open bad entry " << i << " in "
+                             << index_path;
+      munmap(data, size);
+      return false;
+    }
+  }
+  data_ = static_cast<const char*>(data);
+  data_size_ = size;
+  entry_num_ = header->entry_num_;
+  entries_ = entries;
+  pool_ = data_ + sizeof(IndexHeader) + entries_size;
+  return true;
+}
+
+void ImageIndex::Close() {
+  if (data_ != NULL) munmap(const_cast<char*>(data_), data_size_);
+  data_ = NULL;
+  data_size_ = 0;
+  entry_num_ = 0;
+  entries_ = NULL;
+  pool_ = NULL;
+}
+
+const ImageIndex::Entry* ImageIndex::Find(const std::string& img_path) const {
+  // Binary search with the same bytewise order the entries were sorted in.
+  uint64_t low = 0;
+  uint64_t high = entry_num_;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    const Entry& entry = entries_[mid];
+    size_t length = std::min<size_t>(entry.path_length_, img_path.size());
+    int cmp = memcmp(pool_ + entry.path_offset_, img_path.data(), length);
+    if (cmp == 0) {
+      if (entry.path_length_ == img_path.size()) return &entry;
+      cmp = (entry.path_length_ < img_path.size()) ? -1 : 1;
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return NULL;
+}
+
+bool ImageIndex::Lookup(const std::string& img_path,
+                        int& width, int& height) const {
+  if (data_ == NULL) return false;
+  const Entry* entry = Find(img_path);
+  if ((entry == NULL) || (entry->width_ <= 0) || (entry->height_ <= 0))
+    return false;
+  if (validate_) {
+    int64_t mtime = 0;
+    int64_t file_size = 0;
+    if (!StatFile(img_path, mtime, file_size) ||
+        (mtime != entry->mtime_) || (file_size != entry->file_size_))
+      return false;
+  }
+  width = entry->width_;
+  height = entry->height_;
+  return true;
+}
+
+bool ImageIndex::Build(const std::vector<std::string>& roots,
+                       const std::string& index_path,
+                       int thread_num,
+                       const ImageIndex* previous,
+                       int* probed_num) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < roots.size(); ++i) {
+    CollectImages(roots[i], paths);
+  }
+  std::vector<BuildEntry> entries(paths.size());
+  for (int i = 0; i < paths.size(); ++i) {
+    entries[i].path_ = paths[i];
+  }
+  paths.clear();
+
+  // Stat and probe in parallel. Every thread takes the next unclaimed entry.
+  if (thread_num < 1)
+    thread_num = static_cast<int>(std::thread::hardware_concurrency());
+  if (thread_num < 1) thread_num = 1;
+  std::atomic<int> next_entry(0);
+  std::atomic<int> probe_counter(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < thread_num; ++t) {
+    workers.push_back(std::thread([&]() {
+      for (int i = next_entry++; i < entries.size(); i = next_entry++) {
+        BuildEntry& entry = entries[i];
+        entry.width_ = 0;
+        entry.height_ = 0;
+        entry.valid_ = StatFile(entry.path_, entry.mtime_, entry.file_size_);
+        if (!entry.valid_) continue;
+        const Entry* old = (previous != NULL) ? previous->Find(entry.path_) :
+                                                NULL;
+        if ((old != NULL) && (old->mtime_ == entry.mtime_) &&
+            (old->file_size_ == entry.file_size_)) {
+          entry.width_ = old->width_;
+          entry.height_ = old->height_;
+          continue;
+        }
+        ++probe_counter;
+        if (!ProbeImageSize(entry.path_, entry.width_, entry.height_)) {
+          entry.width_ = 0;
+          entry.height_ = 0;
+        }
+      }
+    }));
+  }
+  for (int t = 0; t < workers.size(); ++t) {
+    workers[t].join();
+  }
+  if (probed_num != NULL) *probed_num = probe_counter;
+
+  // Sort by path and drop the files that vanished meanwhile, and the
+  // duplicates from overlapping roots.
+  std::sort(entries.begin(), entries.end(), BuildEntryLess);
+  std::vector<Entry> records;
+  std::string pool;
+  for (int i = 0; i < entries.size(); ++i) {
+    if (!entries[i].valid_) continue;
+    if ((i > 0) && (entries[i].path_ == entries[i - 1].path_)) continue;
+    Entry record;
+    memset(&record, 0, sizeof(record));
+    record.path_offset_ = pool.size();
+    record.path_length_ = static_cast<uint32_t>(entries[i].path_.size());
+    record.mtime_ = entries[i].mtime_;
+    record.file_size_ = entries[i].file_size_;
+    record.width_ = entries[i].width_;
+    record.height_ = entries[i].height_;
+    records.push_back(record);
+    pool += entries[i].path_;
+  }
+
+  // Write a temporary file and rename it over the index.
+  IndexHeader header;
+  memcpy(header.magic_, kIndexMagic, 4);
+  header.version_ = kIndexVersion;
+  header.entry_num_ = records.size();
+  header.pool_size_ = pool.size();
+  std::string tmp_path = index_path + ".tmp";
+  std::ofstream output(tmp_path.c_str(), std::ios::out | std::ios::binary);
+  if (!output) {
+    COLLAGE_LOG(kLogError) << "ImageIndex::Build " << tmp_path;
+    return false;
+  }
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!records.empty()) {
+    output.write(reinterpret_cast<const char*>(&records[0]),
+                 records.size() * sizeof(Entry));
+  }
+  output.write(pool.data(), pool.size());
+  output.close();
+  if (!output || (rename(tmp_path.c_str(), index_path.c_str()) != 0)) {
+    COLLAGE_LOG(kLogError) << "ImageIndex::Build " << index_path;
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
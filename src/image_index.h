@@ -0,0 +1,81 @@
+//
+//  image_index.h
+//  wu_collage_advanced
+//
+//  Persistent on-disk index of image dimensions.
+//
+
+#ifndef __wu_collage_advanced__image_index__
+#define __wu_collage_advanced__image_index__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Maps image paths to width, height, modification time and file size, so that
+// image lists over a mostly static library can be loaded without opening the
+// images. The file is a sorted array of fixed-size entries followed by a pool
+// of path bytes; it is memory-mapped read-only and searched in place, so
+// opening an index costs one mmap regardless of its size.
+//
+// Paths are matched byte for byte. An image list has to name the images the
+// same way the index was built (e.g. both relative to the same directory).
+class ImageIndex {
+public:
+  ImageIndex() : data_(NULL), data_size_(0), entry_num_(0), entries_(NULL),
+      pool_(NULL), validate_(true) {}
+  ~ImageIndex() {
+    Close();
+  }
+
+  // Map an index file built by Build(). Returns false if it cannot be read,
+  // is not an index, or has a path outside its path bytes.
+  bool Open(const std::string& index_path);
+  void Close();
+  bool is_open() const {
+    return data_ != NULL;
+  }
+  int entry_num() const {
+    return static_cast<int>(entry_num_);
+  }
+  // If set (the default), Lookup() also stats the image and only answers if
+  // its modification time and size still match the index. Without it a
+  // lookup touches nothing but the mapped index.
+  void set_validate(bool validate) {
+    validate_ = validate;
+  }
+
+  // Size of img_path. Returns false if the image is not in the index, has
+  // changed since it was indexed, or its size could not be probed.
+  bool Lookup(const std::string& img_path, int& width, int& height) const;
+
+  // Index every image file (by extension) under the given directories,
+  // probing headers on thread_num threads (one per core if < 1). Entries of
+  // previous whose file is unchanged are reused instead of probed, which is
+  // how an index is refreshed. The file is replaced atomically, so readers
+  // that mapped the old one are not disturbed.
+  // probed_num, if not NULL, receives the number of headers actually read.
+  static bool Build(const std::vector<std::string>& roots,
+                    const std::string& index_path,
+                    int thread_num,
+                    const ImageIndex* previous,
+                    int* probed_num);
+
+private:
+  ImageIndex(const ImageIndex&) = delete;
+  ImageIndex& operator=(const ImageIndex&) = delete;
+
+  class Entry;
+  // Entry for img_path, or NULL.
+  const Entry* Find(const std::string& img_path) const;
+
+  const char* data_;
+  size_t data_size_;
+  uint64_t entry_num_;
+  const Entry* entries_;
+  const char* pool_;
+  bool validate_;
+};
+
+#endif /* defined(__wu_collage_advanced__image_index__) */
@@ -0,0 +1,90 @@
+//
+//  image_prefetcher.cc
+//  wu_collage_advanced
+//
+//  Background decoding of the collage images while the layout is searched.
+//
+
+#include "image_prefetcher.h"
+#include <assert.h>
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<CollageInput>& inputs,
+                                 const std::vector<cv::Size>& hint_sizes,
+                                 TileCache* tile_cache,
+                                 const PixelProvider& provider)
+    : inputs_(inputs), hint_sizes_(hint_sizes), tile_cache_(tile_cache),
+      provider_(provider), images_(inputs.size()),
+      states_(inputs.size(), kPending), next_image_(0), stop_(false),
+      prefetch_num_(0) {
+  assert(inputs.size() == hint_sizes.size());
+}
+
+void ImagePrefetcher::Start(int thread_num) {
+  for (int t = 0; t < thread_num; ++t) {
+    workers_.push_back(std::thread(&ImagePrefetcher::Worker, this));
+  }
+}
+
+void ImagePrefetcher::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  for (int t = 0; t < workers_.size(); ++t) {
+    workers_[t].join();
+  }
+  workers_.clear();
+}
+
+void ImagePrefetcher::Worker() {
+  while (true) {
+    int img_ind = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Skip the images Get() has already taken over.
+      while ((next_image_ < states_.size()) &&
+             (states_[next_image_] != kPending)) {
+        ++next_image_;
+      }
+      if (stop_ || (next_image_ == states_.size())) return;
+      img_ind = next_image_++;
+      states_[img_ind] = kDecoding;
+    }
+    cv::Mat image = inputs_[img_ind].Read(hint_sizes_[img_ind], tile_cache_,
+                                          provider_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      images_[img_ind] = image;
+      states_[img_ind] = kReady;
+      ++prefetch_num_;
+    }
+    ready_.notify_all();
+  }
+}
+
+cv::Mat ImagePrefetcher::Get(int img_ind, const cv::Size& tile_size) {
+  cv::Mat image;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (states_[img_ind] == kDecoding) {
+      ready_.wait(lock);
+    }
+    if (states_[img_ind] == kReady) {
+      image = images_[img_ind];
+    } else {
+      // Nobody started it, decode it here at the size actually needed.
+      states_[img_ind] = kDecoding;
+    }
+  }
+  if ((image.cols >= tile_size.width) && (image.rows >= tile_size.height))
+    return image;
+  // Not prefetched, or prefetched smaller than the final tile.
+  image = inputs_[img_ind].Read(tile_size, tile_cache_, provider_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    images_[img_ind] = image;
+    states_[img_ind] = kReady;
+  }
+  ready_.notify_all();
+  return image;
+}
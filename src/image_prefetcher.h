@@ -0,0 +1,85 @@
+//
+//  image_prefetcher.h
+//  wu_collage_advanced
+//
+//  Background decoding of the collage images while the layout is searched.
+//
+
+#ifndef __wu_collage_advanced__image_prefetcher__
+#define __wu_collage_advanced__image_prefetcher__
+
+#include "collage_input.h"
+#include "tile_cache.h"
+#include <condition_variable>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Decodes a known set of images on background threads, each one reduced to
+// about a size hint, before anybody asks for them. Get() then returns the
+// image at once if it is ready, waits if it is being decoded, and decodes it
+// on the calling thread if no worker got to it yet. An image is decoded a
+// second time only if its final tile turns out larger than its hint and the
+// prefetched image does not cover it.
+//
+// All the decoded images are held until the prefetcher is destroyed.
+class ImagePrefetcher {
+public:
+  // hint_sizes[i] is the tile size inputs[i] is expected to need; the
+  // workers decode at the strongest reduction still covering it. Both vectors
+  // and the provider must outlive the prefetcher. tile_cache (not owned) may
+  // be NULL.
+  ImagePrefetcher(const std::vector<CollageInput>& inputs,
+                  const std::vector<cv::Size>& hint_sizes,
+                  TileCache* tile_cache,
+                  const PixelProvider& provider);
+  ~ImagePrefetcher() {
+    Stop();
+  }
+
+  // Start thread_num decoding threads.
+  void Start(int thread_num);
+  // Let the workers finish their current image and join them. Images not
+  // started yet are left to Get().
+  void Stop();
+  // Image img_ind, at least as large as tile_size if the source allows.
+  // An image prefetched smaller than tile_size is decoded again.
+  // Returns an empty Mat if it cannot be read.
+  cv::Mat Get(int img_ind, const cv::Size& tile_size);
+
+  // Number of images the workers decoded ahead of Get().
+  int prefetch_num() const {
+    return prefetch_num_;
+  }
+
+private:
+  ImagePrefetcher(const ImagePrefetcher&) = delete;
+  ImagePrefetcher& operator=(const ImagePrefetcher&) = delete;
+
+  enum State {
+    kPending,
+    kDecoding,
+    kReady
+  };
+  void Worker();
+
+  const std::vector<CollageInput>& inputs_;
+  const std::vector<cv::Size>& hint_sizes_;
+  TileCache* tile_cache_;
+  const PixelProvider& provider_;
+  std::vector<cv::Mat> images_;
+  std::vector<State> states_;
+  // First image the workers have not claimed.
+  int next_image_;
+  bool stop_;
+  int prefetch_num_;
+  std::vector<std::thread> workers_;
+  // Guards images_, states_, next_image_, stop_ and prefetch_num_.
+  std::mutex mutex_;
+  // Signalled whenever an image becomes ready.
+  std::condition_variable ready_;
+};
+
+#endif /* defined(__wu_collage_advanced__image_prefetcher__) */
@@ -0,0 +1,241 @@
+//
+//  image_probe.cc
+//  wu_collage_advanced
+//
+//  Read image dimensions from the file header without decoding pixels.
+//
+
+#include "image_probe.h"
+#include "collage_stats.h"
+#include <algorithm>
+#include <fstream>
+#include <limits.h>
+#include <streambuf>
+#include <vector>
+
+namespace {
+
+unsigned int ReadBE16(const unsigned char* p) {
+  return (p[0] << 8) | p[1];
+}
+
+unsigned int ReadLE16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+unsigned int ReadBE32(const unsigned char* p) {
+  return (static_cast<unsigned int>(p[0]) << 24) | (p[1] << 16) |
+         (p[2] << 8) | p[3];
+}
+
+unsigned int ReadLE32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<unsigned int>(p[3]) << 24);
+}
+
+unsigned int ReadLE24(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+// Return the EXIF orientation (1 ~ 8) stored in an APP1 segment payload,
+// or 0 if there is none.
+int ParseExifOrientation(const std::vector<unsigned char>& seg) {
+  if (seg.size() < 14) return 0;
+  if ((seg[0] != 'E') || (seg[1] != 'x') || (seg[2] != 'i') ||
+      (seg[3] != 'f') || (seg[4] != 0) || (seg[5] != 0)) return 0;
+  const unsigned char* tiff = &seg[6];
+  size_t tiff_size = seg.size() - 6;
+  bool little_endian = false;
+  if ((tiff[0] == 'I') && (tiff[1] == 'I')) {
+    little_endian = true;
+  } else if ((tiff[0] != 'M') || (tiff[1] != 'M')) {
+    return 0;
+  }
+  // Offsets come from the file: compare them against the remaining size
+  // before adding anything, so that no sum can wrap around.
+  size_t ifd_offset = little_endian ? ReadLE32(tiff + 4) : ReadBE32(tiff + 4);
+  if (ifd_offset > tiff_size - 2) return 0;
+  unsigned int entry_num = little_endian ? ReadLE16(tiff + ifd_offset) :
+                                           ReadBE16(tiff + ifd_offset);
+  if (tiff_size < 12) return 0;
+  for (size_t i = 0; i < entry_num; ++i) {
+    size_t entry = ifd_offset + 2 + i * 12;
+    if (entry > tiff_size - 12) return 0;
+    unsigned int tag = little_endian ? ReadLE16(tiff + entry) :
+                                       ReadBE16(tiff + entry);
+    if (tag == 0x0112) {
+      unsigned int value = little_endian ? ReadLE16(tiff + entry + 8) :
+                                           ReadBE16(tiff + entry + 8);
+      if ((value >= 1) && (value <= 8)) return static_cast<int>(value);
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Walk the JPEG marker segments until the first SOFn frame header.
+// The stream is positioned right after the SOI marker.
+bool ProbeJpeg(std::istream& file, int& width, int& height) {
+  int orientation = 0;
+  while (file) {
+    int byte = file.get();
+    if (byte != 0xFF) return false;
+    int marker = file.get();
+    while (marker == 0xFF) marker = file.get();
+    if (marker == EOF) return false;
+    // Stand-alone markers carry no length field.
+    if ((marker == 0x01) || ((marker >= 0xD0) && (marker <= 0xD8))) continue;
+    // Reaching the scan or the end of image means there is no frame header.
+    if ((marker == 0xD9) || (marker == 0xDA)) return false;
+    unsigned char len_buf[2];
+    if (!file.read(reinterpret_cast<char*>(len_buf), 2)) return false;
+    unsigned int length = ReadBE16(len_buf);
+    if (length < 2) return false;
+    bool is_sof = (marker >= 0xC0) && (marker <= 0xCF) &&
+                  (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC);
+    if (is_sof) {
+      unsigned char sof[5];
+      if ((length < 7) || !file.read(reinterpret_cast<char*>(sof), 5))
+        return false;
+      height = static_cast<int>(ReadBE16(sof + 1));
+      width = static_cast<int>(ReadBE16(sof + 3));
+      // cv::imread rotates the image according to the EXIF orientation,
+      // orientations 5 ~ 8 transpose the image.
+      if (orientation >= 5) {
+        int tmp = width;
+        width = height;
+        height = tmp;
+      }
+      return (width > 0) && (height > 0);
+    } else if ((marker == 0xE1) && (orientation == 0)) {
+      std::vector<unsigned char> seg(length - 2);
+      if (!seg.empty() &&
+          !file.read(reinterpret_cast<char*>(&seg[0]), seg.size()))
+        return false;
+      orientation = ParseExifOrientation(seg);
+    } else {
+      file.seekg(length - 2, std::ios::cur);
+    }
+  }
+  return false;
+}
+
+// Read-only stream buffer over memory owned by the caller, so that encoded
+// images already in memory are probed without a copy.
+class MemoryStreamBuf : public std::streambuf {
+public:
+  MemoryStreamBuf(const void* data, size_t size) {
+    char* begin = const_cast<char*>(static_cast<const char*>(data));
+    setg(begin, begin, begin + size);
+  }
+protected:
+  virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which) {
+    // Range-check as offsets, a pointer out of the buffer is not valid
+    // even to form.
+    off_type size = egptr() - eback();
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = gptr() - eback();
+    } else if (dir == std::ios_base::end) {
+      base = size;
+    }
+    if ((off < -base) || (off > size - base)) return pos_type(off_type(-1));
+    setg(eback(), eback() + base + off, egptr());
+    return pos_type(base + off);
+  }
+  virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
+bool ProbeStream(std::istream& file, int& width, int& height) {
+  unsigned char head[32];
+  file.read(reinterpret_cast<char*>(head), sizeof(head));
+  std::streamsize head_size = file.gcount();
+  if (head_size < 2) return false;
+
+  // JPEG: SOI marker.
+  if ((head[0] == 0xFF) && (head[1] == 0xD8)) {
+    file.clear();
+    file.seekg(2, std::ios::beg);
+    return ProbeJpeg(file, width, height);
+  }
+  // PNG: signature followed by the IHDR chunk.
+  static const unsigned char kPngSignature[8] = {
+    0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A
+  };
+  if ((head_size >= 24) &&
+      std::equal(kPngSignature, kPngSignature + 8, head) &&
+      (head[12] == 'I') && (head[13] == 'H') &&
+      (head[14] == 'D') && (head[15] == 'R')) {
+    width = static_cast<int>(ReadBE32(head + 16));
+    height = static_cast<int>(ReadBE32(head + 20));
+    return (width > 0) && (height > 0);
+  }
+  // WebP: RIFF container with a VP8 / VP8L / VP8X first chunk.
+  if ((head_size >= 30) &&
+      (head[0] == 'R') && (head[1] == 'I') && (head[2] == 'F') &&
+      (head[3] == 'F') && (head[8] == 'W') && (head[9] == 'E') &&
+      (head[10] == 'B') && (head[11] == 'P')) {
+    const unsigned char* chunk = head + 12;
+    if ((chunk[0] == 'V') && (chunk[1] == 'P') && (chunk[2] == '8')) {
+      if (chunk[3] == ' ') {
+        // Lossy: 3-byte frame tag, 3-byte start code, then 14-bit sizes.
+        if ((head[23] != 0x9D) || (head[24] != 0x01) || (head[25] != 0x2A))
+          return false;
+        width = static_cast<int>(ReadLE16(head + 26) & 0x3FFF);
+        height = static_cast<int>(ReadLE16(head + 28) & 0x3FFF);
+      } else if (chunk[3] == 'L') {
+        // Lossless: signature byte, then packed 14-bit (size - 1) fields.
+        if (head[20] != 0x2F) return false;
+        unsigned int bits = ReadLE32(head + 21);
+        width = static_cast<int>((bits & 0x3FFF) + 1);
+        height = static_cast<int>(((bits >> 14) & 0x3FFF) + 1);
+      } else if (chunk[3] == 'X') {
+        // Extended: 24-bit (canvas size - 1) fields.
+        width = static_cast<int>(ReadLE24(head + 24) + 1);
+        height = static_cast<int>(ReadLE24(head + 27) + 1);
+      } else {
+        return false;
+      }
+      return (width > 0) && (height > 0);
+    }
+    return false;
+  }
+  // BMP: file header followed by a core or info header.
+  if ((head_size >= 26) && (head[0] == 'B') && (head[1] == 'M')) {
+    unsigned int dib_size = ReadLE32(head + 14);
+    if (dib_size == 12) {
+      width = static_cast<int>(ReadLE16(head + 18));
+      height = static_cast<int>(ReadLE16(head + 20));
+    } else if (dib_size >= 40) {
+      width = static_cast<int>(ReadLE32(head + 18));
+      // Negative height means a top-down bitmap.
+      height = static_cast<int>(ReadLE32(head + 22));
+      if (height == INT_MIN) return false;
+      if (height < 0) height = -height;
+    } else {
+      return false;
+    }
+    return (width > 0) && (height > 0);
+  }
+  return false;
+}
+
+}  // namespace
+
+bool ProbeImageSize(const std::string& img_path, int& width, int& height) {
+  StatTimer timer(kStatProbe);
+  std::ifstream file(img_path.c_str(), std::ios::in | std::ios::binary);
+  if (!file) return false;
+  return ProbeStream(file, width, height);
+}
+
+bool ProbeImageSize(const void* data, size_t size, int& width, int& height) {
+  if ((data == NULL) || (size == 0)) return false;
+  StatTimer timer(kStatProbe);
+  MemoryStreamBuf buffer(data, size);
+  std::istream stream(&buffer);
+  return ProbeStream(stream, width, height);
+}
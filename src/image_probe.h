@@ -0,0 +1,23 @@
+//
+//  image_probe.h
+//  wu_collage_advanced
+//
+//  Read image dimensions from the file header without decoding pixels.
+//
+
+#ifndef __wu_collage_advanced__image_probe__
+#define __wu_collage_advanced__image_probe__
+
+#include <stddef.h>
+#include <string>
+
+// Read the width and height of an image by parsing only its header.
+// Supported formats are JPEG (SOFn marker, EXIF orientation honoured the same
+// way cv::imread does), PNG (IHDR chunk), WebP (VP8 / VP8L / VP8X) and BMP.
+// Returns false if the file cannot be opened or the format is not recognized,
+// in which case the caller should fall back to a full decode.
+bool ProbeImageSize(const std::string& img_path, int& width, int& height);
+// Same as above for an encoded image of size bytes already in memory.
+bool ProbeImageSize(const void* data, size_t size, int& width, int& height);
+
+#endif /* defined(__wu_collage_advanced__image_probe__) */
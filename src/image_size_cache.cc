@@ -0,0 +1,88 @@
+//
+//  image_size_cache.cc
+//  wu_collage_advanced
+//
+//  Thread-safe in-process cache of image dimensions.
+//
+
+#include "image_size_cache.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "image_probe.h"
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+
+bool ImageSizeCache::GetSize(const std::string& img_path,
+                             int& width, int& height) {
+  width = 0;
+  height = 0;
+  struct stat st;
+  if (stat(img_path.c_str(), &st) != 0) return false;
+  int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                  st.st_mtim.tv_nsec;
+  int64_t file_size = static_cast<int64_t>(st.st_size);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, ImageSizeList::iterator>::iterator it =
+        lookup_.find(img_path);
+    if ((it != lookup_.end()) && (it->second->mtime_ == mtime) &&
+        (it->second->file_size_ == file_size)) {
+      sizes_.splice(sizes_.begin(), sizes_, it->second);
+      width = it->second->width_;
+      height = it->second->height_;
+      return true;
+    }
+  }
+  // Read the image without holding the lock. Two threads may occasionally
+  // probe the same new image, they get the same answer.
+  bool probed = false;
+  if ((image_index_ == NULL) ||
+      !image_index_->Lookup(img_path, width, height)) {
+    probed = true;
+    if (!ProbeImageSize(img_path, width, height)) {
+      StatTimer timer(kStatDecode);
+      cv::Mat img = cv::imread(img_path.c_str());
+      width = img.cols;
+      height = img.rows;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (probed) ++probe_num_;
+  if (width <= 0) return false;
+  std::unordered_map<std::string, ImageSizeList::iterator>::iterator it =
+      lookup_.find(img_path);
+  if (it != lookup_.end()) sizes_.erase(it->second);
+  ImageSize size;
+  size.path_ = img_path;
+  size.mtime_ = mtime;
+  size.file_size_ = file_size;
+  size.width_ = width;
+  size.height_ = height;
+  sizes_.push_front(size);
+  lookup_[img_path] = sizes_.begin();
+  while (sizes_.size() > capacity_) {
+    lookup_.erase(sizes_.back().path_);
+    sizes_.pop_back();
+  }
+  return true;
+}
+
+bool ImageSizeCache::ReadImageList(const std::string& image_list,
+                                   std::vector<std::string>& image_paths,
+                                   std::vector<cv::Size>& image_sizes) {
+  std::ifstream input_list(image_list.c_str());
+  if (!input_list) {
+    COLLAGE_LOG(kLogError) << "ReadImageList " << image_list;
+    return false;
+  }
+  std::string img_path;
+  while (std::getline(input_list, img_path)) {
+    int width = 0;
+    int height = 0;
+    if (img_path.empty() || !GetSize(img_path, width, height)) continue;
+    image_paths.push_back(img_path);
+    image_sizes.push_back(cv::Size(width, height));
+  }
+  return true;
+}
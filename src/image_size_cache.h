@@ -0,0 +1,71 @@
+//
+//  image_size_cache.h
+//  wu_collage_advanced
+//
+//  Thread-safe in-process cache of image dimensions.
+//
+
+#ifndef __wu_collage_advanced__image_size_cache__
+#define __wu_collage_advanced__image_size_cache__
+
+#include "image_index.h"
+#include <list>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Remembers the size of images asked for recently, so that image lists
+// sharing photos (e.g. the jobs of a batch) open each file only once. Sizes
+// are read from the file header when possible and by a full decode otherwise.
+// Every hit is revalidated against the file's modification time and size, and
+// the least recently used entries are dropped beyond capacity entries.
+class ImageSizeCache {
+public:
+  explicit ImageSizeCache(size_t capacity = 1 << 20)
+      : capacity_(capacity), image_index_(NULL), probe_num_(0) {}
+
+  // Misses are looked up in image_index (not owned) before opening the image.
+  void set_image_index(const ImageIndex* image_index) {
+    image_index_ = image_index;
+  }
+
+  // Size of img_path. Returns false if the image cannot be read; failures
+  // are not cached, the image is opened again next time.
+  bool GetSize(const std::string& img_path, int& width, int& height);
+  // Read an image list, one path per row, and look up all its images.
+  // Unreadable images are left out. Returns false if the list cannot be
+  // opened.
+  bool ReadImageList(const std::string& image_list,
+                     std::vector<std::string>& image_paths,
+                     std::vector<cv::Size>& image_sizes);
+
+  // Number of images opened so far, i.e. misses of both the cache and the
+  // index.
+  int probe_num() const {
+    return probe_num_;
+  }
+
+private:
+  class ImageSize {
+  public:
+    std::string path_;
+    int64_t mtime_;        // Nanoseconds.
+    int64_t file_size_;
+    int width_;
+    int height_;
+  };
+  typedef std::list<ImageSize> ImageSizeList;
+
+  size_t capacity_;
+  std::mutex mutex_;
+  // Most recently used first.
+  ImageSizeList sizes_;
+  std::unordered_map<std::string, ImageSizeList::iterator> lookup_;
+  const ImageIndex* image_index_;
+  int probe_num_;
+};
+
+#endif /* defined(__wu_collage_advanced__image_size_cache__) */
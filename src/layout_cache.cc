@@ -0,0 +1,184 @@
+//
+//  layout_cache.cc
+//  wu_collage_advanced
+//
+//  Size-bounded LRU cache of finished layout trees.
+//
+
+#include "layout_cache.h"
+#include <atomic>
+#include <fstream>
+#include <math.h>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Layout files start with this magic and version.
+static const char kLayoutMagic[4] = {'W', 'C', 'L', 'C'};
+static const int32_t kLayoutVersion = 2;
+// Numbers the temporary files of this process.
+static std::atomic<unsigned int> temp_counter(0);
+
+namespace {
+
+int32_t FloatBits(float value) {
+  int32_t bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+}  // namespace
+
+LayoutKey::LayoutKey(const std::vector<float>& sorted_alphas,
+                     int canvas_width, float expect_alpha, float thresh) {
+  words_.reserve(sorted_alphas.size() + 3);
+  words_.push_back(canvas_width);
+  words_.push_back(FloatBits(expect_alpha));
+  words_.push_back(FloatBits(thresh));
+  for (int i = 0; i < sorted_alphas.size(); ++i) {
+    words_.push_back(static_cast<int32_t>(
+        floor(log(sorted_alphas[i]) * kAlphaQuantScale + 0.5)));
+  }
+  // FNV-1a over the words.
+  hash_ = 14695981039346656037ULL;
+  for (int i = 0; i < words_.size(); ++i) {
+    hash_ ^= static_cast<uint32_t>(words_[i]);
+    hash_ *= 1099511628211ULL;
+  }
+}
+
+bool LayoutCache::Get(const LayoutKey& key, std::vector<int>& code) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<uint64_t, EntryList::iterator>::iterator it =
+        lookup_.find(key.hash());
+    if ((it != lookup_.end()) && (it->second->key_ == key)) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      code = it->second->code_;
+      ++hit_num_;
+      return true;
+    }
+  }
+  if (!disk_dir_.empty() && ReadDisk(key, code)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Insert(key, code);
+    ++disk_hit_num_;
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++miss_num_;
+  return false;
+}
+
+void LayoutCache::Put(const LayoutKey& key, const std::vector<int>& code) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Insert(key, code);
+  }
+  if (!disk_dir_.empty()) WriteDisk(key, code);
+}
+
+void LayoutCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  lookup_.clear();
+  total_bytes_ = 0;
+}
+
+void LayoutCache::Insert(const LayoutKey& key, const std::vector<int>& code) {
+  std::unordered_map<uint64_t, EntryList::iterator>::iterator it =
+      lookup_.find(key.hash());
+  if (it != lookup_.end()) {
+    total_bytes_ -= it->second->bytes_;
+    entries_.erase(it->second);
+    lookup_.erase(it);
+  }
+  Entry entry;
+  entry.key_ = key;
+  entry.code_ = code;
+  entry.bytes_ = sizeof(Entry) + key.words().size() * sizeof(int32_t) +
+                 code.size() * sizeof(int);
+  entries_.push_front(entry);
+  lookup_[key.hash()] = entries_.begin();
+  total_bytes_ += entry.bytes_;
+  Evict();
+}
+
+void LayoutCache::Evict() {
+  // The entry just used is at the front and is always kept.
+  while ((total_bytes_ > capacity_bytes_) && (entries_.size() > 1)) {
+    Entry& victim = entries_.back();
+    total_bytes_ -= victim.bytes_;
+    lookup_.erase(victim.key_.hash());
+    entries_.pop_back();
+  }
+}
+
+std::string LayoutCache::DiskPath(const LayoutKey& key) const {
+  std::ostringstream path;
+  path << disk_dir_ << "/" << std::hex << key.hash() << ".layout";
+  return path.str();
+}
+
+// File layout: magic, version, key word number, code number (int32 each),
+// then the key words and the code. The key is compared in full, so a hash
+// collision reads as a miss.
+bool LayoutCache::ReadDisk(const LayoutKey& key,
+                           std::vector<int>& code) const {
+  std::ifstream file(DiskPath(key).c_str(), std::ios::in | std::ios::binary);
+  if (!file) return false;
+  char magic[4];
+  int32_t header[3];
+  if (!file.read(magic, sizeof(magic)) ||
+      !file.read(reinterpret_cast<char*>(header), sizeof(header)))
+    return false;
+  if ((memcmp(magic, kLayoutMagic, sizeof(magic)) != 0) ||
+      (header[0] != kLayoutVersion) ||
+      (header[1] != static_cast<int32_t>(key.words().size())) ||
+      (header[2] < 0))
+    return false;
+  std::vector<int32_t> words(header[1]);
+  if (!words.empty() &&
+      !file.read(reinterpret_cast<char*>(&words[0]),
+                 words.size() * sizeof(int32_t)))
+    return false;
+  if (words != key.words()) return false;
+  std::vector<int32_t> stored(header[2]);
+  if (!stored.empty() &&
+      !file.read(reinterpret_cast<char*>(&stored[0]),
+                 stored.size() * sizeof(int32_t)))
+    return false;
+  code.assign(stored.begin(), stored.end());
+  return true;
+}
+
+// Written under a name private to this process and call, then renamed, so
+// that other processes never see a partial file.
+void LayoutCache::WriteDisk(const LayoutKey& key,
+                            const std::vector<int>& code) const {
+  std::string disk_path = DiskPath(key);
+  std::ostringstream tmp_path;
+  tmp_path << disk_path << "." << getpid() << "_" << temp_counter++ << ".tmp";
+  std::ofstream file(tmp_path.str().c_str(),
+                     std::ios::out | std::ios::binary | std::ios::trunc);
+  // The disk copy is best effort, the layout is cached in memory anyway.
+  if (!file) return;
+  int32_t header[3] = {kLayoutVersion,
+                       static_cast<int32_t>(key.words().size()),
+                       static_cast<int32_t>(code.size())};
+  std::vector<int32_t> stored(code.begin(), code.end());
+  file.write(kLayoutMagic, sizeof(kLayoutMagic));
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(&key.words()[0]),
+             key.words().size() * sizeof(int32_t));
+  if (!stored.empty())
+    file.write(reinterpret_cast<const char*>(&stored[0]),
+               stored.size() * sizeof(int32_t));
+  file.close();
+  if (file) {
+    rename(tmp_path.str().c_str(), disk_path.c_str());
+  } else {
+    remove(tmp_path.str().c_str());
+  }
+}
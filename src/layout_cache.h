@@ -0,0 +1,123 @@
+//
+//  layout_cache.h
+//  wu_collage_advanced
+//
+//  Size-bounded LRU cache of finished layout trees.
+//
+
+#ifndef __wu_collage_advanced__layout_cache__
+#define __wu_collage_advanced__layout_cache__
+
+#include <list>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Aspect ratios are compared in steps of 1 / kAlphaQuantScale in log space,
+// i.e. about 0.5%. Image sets closer than that share their layouts.
+static const float kAlphaQuantScale = 200;
+
+// Identifies a layout request: the multiset of quantized aspect ratios plus
+// the canvas parameters. The random seed is left out on purpose: any layout
+// within thresh answers the request, whichever seed found it, so unseeded
+// callers (a new default seed every time) hit the cache too.
+class LayoutKey {
+public:
+  LayoutKey() : hash_(0) {}
+  // sorted_alphas must be sorted (CollageLayout sorts its images before
+  // searching).
+  LayoutKey(const std::vector<float>& sorted_alphas, int canvas_width,
+            float expect_alpha, float thresh);
+
+  bool operator==(const LayoutKey& other) const {
+    return (hash_ == other.hash_) && (words_ == other.words_);
+  }
+  uint64_t hash() const {
+    return hash_;
+  }
+  // The parameters, then the quantized aspect ratios.
+  const std::vector<int32_t>& words() const {
+    return words_;
+  }
+
+private:
+  std::vector<int32_t> words_;
+  uint64_t hash_;
+};
+
+// Keeps the compact form (see CollageTree::Encode) of recently found layouts,
+// so that a repeated request skips the tree search and only computes the
+// positions. The least recently used layouts are dropped once their size
+// exceeds the capacity.
+//
+// With a disk directory, every layout put in the cache is also written there
+// and survives the process; several processes can share the directory.
+//
+// All methods are thread-safe.
+class LayoutCache {
+public:
+  explicit LayoutCache(size_t capacity_bytes,
+                       const std::string& disk_dir = "")
+      : capacity_bytes_(capacity_bytes), disk_dir_(disk_dir),
+        total_bytes_(0), hit_num_(0), disk_hit_num_(0), miss_num_(0) {}
+
+  // The layout stored for key, from memory or disk. Returns false if there
+  // is none.
+  bool Get(const LayoutKey& key, std::vector<int>& code);
+  // Store the layout for key, replacing any previous one.
+  void Put(const LayoutKey& key, const std::vector<int>& code);
+  // Drop everything held in memory. The disk directory is kept.
+  void Clear();
+
+  // Accessors:
+  size_t capacity_bytes() const {
+    return capacity_bytes_;
+  }
+  size_t total_bytes() const {
+    return total_bytes_;
+  }
+  long long hit_num() const {
+    return hit_num_;
+  }
+  long long disk_hit_num() const {
+    return disk_hit_num_;
+  }
+  long long miss_num() const {
+    return miss_num_;
+  }
+
+private:
+  class Entry {
+  public:
+    LayoutKey key_;
+    std::vector<int> code_;
+    size_t bytes_;
+  };
+  typedef std::list<Entry> EntryList;
+
+  // Insert or refresh key in memory. Needs the lock.
+  void Insert(const LayoutKey& key, const std::vector<int>& code);
+  // Path of key's file in disk_dir_.
+  std::string DiskPath(const LayoutKey& key) const;
+  bool ReadDisk(const LayoutKey& key, std::vector<int>& code) const;
+  void WriteDisk(const LayoutKey& key, const std::vector<int>& code) const;
+  // Drop least recently used layouts down to the capacity. Needs the lock.
+  void Evict();
+
+  size_t capacity_bytes_;
+  std::string disk_dir_;
+  // Most recently used first.
+  EntryList entries_;
+  // Keyed by LayoutKey::hash(); a colliding key replaces the entry.
+  std::unordered_map<uint64_t, EntryList::iterator> lookup_;
+  size_t total_bytes_;
+  long long hit_num_;
+  long long disk_hit_num_;
+  long long miss_num_;
+  std::mutex mutex_;
+};
+
+#endif /* defined(__wu_collage_advanced__layout_cache__) */
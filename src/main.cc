@@ -7,14 +7,121 @@
 //
 
 #include "wu_collage_advanced.h"
+#include "collage_batch.h"
+#include "collage_log.h"
+#include "collage_server.h"
+#include "collage_stats.h"
+#include <chrono>
+#include <fstream>
 #include <iostream>
-#include <time.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <vector>
+
+// The server of --serve, stopped by SIGINT and SIGTERM.
+static CollageServer* g_server = NULL;
+
+static void StopServer(int) {
+  if (g_server != NULL) g_server->Stop();
+}
+
+// Writes the files asked for by --stats and --trace when main returns.
+class StatsOutput {
+public:
+  ~StatsOutput() {
+    if (!stats_path_.empty()) {
+      std::ofstream stats(stats_path_.c_str());
+      CollageStats::WriteJson(stats);
+      if (!stats)
+        std::cout << "Error: cannot write " << stats_path_ << std::endl;
+    }
+    if (!trace_path_.empty()) {
+      std::ofstream trace(trace_path_.c_str());
+      CollageStats::WriteTrace(trace);
+      if (!trace)
+        std::cout << "Error: cannot write " << trace_path_ << std::endl;
+    }
+  }
+  std::string stats_path_;
+  std::string trace_path_;
+};
+
+static int LogLevelOf(const std::string& name) {
+  if (name == "quiet") return -1;
+  if (name == "error") return kLogError;
+  if (name == "warning") return kLogWarning;
+  if (name == "info") return kLogInfo;
+  if (name == "debug") return kLogDebug;
+  return atoi(name.c_str());
+}
 
 int main(int argc, const char * argv[]) {
+  // Options of every mode, before the mode's own arguments:
+  //   --stats=path  phase counters and latency histograms as JSON
+  //   --trace=path  every timed phase in the Chrome trace event format
+  //   --log=level   quiet, error, warning (default), info or debug
+  StatsOutput stats_output;
+  std::vector<const char*> args(1, argv[0]);
+  int arg = 1;
+  for (; arg < argc; ++arg) {
+    std::string option(argv[arg]);
+    if (option.compare(0, 8, "--stats=") == 0) {
+      stats_output.stats_path_ = option.substr(8);
+      CollageStats::set_enabled(true);
+    } else if (option.compare(0, 8, "--trace=") == 0) {
+      stats_output.trace_path_ = option.substr(8);
+      CollageStats::set_tracing(true);
+    } else if (option.compare(0, 6, "--log=") == 0) {
+      CollageLog::set_level(LogLevelOf(option.substr(6)));
+    } else {
+      break;
+    }
+  }
+  args.insert(args.end(), argv + arg, argv + argc);
+  argc = static_cast<int>(args.size());
+  argv = &args[0];
+
+  // Batch mode:
+  //   collage --batch manifest
+  //           [thread_num [index_file [tile_cache_dir [layout_cache_dir]]]]
+  // Runs every job of the manifest without any interaction.
+  if ((argc >= 3) && (std::string(argv[1]) == "--batch")) {
+    int thread_num = (argc >= 4) ? atoi(argv[3]) : 0;
+    CollageBatch batch(thread_num, 256 << 20, (argc >= 6) ? argv[5] : "",
+                       (argc >= 7) ? argv[6] : "");
+    ImageIndex image_index;
+    if ((argc >= 5) && image_index.Open(argv[4]))
+      batch.set_image_index(&image_index);
+    if (!batch.ReadManifest(argv[2])) return -1;
+    int failed_num = batch.Run(std::cout);
+    return (failed_num == 0) ? 0 : -1;
+  }
+
+  // Server mode:
+  //   collage --serve socket_path [thread_num [queue_size [index_file
+  //           [tile_cache_dir [layout_cache_dir]]]]]
+  // Serves collages on a Unix domain socket until interrupted, see
+  // collage_server.h for the protocol.
+  if ((argc >= 3) && (std::string(argv[1]) == "--serve")) {
+    int thread_num = (argc >= 4) ? atoi(argv[3]) : 0;
+    int queue_size = (argc >= 5) ? atoi(argv[4]) : 64;
+    CollageServer server(thread_num, queue_size, 256 << 20,
+                         (argc >= 7) ? argv[6] : "",
+                         (argc >= 8) ? argv[7] : "");
+    ImageIndex image_index;
+    if ((argc >= 6) && image_index.Open(argv[5]))
+      server.set_image_index(&image_index);
+    g_server = &server;
+    signal(SIGINT, StopServer);
+    signal(SIGTERM, StopServer);
+    bool success = server.Serve(argv[2], std::cout);
+    g_server = NULL;
+    return success ? 0 : -1;
+  }
+
   std::cout << "Well come to \"Collage Advanced\"" << std::endl << std::endl;;
   
-  if (argc != 2) {
+  if ((argc < 2) || (argc > 4)) {
     std::cout << "Error number of input arguments" << std::endl;
     return 0;
   }
@@ -30,28 +137,39 @@ int main(int argc, const char * argv[]) {
     std::cin >> expect_alpha;
   }
   
-  clock_t start, end;
-  CollageAdvanced my_collage(image_list, canvas_width);
+  // An optional seed reproduces a previous layout.
+  uint64_t random_seed = CollageRandom::DefaultSeed();
+  if (argc >= 3) random_seed = strtoull(argv[2], NULL, 10);
+  // An optional image size index (see collage_index) avoids opening images.
+  ImageIndex image_index;
+  if ((argc == 4) && !image_index.Open(argv[3]))
+    std::cout << "Error: cannot open index " << argv[3] << std::endl;
+  CollageAdvanced my_collage(image_list, canvas_width, random_seed,
+                             image_index.is_open() ? &image_index : NULL);
   
-  start = clock();
-  //bool success = my_collage.CreateCollage();
+  // Images are decoded while the layout is searched, so the time below
+  // covers both.
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
   int total_tree_generation = 0;
   int total_adjust_iteration = 0;
-  int success = my_collage.CreateCollage(expect_alpha, 1.1,
-                                         total_tree_generation,
-                                         total_adjust_iteration);
+  cv::Mat canvas;
+  int success = my_collage.CreateCollageImage(expect_alpha, 1.1,
+                                              total_tree_generation,
+                                              total_adjust_iteration,
+                                              canvas);
   if (success == -1) {
     return -1;
   }
-  end = clock();
-  cv::Mat canvas = my_collage.OutputCollageImage();
+  long long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
   int canvas_height = my_collage.canvas_height();
   float canvas_alpha = my_collage.canvas_alpha();
   std::cout << "Tree re-generation number: " << total_tree_generation << std::endl;
   std::cout << "Tree adjust number: " << total_adjust_iteration << std::endl;
   std::cout << "canvas_height: " << canvas_height << std::endl;
   std::cout << "canvas_alpha: " << canvas_alpha << std::endl;
-  std::cout << "processing time: " << (end - start) * 1000000 / CLOCKS_PER_SEC
+  std::cout << "random_seed: " << random_seed << std::endl;
+  std::cout << "processing time (layout and rendering): " << elapsed_us
   << " us (10e-6 s)" << std::endl;
   std::string html_save_path = "/tmp/collage_result.html";
   my_collage.OutputCollageHtml(html_save_path);
@@ -0,0 +1,263 @@
+//
+//  tile_cache.cc
+//  wu_collage_advanced
+//
+//  Size-bounded LRU cache of decoded, pre-downscaled tile images.
+//
+
+#include "tile_cache.h"
+#include "collage_stats.h"
+#include "image_probe.h"
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pyramids stop before a level gets smaller than this on either side.
+static const int kMinLevelSide = 32;
+// Tile files start with this magic and version.
+static const char kTileMagic[4] = {'W', 'C', 'T', 'C'};
+static const int32_t kTileVersion = 1;
+// Larger stored images are taken for corrupt.
+static const int32_t kMaxDiskSide = 1 << 16;
+// Numbers the temporary files of this process.
+static std::atomic<unsigned int> temp_counter(0);
+
+int ReducedReadFlag(const cv::Size& image_size, const cv::Size& tile_size) {
+#if CV_MAJOR_VERSION >= 3
+  int width = image_size.width;
+  int height = image_size.height;
+  if ((width >= tile_size.width * 8) && (height >= tile_size.height * 8))
+    return cv::IMREAD_REDUCED_COLOR_8;
+  if ((width >= tile_size.width * 4) && (height >= tile_size.height * 4))
+    return cv::IMREAD_REDUCED_COLOR_4;
+  if ((width >= tile_size.width * 2) && (height >= tile_size.height * 2))
+    return cv::IMREAD_REDUCED_COLOR_2;
+  return cv::IMREAD_COLOR;
+#else
+  return 1;  // CV_LOAD_IMAGE_COLOR
+#endif
+}
+
+int ReducedReadFlag(const std::string& img_path, const cv::Size& tile_size) {
+  // An image that cannot be probed is decoded in full.
+  int width = 0;
+  int height = 0;
+  ProbeImageSize(img_path, width, height);
+  return ReducedReadFlag(cv::Size(width, height), tile_size);
+}
+
+cv::Mat ReadTileImage(const std::string& img_path, const cv::Size& tile_size,
+                      TileCache* tile_cache) {
+  if (tile_cache != NULL) return tile_cache->Get(img_path, tile_size);
+  int flag = ReducedReadFlag(img_path, tile_size);
+  StatTimer timer(kStatDecode);
+  return cv::imread(img_path.c_str(), flag);
+}
+
+cv::Mat TileCache::Get(const std::string& img_path,
+                       const cv::Size& tile_size) {
+  struct stat st;
+  if (stat(img_path.c_str(), &st) != 0) return cv::Mat();
+  int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                  st.st_mtim.tv_nsec;
+  int64_t file_size = static_cast<int64_t>(st.st_size);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, PyramidList::iterator>::iterator it =
+        lookup_.find(img_path);
+    if ((it != lookup_.end()) && (it->second->mtime_ == mtime) &&
+        (it->second->file_size_ == file_size)) {
+      cv::Mat level = FindLevel(*it->second, tile_size);
+      if (!level.empty()) {
+        pyramids_.splice(pyramids_.begin(), pyramids_, it->second);
+        ++hit_num_;
+        return level;
+      }
+    }
+  }
+
+  // Missing, modified, or cached smaller than this tile needs.
+  Pyramid pyramid;
+  Load(img_path, mtime, file_size, tile_size, pyramid);
+  if (pyramid.levels_.empty()) return cv::Mat();
+  cv::Mat level = FindLevel(pyramid, tile_size);
+  // Reduced decodes are chosen to cover the tile, this is only a safeguard.
+  if (level.empty()) level = pyramid.levels_[0];
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_map<std::string, PyramidList::iterator>::iterator it =
+      lookup_.find(img_path);
+  if (it != lookup_.end()) {
+    total_bytes_ -= it->second->bytes_;
+    pyramids_.erase(it->second);
+  }
+  pyramids_.push_front(pyramid);
+  lookup_[img_path] = pyramids_.begin();
+  total_bytes_ += pyramid.bytes_;
+  Evict();
+  return level;
+}
+
+void TileCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pyramids_.clear();
+  lookup_.clear();
+  total_bytes_ = 0;
+}
+
+cv::Mat TileCache::FindLevel(const Pyramid& pyramid,
+                             const cv::Size& tile_size) {
+  for (int i = static_cast<int>(pyramid.levels_.size()) - 1; i >= 0; --i) {
+    const cv::Mat& level = pyramid.levels_[i];
+    if ((level.cols >= tile_size.width) && (level.rows >= tile_size.height))
+      return level;
+  }
+  if (pyramid.full_size_) return pyramid.levels_[0];
+  return cv::Mat();
+}
+
+void TileCache::Load(const std::string& img_path, int64_t mtime,
+                     int64_t file_size, const cv::Size& tile_size,
+                     Pyramid& pyramid) {
+  pyramid.path_ = img_path;
+  pyramid.mtime_ = mtime;
+  pyramid.file_size_ = file_size;
+  pyramid.full_size_ = false;
+  pyramid.bytes_ = 0;
+  bool disk_hit = false;
+  cv::Mat image;
+  std::string disk_path;
+  if (!disk_dir_.empty()) {
+    disk_path = DiskPath(img_path, mtime, file_size);
+    {
+      StatTimer timer(kStatDecode);
+      disk_hit = ReadDisk(disk_path, img_path, tile_size, image);
+    }
+    if (disk_hit) {
+      int full_width = 0;
+      int full_height = 0;
+      pyramid.full_size_ = ProbeImageSize(img_path, full_width, full_height) &&
+                           (full_width == image.cols) &&
+                           (full_height == image.rows);
+    }
+  }
+  if (image.empty()) {
+    int flag = ReducedReadFlag(img_path, tile_size);
+    {
+      StatTimer timer(kStatDecode);
+      image = cv::imread(img_path.c_str(), flag);
+    }
+    if (image.empty()) return;
+#if CV_MAJOR_VERSION >= 3
+    pyramid.full_size_ = (flag == cv::IMREAD_COLOR);
+#else
+    pyramid.full_size_ = true;
+#endif
+    if (!disk_path.empty()) {
+      StatTimer timer(kStatEncode);
+      WriteDisk(disk_path, img_path, image);
+    }
+  }
+
+  pyramid.levels_.push_back(image);
+  while ((pyramid.levels_.back().cols >= 2 * kMinLevelSide) &&
+         (pyramid.levels_.back().rows >= 2 * kMinLevelSide)) {
+    const cv::Mat& last = pyramid.levels_.back();
+    cv::Mat half;
+    StatTimer timer(kStatResize);
+    cv::resize(last, half, cv::Size(last.cols / 2, last.rows / 2), 0, 0,
+               cv::INTER_AREA);
+    pyramid.levels_.push_back(half);
+  }
+  for (int i = 0; i < pyramid.levels_.size(); ++i) {
+    pyramid.bytes_ += pyramid.levels_[i].total() *
+                      pyramid.levels_[i].elemSize();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (disk_hit) {
+    ++disk_hit_num_;
+  } else {
+    ++miss_num_;
+  }
+}
+
+std::string TileCache::DiskPath(const std::string& img_path, int64_t mtime,
+                                int64_t file_size) const {
+  std::ostringstream path;
+  path << disk_dir_;
+  if (disk_dir_[disk_dir_.size() - 1] != '/') path << "/";
+  path << std::hex << std::hash<std::string>()(img_path) << std::dec << "_"
+       << mtime << "_" << file_size << ".tile";
+  return path.str();
+}
+
+// File layout: magic, version, path length, rows, cols, type (int32 each),
+// then the source path and the pixels row by row.
+bool TileCache::ReadDisk(const std::string& disk_path,
+                         const std::string& img_path,
+                         const cv::Size& tile_size, cv::Mat& image) {
+  std::ifstream file(disk_path.c_str(), std::ios::in | std::ios::binary);
+  if (!file) return false;
+  char magic[4];
+  int32_t header[5];
+  if (!file.read(magic, sizeof(magic)) ||
+      !file.read(reinterpret_cast<char*>(header), sizeof(header)))
+    return false;
+  if ((memcmp(magic, kTileMagic, sizeof(magic)) != 0) ||
+      (header[0] != kTileVersion) ||
+      (header[1] != static_cast<int32_t>(img_path.size())) ||
+      (header[2] < tile_size.height) || (header[2] > kMaxDiskSide) ||
+      (header[3] < tile_size.width) || (header[3] > kMaxDiskSide) ||
+      (header[2] <= 0) || (header[3] <= 0) || (header[4] != CV_8UC3))
+    return false;
+  std::string stored_path(header[1], '\0');
+  if (!stored_path.empty() && !file.read(&stored_path[0], stored_path.size()))
+    return false;
+  if (stored_path != img_path) return false;
+  cv::Mat stored(header[2], header[3], header[4]);
+  if (!file.read(reinterpret_cast<char*>(stored.data),
+                 stored.total() * stored.elemSize()))
+    return false;
+  image = stored;
+  return true;
+}
+
+// Written under a name private to this process and call, then renamed, so
+// concurrent writers and readers of the same image never see a partial file.
+void TileCache::WriteDisk(const std::string& disk_path,
+                          const std::string& img_path, const cv::Mat& image) {
+  if ((image.type() != CV_8UC3) || !image.isContinuous()) return;
+  std::ostringstream tmp_path;
+  tmp_path << disk_path << "." << getpid() << "_" << temp_counter++ << ".tmp";
+  std::ofstream file(tmp_path.str().c_str(),
+                     std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file) return;
+  int32_t header[5] = {kTileVersion, static_cast<int32_t>(img_path.size()),
+                       image.rows, image.cols, image.type()};
+  file.write(kTileMagic, sizeof(kTileMagic));
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  file.write(img_path.data(), img_path.size());
+  file.write(reinterpret_cast<const char*>(image.data),
+             image.total() * image.elemSize());
+  file.close();
+  if (file) {
+    rename(tmp_path.str().c_str(), disk_path.c_str());
+  } else {
+    remove(tmp_path.str().c_str());
+  }
+}
+
+void TileCache::Evict() {
+  while ((total_bytes_ > capacity_bytes_) && !pyramids_.empty()) {
+    Pyramid& last = pyramids_.back();
+    total_bytes_ -= last.bytes_;
+    lookup_.erase(last.path_);
+    pyramids_.pop_back();
+  }
+}
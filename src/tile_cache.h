@@ -0,0 +1,121 @@
+//
+//  tile_cache.h
+//  wu_collage_advanced
+//
+//  Size-bounded LRU cache of decoded, pre-downscaled tile images.
+//
+
+#ifndef __wu_collage_advanced__tile_cache__
+#define __wu_collage_advanced__tile_cache__
+
+#include <list>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Choose the cv::imread flag for a tile. JPEG (DCT scaling) and WebP decoders
+// can produce a 1/2, 1/4 or 1/8 image directly, which is much cheaper than a
+// full decode. We take the strongest reduction that still leaves the decoded
+// image at least as large as the tile.
+int ReducedReadFlag(const std::string& img_path, const cv::Size& tile_size);
+// Same as above for an image of known size.
+int ReducedReadFlag(const cv::Size& image_size, const cv::Size& tile_size);
+
+// Keeps a pyramid (each level half the size of the previous one) of every
+// image rendered recently, keyed by path, modification time (to the
+// nanosecond) and file size. Rendering the same photos again, at any size up
+// to the one first decoded, needs no decoding at all. The least recently used
+// pyramids are dropped once the pixels exceed the capacity.
+//
+// With a disk directory, the largest level of every decoded image is also
+// stored there as raw pixels and survives the process; loading it is a plain
+// read instead of a JPEG decode. Each file records the source path, which is
+// checked on load, so two images whose path hashes collide never mix.
+//
+// All methods are thread-safe, decoding happens outside the lock.
+class TileCache {
+public:
+  explicit TileCache(size_t capacity_bytes, const std::string& disk_dir = "")
+      : capacity_bytes_(capacity_bytes), disk_dir_(disk_dir),
+        total_bytes_(0), hit_num_(0), disk_hit_num_(0), miss_num_(0) {}
+
+  // The smallest cached level of img_path at least as large as tile_size in
+  // both dimensions, decoding (and caching) the image if there is none.
+  // The result shares its pixels with the cache and must not be modified.
+  // Returns an empty Mat if the image cannot be read.
+  cv::Mat Get(const std::string& img_path, const cv::Size& tile_size);
+  // Drop everything held in memory. The disk directory is kept.
+  void Clear();
+
+  // Accessors:
+  size_t capacity_bytes() const {
+    return capacity_bytes_;
+  }
+  size_t total_bytes() const {
+    return total_bytes_;
+  }
+  long long hit_num() const {
+    return hit_num_;
+  }
+  long long disk_hit_num() const {
+    return disk_hit_num_;
+  }
+  long long miss_num() const {
+    return miss_num_;
+  }
+
+private:
+  class Pyramid {
+  public:
+    std::string path_;
+    int64_t mtime_;          // Nanoseconds.
+    int64_t file_size_;
+    // levels_[0] is the largest, as decoded.
+    std::vector<cv::Mat> levels_;
+    // levels_[0] is the image at its original size, so no request can need
+    // a larger level.
+    bool full_size_;
+    size_t bytes_;
+  };
+  typedef std::list<Pyramid> PyramidList;
+
+  // Smallest level of pyramid covering tile_size, or an empty Mat.
+  static cv::Mat FindLevel(const Pyramid& pyramid, const cv::Size& tile_size);
+  // Decode img_path for tile_size, from the disk cache if possible.
+  void Load(const std::string& img_path, int64_t mtime, int64_t file_size,
+            const cv::Size& tile_size, Pyramid& pyramid);
+  // Path of img_path's file in disk_dir_ for this version of the image.
+  std::string DiskPath(const std::string& img_path, int64_t mtime,
+                       int64_t file_size) const;
+  // Read the image stored for img_path at disk_path if it is at least
+  // tile_size. Returns false on any mismatch.
+  static bool ReadDisk(const std::string& disk_path,
+                       const std::string& img_path, const cv::Size& tile_size,
+                       cv::Mat& image);
+  // Store image for img_path at disk_path, best effort.
+  static void WriteDisk(const std::string& disk_path,
+                        const std::string& img_path, const cv::Mat& image);
+  // Drop least recently used pyramids down to the capacity. Needs the lock.
+  void Evict();
+
+  size_t capacity_bytes_;
+  std::string disk_dir_;
+  // Most recently used first.
+  PyramidList pyramids_;
+  std::unordered_map<std::string, PyramidList::iterator> lookup_;
+  size_t total_bytes_;
+  long long hit_num_;
+  long long disk_hit_num_;
+  long long miss_num_;
+  std::mutex mutex_;
+};
+
+// Decode the image for a tile of tile_size, or take it from tile_cache if it
+// is not NULL.
+cv::Mat ReadTileImage(const std::string& img_path, const cv::Size& tile_size,
+                      TileCache* tile_cache);
+
+#endif /* defined(__wu_collage_advanced__tile_cache__) */
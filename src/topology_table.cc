@@ -0,0 +1,379 @@
+//
+//  topology_table.cc
+//  wu_collage_advanced
+//
+//  Slicing tree topologies of small collages, enumerated at compile time.
+//
+
+#include "topology_table.h"
+#include <stddef.h>
+
+namespace {
+
+// The tree shapes and cuts of the tables are built by the compiler from the
+// constexpr functions below (C++11: one return statement each, loops are
+// recursions). A shape is a
+// tree of groups whose root cut is left open: (n, t) is the t-th of the
+// ShapeNum(n) shapes with n leaves. A shape with n > 1 leaves splits them
+// into k groups, the first n % k of n / k + 1 leaves and the others of n / k,
+// and the groups of one size are a multiset of shapes, in increasing order.
+// The groups are then chained into binary nodes of the same cut,
+// cut(G0, cut(G1, ... cut(Gk-2, Gk-1))), and the groups use the other cut.
+
+const int kLeafNode = 0;
+const int kVerticalNode = 1;
+const int kHorizontalNode = 2;
+
+constexpr long long Binomial(long long n, int k) {
+  return (k == 0) ? 1 : Binomial(n - 1, k - 1) * n / k;
+}
+
+// Multisets of b elements out of a types.
+constexpr long long MultisetNum(long long a, int b) {
+  return (b == 0) ? 1 : ((a == 0) ? 0 : Binomial(a + b - 1, b));
+}
+
+constexpr long long ShapeNum(int n);
+
+// Shapes of n leaves in k groups.
+constexpr long long GroupShapeNum(int n, int k) {
+  return ((n % k == 0) ? 1 : MultisetNum(ShapeNum(n / k + 1), n % k)) *
+         MultisetNum(ShapeNum(n / k), k - n % k);
+}
+
+constexpr long long ShapeNumFrom(int n, int k) {
+  return (k > n) ? 0 : GroupShapeNum(n, k) + ShapeNumFrom(n, k + 1);
+}
+
+constexpr long long ShapeNum(int n) {
+  return (n == 1) ? 1 : ShapeNumFrom(n, 2);
+}
+
+// ShapeNum once and for all, the functions below only look it up.
+constexpr long long kShapeNums[kMaxTableImages + 1] = {
+    0, ShapeNum(1), ShapeNum(2), ShapeNum(3), ShapeNum(4), ShapeNum(5),
+    ShapeNum(6), ShapeNum(7), ShapeNum(8), ShapeNum(9), ShapeNum(10),
+    ShapeNum(11), ShapeNum(12), ShapeNum(13), ShapeNum(14), ShapeNum(15),
+    ShapeNum(16)};
+
+constexpr long long GroupShapes(int n, int k) {
+  return ((n % k == 0) ? 1 : MultisetNum(kShapeNums[n / k + 1], n % k)) *
+         MultisetNum(kShapeNums[n / k], k - n % k);
+}
+
+// Group number of shape (n, t), searched from k groups on.
+constexpr int GroupNum(int n, long long t, int k) {
+  return (t < GroupShapes(n, k)) ? k :
+         GroupNum(n, t - GroupShapes(n, k), k + 1);
+}
+
+// Index of shape (n, t) among the shapes with as many groups.
+constexpr long long GroupShapeIndex(int n, long long t, int k) {
+  return (t < GroupShapes(n, k)) ? t :
+         GroupShapeIndex(n, t - GroupShapes(n, k), k + 1);
+}
+
+// Element j of the t-th multiset of b elements out of a types, elements
+// from x on.
+constexpr long long MultisetElement(long long a, int b, long long t, int j,
+                                    long long x) {
+  return (t >= MultisetNum(a - x, b - 1)) ?
+         MultisetElement(a, b, t - MultisetNum(a - x, b - 1), j, x + 1) :
+         ((j == 0) ? x : MultisetElement(a, b - 1, t, j - 1, x));
+}
+
+// Leaves of group c of shape (n, t) with k groups.
+constexpr int GroupSize(int n, int k, int c) {
+  return (c < n % k) ? n / k + 1 : n / k;
+}
+
+// First leaf of group c.
+constexpr int GroupStart(int n, int k, int c) {
+  return (c < n % k) ? c * (n / k + 1) : n % k + c * (n / k);
+}
+
+// Group holding leaf j.
+constexpr int GroupOfLeaf(int n, int k, int j) {
+  return (j < (n % k) * (n / k + 1)) ? j / (n / k + 1) :
+         n % k + (j - (n % k) * (n / k + 1)) / (n / k);
+}
+
+// Shape index of group c, given the index u among the shapes with k groups.
+constexpr long long GroupShape(int n, int k, long long u, int c) {
+  return (c < n % k) ?
+         MultisetElement(kShapeNums[n / k + 1], n % k,
+                         u / MultisetNum(kShapeNums[n / k], k - n % k),
+                         c, 0) :
+         MultisetElement(kShapeNums[n / k], k - n % k,
+                         u % MultisetNum(kShapeNums[n / k], k - n % k),
+                         c - n % k, 0);
+}
+
+constexpr int OtherCut(int cut) {
+  return (cut == kVerticalNode) ? kHorizontalNode : kVerticalNode;
+}
+
+constexpr uint64_t NodeCode(int n, long long t, int cut);
+
+// Pre-order nodes of the chain of groups c, c + 1, ..., k - 1.
+constexpr uint64_t ChainCode(int n, int k, long long u, int cut, int c) {
+  return (c == k - 1) ?
+         NodeCode(GroupSize(n, k, c), GroupShape(n, k, u, c), OtherCut(cut)) :
+         static_cast<uint64_t>(cut) |
+         (NodeCode(GroupSize(n, k, c), GroupShape(n, k, u, c),
+                   OtherCut(cut)) << 2) |
+         (ChainCode(n, k, u, cut, c + 1) << (4 * GroupSize(n, k, c)));
+}
+
+// Pre-order nodes of shape (n, t) with root cut cut, 2 bits each.
+constexpr uint64_t NodeCode(int n, long long t, int cut) {
+  return (n == 1) ? static_cast<uint64_t>(kLeafNode) :
+         ChainCode(n, GroupNum(n, t, 2), GroupShapeIndex(n, t, 2), cut, 0);
+}
+
+// Nodes of entry i of the table for n images: the shapes with a vertical
+// root cut, then the same ones with a horizontal root cut.
+constexpr uint64_t EntryNodes(int n, long long i) {
+  return (n == 1) ? static_cast<uint64_t>(kLeafNode) :
+         NodeCode(n, i % kShapeNums[n],
+                  (i < kShapeNums[n]) ? kVerticalNode : kHorizontalNode);
+}
+
+constexpr int EntryNum(int n) {
+  return (n == 1) ? 1 : static_cast<int>(2 * kShapeNums[n]);
+}
+
+template <int... I> class IndexList {};
+
+template <int N, int... I>
+class MakeIndexList : public MakeIndexList<N - 1, N - 1, I...> {};
+
+template <int... I>
+class MakeIndexList<0, I...> {
+public:
+  typedef IndexList<I...> Type;
+};
+
+template <int N, typename Indices> class NodeTable;
+
+template <int N, int... I>
+class NodeTable<N, IndexList<I...> > {
+public:
+  static constexpr uint64_t kNodes[sizeof...(I)] = {EntryNodes(N, I)...};
+};
+
+template <int N, int... I>
+constexpr uint64_t NodeTable<N, IndexList<I...> >::kNodes[sizeof...(I)];
+
+template <int N>
+class NodeTableOf
+    : public NodeTable<N, typename MakeIndexList<EntryNum(N)>::Type> {};
+
+// Indexed by image number.
+const uint64_t* const kNodeTables[kMaxTableImages + 1] = {
+    NULL, NodeTableOf<1>::kNodes, NodeTableOf<2>::kNodes,
+    NodeTableOf<3>::kNodes, NodeTableOf<4>::kNodes, NodeTableOf<5>::kNodes,
+    NodeTableOf<6>::kNodes, NodeTableOf<7>::kNodes, NodeTableOf<8>::kNodes,
+    NodeTableOf<9>::kNodes, NodeTableOf<10>::kNodes, NodeTableOf<11>::kNodes,
+    NodeTableOf<12>::kNodes, NodeTableOf<13>::kNodes,
+    NodeTableOf<14>::kNodes, NodeTableOf<15>::kNodes,
+    NodeTableOf<16>::kNodes};
+
+const int kTableSizes[kMaxTableImages + 1] = {
+    0, EntryNum(1), EntryNum(2), EntryNum(3), EntryNum(4), EntryNum(5),
+    EntryNum(6), EntryNum(7), EntryNum(8), EntryNum(9), EntryNum(10),
+    EntryNum(11), EntryNum(12), EntryNum(13), EntryNum(14), EntryNum(15),
+    EntryNum(16)};
+
+constexpr int EntryNumUpTo(int n) {
+  return (n == 0) ? 0 : EntryNum(n) + EntryNumUpTo(n - 1);
+}
+
+static_assert(EntryNum(12) == 106 && EntryNum(16) == 514,
+              "unexpected topology table sizes");
+
+// Expected aspect ratio of a leaf for a canvas of aspect ratio 1, as a
+// reduced fraction. A cut gives its children space in proportion to their
+// leaves: side by side, a child with l out of n leaves has the aspect ratio
+// times l / n, stacked, times n / l. Along a chain of groups this is the
+// same as giving every group of m leaves m / n (or n / m) at once.
+class Fraction {
+public:
+  long long num_;
+  long long den_;
+};
+
+long long Gcd(long long a, long long b) {
+  while (b != 0) {
+    long long c = a % b;
+    a = b;
+    b = c;
+  }
+  return a;
+}
+
+Fraction Scale(const Fraction& f, long long num, long long den) {
+  Fraction scaled;
+  scaled.num_ = f.num_ * num;
+  scaled.den_ = f.den_ * den;
+  long long gcd = Gcd(scaled.num_, scaled.den_);
+  scaled.num_ /= gcd;
+  scaled.den_ /= gcd;
+  return scaled;
+}
+
+// Ranks of the leaves of nodes (n leaves): the leaf expecting the smallest
+// aspect ratio gets the narrowest image. Ties go by position.
+uint64_t LeafRanks(uint64_t nodes, int n) {
+  int node_num = 2 * n - 1;
+  // Leaves below every node, from a backwards pass.
+  int leaf_nums[2 * kMaxTableImages - 1];
+  int stack[kMaxTableImages];
+  int size = 0;
+  for (int p = node_num - 1; p >= 0; --p) {
+    if (((nodes >> (2 * p)) & 3) == kLeafNode) {
+      leaf_nums[p] = 1;
+    } else {
+      leaf_nums[p] = leaf_nums[stack[size - 1]] + leaf_nums[stack[size - 2]];
+      size -= 2;
+    }
+    stack[size++] = p;
+  }
+  // Expectations, top-down. The left child of an inner node p is p + 1, its
+  // right child follows the left subtree.
+  Fraction expects[2 * kMaxTableImages - 1];
+  expects[0].num_ = 1;
+  expects[0].den_ = 1;
+  Fraction leaf_expects[kMaxTableImages];
+  int leaf = 0;
+  for (int p = 0; p < node_num; ++p) {
+    int type = static_cast<int>((nodes >> (2 * p)) & 3);
+    if (type == kLeafNode) {
+      leaf_expects[leaf++] = expects[p];
+      continue;
+    }
+    int left = p + 1;
+    int right = left + 2 * leaf_nums[left] - 1;
+    if (type == kVerticalNode) {
+      expects[left] = Scale(expects[p], leaf_nums[left], leaf_nums[p]);
+      expects[right] = Scale(expects[p], leaf_nums[right], leaf_nums[p]);
+    } else {
+      expects[left] = Scale(expects[p], leaf_nums[p], leaf_nums[left]);
+      expects[right] = Scale(expects[p], leaf_nums[p], leaf_nums[right]);
+    }
+  }
+  uint64_t ranks = 0;
+  for (int j = 0; j < n; ++j) {
+    uint64_t rank = 0;
+    for (int l = 0; l < n; ++l) {
+      long long lhs = leaf_expects[l].num_ * leaf_expects[j].den_;
+      long long rhs = leaf_expects[j].num_ * leaf_expects[l].den_;
+      if ((lhs < rhs) || ((lhs == rhs) && (l < j))) ++rank;
+    }
+    ranks |= rank << (4 * j);
+  }
+  return ranks;
+}
+
+// The entries of all the tables, with their ranks. Filled once, on first
+// use.
+class Entries {
+public:
+  Entries() {
+    int offset = 0;
+    for (int n = 1; n <= kMaxTableImages; ++n) {
+      offsets_[n] = offset;
+      for (int i = 0; i < kTableSizes[n]; ++i) {
+        Topology& entry = entries_[offset + i];
+        entry.nodes_ = kNodeTables[n][i];
+        entry.ranks_ = LeafRanks(entry.nodes_, n);
+      }
+      offset += kTableSizes[n];
+    }
+  }
+  const Topology* Of(int image_num) const {
+    return entries_ + offsets_[image_num];
+  }
+
+private:
+  Topology entries_[EntryNumUpTo(kMaxTableImages)];
+  int offsets_[kMaxTableImages + 1];
+};
+
+const Entries& AllEntries() {
+  static const Entries entries;
+  return entries;
+}
+
+}  // namespace
+
+int TopologyTable::Count(int image_num) {
+  if ((image_num < 1) || (image_num > kMaxTableImages)) return 0;
+  return kTableSizes[image_num];
+}
+
+const Topology* TopologyTable::Entries(int image_num) {
+  if ((image_num < 1) || (image_num > kMaxTableImages)) return NULL;
+  return AllEntries().Of(image_num);
+}
+
+// The nodes are read backwards, so both children of an inner node are on the
+// stack when it comes: the left one on top.
+float TopologyTable::Evaluate(const Topology& topology, int image_num,
+                              const float* sorted_alphas) {
+  float stack[kMaxTableImages];
+  int size = 0;
+  int leaf = image_num - 1;
+  for (int p = 2 * image_num - 2; p >= 0; --p) {
+    int type = static_cast<int>((topology.nodes_ >> (2 * p)) & 3);
+    if (type == kLeafNode) {
+      stack[size++] =
+          sorted_alphas[(topology.ranks_ >> (4 * leaf)) & 15];
+      --leaf;
+      continue;
+    }
+    float left_alpha = stack[--size];
+    float right_alpha = stack[size - 1];
+    if (type == kVerticalNode) {
+      stack[size - 1] = left_alpha + right_alpha;
+    } else {
+      stack[size - 1] = (left_alpha * right_alpha) /
+                        (left_alpha + right_alpha);
+    }
+  }
+  return stack[0];
+}
+
+int TopologyTable::Closest(int image_num, const float* sorted_alphas,
+                           float expect_alpha, float& alpha) {
+  int count = Count(image_num);
+  const Topology* entries = Entries(image_num);
+  int best = -1;
+  float best_distance = 0;
+  for (int i = 0; i < count; ++i) {
+    float entry_alpha = Evaluate(entries[i], image_num, sorted_alphas);
+    float distance = (entry_alpha > expect_alpha) ?
+                     entry_alpha / expect_alpha : expect_alpha / entry_alpha;
+    if ((best == -1) || (distance < best_distance)) {
+      best = i;
+      best_distance = distance;
+      alpha = entry_alpha;
+    }
+  }
+  return best;
+}
+
+void TopologyTable::Code(const Topology& topology, int image_num,
+                         std::vector<int>& code) {
+  code.resize(2 * image_num - 1);
+  int leaf = 0;
+  for (int p = 0; p < 2 * image_num - 1; ++p) {
+    int type = static_cast<int>((topology.nodes_ >> (2 * p)) & 3);
+    if (type == kLeafNode) {
+      code[p] = static_cast<int>((topology.ranks_ >> (4 * leaf)) & 15);
+      ++leaf;
+    } else {
+      code[p] = (type == kVerticalNode) ? -1 : -2;
+    }
+  }
+}
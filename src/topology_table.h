@@ -0,0 +1,61 @@
+//
+//  topology_table.h
+//  wu_collage_advanced
+//
+//  Slicing tree topologies of small collages, enumerated at compile time.
+//
+
+#ifndef __wu_collage_advanced__topology_table__
+#define __wu_collage_advanced__topology_table__
+
+#include <stdint.h>
+#include <vector>
+
+// Largest image number with a table.
+static const int kMaxTableImages = 16;
+
+// One layout tree shape with its cuts and the image of every leaf.
+// nodes_ holds the 2 * image_num - 1 nodes in pre-order, 2 bits each from
+// the lowest: 0 for a leaf, 1 for a vertical cut ('v', side by side), 2 for
+// a horizontal cut ('h', stacked). ranks_ holds, 4 bits per leaf from left
+// to right, the rank by aspect ratio of the image given to that leaf.
+class Topology {
+public:
+  uint64_t nodes_;
+  uint64_t ranks_;
+};
+
+// For image_num <= kMaxTableImages, the table holds the "balanced" slicing
+// trees: a cut splits its n images into k >= 2 groups of n / k or n / k + 1
+// images, side by side or stacked, and each group is a single image or again
+// such a tree with the other cut. Trees differing only in the order of the
+// groups are kept once. There are 2 entries for 2 images, 106 for 12 and 514
+// for 16.
+// Leaves get images by rank: every leaf expects an aspect ratio (groups
+// sharing a cut get space in proportion to their image numbers), and the
+// images, sorted by aspect ratio, go to the leaves in the order of their
+// expected aspect ratios. That order does not depend on the canvas: the
+// shapes and cuts are generated by the compiler, the ranks are derived from
+// them once, on first use, and evaluating an entry is then a single pass
+// over its nodes.
+class TopologyTable {
+public:
+  // Entries for image_num images, 0 above kMaxTableImages.
+  static int Count(int image_num);
+  static const Topology* Entries(int image_num);
+  // Aspect ratio of topology with image_num images whose aspect ratios in
+  // increasing order are sorted_alphas.
+  static float Evaluate(const Topology& topology, int image_num,
+                        const float* sorted_alphas);
+  // The entry whose aspect ratio is closest to expect_alpha (as a factor),
+  // the first one on ties, and that aspect ratio in alpha. Returns -1 if
+  // there is no table for image_num. Allocates nothing.
+  static int Closest(int image_num, const float* sorted_alphas,
+                     float expect_alpha, float& alpha);
+  // topology in the form of CollageTree::Encode, with the leaves holding
+  // image ranks, ready for CollageTree::Decode.
+  static void Code(const Topology& topology, int image_num,
+                   std::vector<int>& code);
+};
+
+#endif /* defined(__wu_collage_advanced__topology_table__) */
@@ -0,0 +1,158 @@
+//
+//  tree_batch.cc
+//  wu_collage_advanced
+//
+//  Aspect ratios of many candidate trees of the same shape at once.
+//
+
+#include "tree_batch.h"
+#include <assert.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#define TREE_BATCH_LANES 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TREE_BATCH_LANES 4
+#else
+#define TREE_BATCH_LANES 1
+#endif
+
+namespace {
+
+// out = mask ? l + r : (l * r) / (l + r), lane by lane, over n floats (a
+// multiple of TREE_BATCH_LANES). out may be l. Same operations in the same
+// order as CollageTree::CalculateAlpha, so the results are bitwise equal.
+void CombineRow(const float* l, const float* r, const uint32_t* mask,
+                float* out, int n) {
+#if defined(__AVX__)
+  for (int k = 0; k < n; k += 8) {
+    __m256 left = _mm256_loadu_ps(l + k);
+    __m256 right = _mm256_loadu_ps(r + k);
+    __m256 sum = _mm256_add_ps(left, right);
+    __m256 h = _mm256_div_ps(_mm256_mul_ps(left, right), sum);
+    __m256 v_mask = _mm256_castsi256_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask + k)));
+    _mm256_storeu_ps(out + k, _mm256_blendv_ps(h, sum, v_mask));
+  }
+#elif defined(__SSE2__)
+  for (int k = 0; k < n; k += 4) {
+    __m128 left = _mm_loadu_ps(l + k);
+    __m128 right = _mm_loadu_ps(r + k);
+    __m128 sum = _mm_add_ps(left, right);
+    __m128 h = _mm_div_ps(_mm_mul_ps(left, right), sum);
+    __m128 v_mask = _mm_castsi128_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + k)));
+    _mm_storeu_ps(out + k, _mm_or_ps(_mm_and_ps(v_mask, sum),
+                                     _mm_andnot_ps(v_mask, h)));
+  }
+#else
+  for (int k = 0; k < n; ++k) {
+    float sum = l[k] + r[k];
+    out[k] = mask[k] ? sum : (l[k] * r[k]) / sum;
+  }
+#endif
+}
+
+}  // namespace
+
+// Post-order walk with an explicit stack. A node is pushed twice: the
+// second time round its children are done and it is emitted.
+void TreeBatch::Init(const CollageTree& tree, int candidate_num) {
+  assert(candidate_num > 0);
+  candidate_num_ = candidate_num;
+  stride_ = (candidate_num + TREE_BATCH_LANES - 1) / TREE_BATCH_LANES *
+            TREE_BATCH_LANES;
+  post_order_.clear();
+  inner_nodes_.clear();
+  leaf_nodes_.clear();
+  max_depth_ = 0;
+  int depth = 0;
+  std::vector<int> stack(1, tree.tree_root());
+  std::vector<char> expanded(1, 0);
+  while (!stack.empty()) {
+    int node = stack.back();
+    const TreeNode& cur = tree.node(node);
+    if (!cur.is_leaf_ && !expanded.back()) {
+      expanded.back() = 1;
+      stack.push_back(cur.right_child_);
+      expanded.push_back(0);
+      stack.push_back(cur.left_child_);
+      expanded.push_back(0);
+      continue;
+    }
+    stack.pop_back();
+    expanded.pop_back();
+    post_order_.push_back(!cur.is_leaf_);
+    if (cur.is_leaf_) {
+      leaf_nodes_.push_back(node);
+      if (++depth > max_depth_) max_depth_ = depth;
+    } else {
+      inner_nodes_.push_back(node);
+      --depth;
+    }
+  }
+  split_masks_.assign(inner_nodes_.size() * stride_, 0);
+  // Padding columns hold harmless values, they are never reported.
+  leaf_alphas_.assign(leaf_nodes_.size() * stride_, 1);
+  stack_rows_.assign(max_depth_ * stride_, 0);
+  for (int c = 0; c < candidate_num_; ++c) {
+    Load(c, tree);
+  }
+}
+
+void TreeBatch::Load(int candidate, const CollageTree& tree) {
+  for (int i = 0; i < inner_nodes_.size(); ++i) {
+    set_split_type(candidate, i, tree.node(inner_nodes_[i]).split_type_);
+  }
+  for (int i = 0; i < leaf_nodes_.size(); ++i) {
+    set_leaf_alpha(candidate, i, tree.node(leaf_nodes_[i]).alpha_);
+  }
+}
+
+void TreeBatch::Store(int candidate, CollageTree& tree) const {
+  for (int i = 0; i < inner_nodes_.size(); ++i) {
+    tree.node(inner_nodes_[i]).split_type_ = split_type(candidate, i);
+  }
+}
+
+// Stack machine over the post-order shape: a leaf pushes its row, an inner
+// node pops two rows and pushes their combination. Leaf rows are used in
+// place, results go to the stack row of the depth they land at.
+void TreeBatch::Evaluate(std::vector<float>& root_alphas) {
+  std::vector<const float*> stack(max_depth_);
+  int top = 0;
+  int inner_ind = 0;
+  int leaf_ind = 0;
+  for (int i = 0; i < post_order_.size(); ++i) {
+    if (!post_order_[i]) {
+      stack[top++] = &leaf_alphas_[leaf_ind++ * stride_];
+      continue;
+    }
+    const float* right = stack[--top];
+    const float* left = stack[top - 1];
+    float* out = &stack_rows_[(top - 1) * stride_];
+    CombineRow(left, right, &split_masks_[inner_ind++ * stride_], out,
+               stride_);
+    stack[top - 1] = out;
+  }
+  root_alphas.assign(stack[0], stack[0] + candidate_num_);
+}
+
+// Two plain passes the compiler can vectorize: the distance of every
+// candidate, then the smallest one.
+int TreeBatch::Closest(const std::vector<float>& root_alphas,
+                       float expect_alpha, float& ratio) {
+  int candidate_num = static_cast<int>(root_alphas.size());
+  std::vector<float> ratios(candidate_num);
+  for (int c = 0; c < candidate_num; ++c) {
+    float up = root_alphas[c] / expect_alpha;
+    float down = expect_alpha / root_alphas[c];
+    ratios[c] = (up > down) ? up : down;
+  }
+  int best = -1;
+  for (int c = 0; c < candidate_num; ++c) {
+    if ((best == -1) || (ratios[c] < ratios[best])) best = c;
+  }
+  ratio = (best == -1) ? 0 : ratios[best];
+  return best;
+}
@@ -0,0 +1,87 @@
+//
+//  tree_batch.h
+//  wu_collage_advanced
+//
+//  Aspect ratios of many candidate trees of the same shape at once.
+//
+
+#ifndef __wu_collage_advanced__tree_batch__
+#define __wu_collage_advanced__tree_batch__
+
+#include "collage_layout.h"
+#include <stdint.h>
+#include <vector>
+
+// Candidate trees sharing one shape (the topology of a CollageTree) but each
+// with its own split types and leaf aspect ratios, e.g. the same tree with
+// different sets of flipped cuts. The shape is kept as a post-order list,
+// and the split types and leaf aspect ratios in structure-of-arrays form:
+// one row per node, one column per candidate. Evaluate walks the shape once
+// and computes every row for all the candidates with SIMD (AVX or SSE2 when
+// the compiler targets them, scalar code otherwise), so the root aspect
+// ratios of K candidates cost about K / 8 tree evaluations.
+//
+// CollageTree::PickCuts scores the cut variants of every generated tree with
+// it before AdjustAlpha; collage_bench times it against one tree at a time.
+class TreeBatch {
+public:
+  TreeBatch() : candidate_num_(0), stride_(0), max_depth_(0) {}
+  // Take the shape of tree (after CalculateAlpha) and make candidate_num
+  // candidates, all with the split types and leaf aspect ratios of tree.
+  void Init(const CollageTree& tree, int candidate_num);
+  // Set candidate to the split types and leaf aspect ratios of tree, which
+  // must have the shape given to Init (e.g. a copy of that tree).
+  void Load(int candidate, const CollageTree& tree);
+  // Give tree the split types of candidate. Call CalculateAlpha next.
+  void Store(int candidate, CollageTree& tree) const;
+  // Inner nodes and leaves are numbered in post-order, see inner_nodes()
+  // and leaf_nodes() for their pool indices.
+  char split_type(int candidate, int inner_ind) const {
+    return split_masks_[inner_ind * stride_ + candidate] ? 'v' : 'h';
+  }
+  void set_split_type(int candidate, int inner_ind, char split_type) {
+    split_masks_[inner_ind * stride_ + candidate] =
+        (split_type == 'v') ? 0xffffffffu : 0;
+  }
+  void set_leaf_alpha(int candidate, int leaf_ind, float alpha) {
+    leaf_alphas_[leaf_ind * stride_ + candidate] = alpha;
+  }
+
+  // Root aspect ratios of all the candidates, root_alphas[candidate]. They
+  // are bitwise equal to what CalculateAlpha gives for each candidate.
+  void Evaluate(std::vector<float>& root_alphas);
+  // The candidate whose root aspect ratio is closest to expect_alpha (as a
+  // factor), and that factor (>= 1) in ratio.
+  static int Closest(const std::vector<float>& root_alphas, float expect_alpha,
+                     float& ratio);
+
+  // Accessors:
+  int candidate_num() const {
+    return candidate_num_;
+  }
+  const std::vector<int>& inner_nodes() const {
+    return inner_nodes_;
+  }
+  const std::vector<int>& leaf_nodes() const {
+    return leaf_nodes_;
+  }
+
+private:
+  int candidate_num_;
+  // Row length, candidate_num_ rounded up to a whole number of vectors.
+  int stride_;
+  // The shape in post-order: true for an inner node, false for a leaf.
+  std::vector<char> post_order_;
+  // Pool indices of the inner nodes and leaves, in post-order.
+  std::vector<int> inner_nodes_;
+  std::vector<int> leaf_nodes_;
+  // One row per inner node: all ones for a vertical cut, 0 for horizontal.
+  std::vector<uint32_t> split_masks_;
+  // One row per leaf.
+  std::vector<float> leaf_alphas_;
+  // Evaluation stack, max_depth_ rows of partial results.
+  int max_depth_;
+  std::vector<float> stack_rows_;
+};
+
+#endif /* defined(__wu_collage_advanced__tree_batch__) */
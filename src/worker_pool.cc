@@ -0,0 +1,70 @@
+//
+//  worker_pool.cc
+//  wu_collage_advanced
+//
+//  Persistent threads running one job on several threads at once.
+//
+
+#include "worker_pool.h"
+#include <algorithm>
+#include <assert.h>
+
+WorkerPool::WorkerPool(int thread_num) : stop_(false) {
+  assert(thread_num >= 1);
+  for (int t = 1; t < thread_num; ++t) {
+    threads_.push_back(std::thread(&WorkerPool::Worker, this));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  job_ready_.notify_all();
+  for (int t = 0; t < threads_.size(); ++t) {
+    threads_[t].join();
+  }
+}
+
+void WorkerPool::Run(const std::function<void()>& job) {
+  Job pending;
+  pending.body_ = &job;
+  pending.waiting_num_ = static_cast<int>(threads_.size());
+  pending.running_num_ = 0;
+  if (pending.waiting_num_ > 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(&pending);
+    }
+    job_ready_.notify_all();
+  }
+  job();
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The job lives on this stack, no thread may start it from now on.
+  if (pending.waiting_num_ > 0) {
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), &pending));
+    pending.waiting_num_ = 0;
+  }
+  job_done_.wait(lock, [&]() {
+    return pending.running_num_ == 0;
+  });
+}
+
+void WorkerPool::Worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    job_ready_.wait(lock, [this]() {
+      return stop_ || !jobs_.empty();
+    });
+    if (stop_) return;
+    Job* job = jobs_.front();
+    if (--job->waiting_num_ == 0) jobs_.pop_front();
+    ++job->running_num_;
+    lock.unlock();
+    (*job->body_)();
+    lock.lock();
+    --job->running_num_;
+    job_done_.notify_all();
+  }
+}
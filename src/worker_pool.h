@@ -0,0 +1,67 @@
+//
+//  worker_pool.h
+//  wu_collage_advanced
+//
+//  Persistent threads running one job on several threads at once.
+//
+
+#ifndef __wu_collage_advanced__worker_pool__
+#define __wu_collage_advanced__worker_pool__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Keeps thread_num - 1 threads waiting for jobs, so that running a job on
+// thread_num threads costs no thread creation. Run() executes the job on the
+// calling thread and on up to thread_num - 1 pool threads; the job body is
+// typically a loop taking work from a shared queue until there is none, so
+// it does not matter how many copies actually start.
+//
+// Run() is thread-safe. Concurrent callers share the pool threads, and each
+// of them works on its own job too, so no job ever waits for a free thread.
+class WorkerPool {
+public:
+  explicit WorkerPool(int thread_num);
+  ~WorkerPool();
+
+  // Run job on this thread and on the free pool threads, and return once all
+  // the copies that started have returned. Copies that did not start by the
+  // time the calling thread's copy returns are dropped.
+  void Run(const std::function<void()>& job);
+
+  // Accessors:
+  int thread_num() const {
+    return static_cast<int>(threads_.size()) + 1;
+  }
+
+private:
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // A job of Run(), with the number of pool threads still to start it and
+  // the number of those that started and have not returned yet.
+  class Job {
+  public:
+    const std::function<void()>* body_;
+    int waiting_num_;
+    int running_num_;
+  };
+  void Worker();
+
+  std::vector<std::thread> threads_;
+  // Jobs some pool threads should still start, oldest first.
+  std::deque<Job*> jobs_;
+  bool stop_;
+  // Guards jobs_, the counters of the jobs and stop_.
+  std::mutex mutex_;
+  // Signalled when a job is queued and on stop.
+  std::condition_variable job_ready_;
+  // Signalled when a pool thread returns from a job.
+  std::condition_variable job_done_;
+};
+
+#endif /* defined(__wu_collage_advanced__worker_pool__) */
@@ -7,178 +7,457 @@
 //
 
 #include "wu_collage_advanced.h"
+#include "collage_log.h"
+#include "collage_stats.h"
+#include "image_prefetcher.h"
+#include "tile_cache.h"
 #include <math.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <stdio.h>
+#include <thread>
 
-bool less_than(AlphaUnit m, AlphaUnit n) {
-  return m.alpha_ < n.alpha_;
+// Resize a decoded image to tile_size into tile. If tile already has that
+// size and type (e.g. a canvas ROI), resize writes into it directly instead
+// of allocating a temporary image.
+void ResizeTile(const cv::Mat& image, const cv::Size& tile_size,
+                cv::Mat& tile) {
+  int interpolation = cv::INTER_LINEAR;
+  if ((image.cols > tile_size.width) && (image.rows > tile_size.height))
+    interpolation = cv::INTER_AREA;
+  StatTimer timer(kStatResize);
+  cv::resize(image, tile, tile_size, 0, 0, interpolation);
 }
 
+// Bring a decoded image to the 8-bit BGR of the canvas. Mats and
+// PixelProvider results may also be gray or BGRA, and 16-bit or floating
+// point (taken to be in [0, 1]). Returns an empty Mat for other channel
+// numbers.
+cv::Mat ToCanvasType(const cv::Mat& image) {
+  if (image.type() == CV_8UC3) return image;
+  cv::Mat image_8u = image;
+  if (image.depth() != CV_8U) {
+    double scale = 1;
+    if (image.depth() == CV_16U)
+      scale = 1.0 / 257;
+    else if ((image.depth() == CV_32F) || (image.depth() == CV_64F))
+      scale = 255;
+    image.convertTo(image_8u, CV_8U, scale);
+  }
+  cv::Mat bgr;
+  if (image_8u.channels() == 1)
+    cv::cvtColor(image_8u, bgr, cv::COLOR_GRAY2BGR);
+  else if (image_8u.channels() == 3)
+    bgr = image_8u;
+  else if (image_8u.channels() == 4)
+    cv::cvtColor(image_8u, bgr, cv::COLOR_BGRA2BGR);
+  return bgr;
+}
+
+// Decode one tile image and resize it straight into its canvas ROI.
+// Tiles are disjoint, so bodies for different leaves can run concurrently.
+// Tile i shows inputs[tile_images[i]], or the same image from the prefetcher
+// if there is one.
+class RenderTileBody : public cv::ParallelLoopBody {
+public:
+  RenderTileBody(const std::vector<CollageInput>& inputs,
+                 const std::vector<int>& tile_images,
+                 const std::vector<cv::Rect>& tile_rects,
+                 TileCache* tile_cache,
+                 const PixelProvider& provider,
+                 ImagePrefetcher* prefetcher,
+                 cv::Mat& canvas) : inputs_(inputs),
+      tile_images_(tile_images), tile_rects_(tile_rects),
+      tile_cache_(tile_cache), provider_(provider), prefetcher_(prefetcher),
+      canvas_(canvas) {}
+  virtual void operator()(const cv::Range& range) const {
+    for (int i = range.start; i < range.end; ++i) {
+      const cv::Rect& pos_cv = tile_rects_[i];
+      if ((pos_cv.width <= 0) || (pos_cv.height <= 0)) continue;
+      cv::Mat image;
+      if (prefetcher_ != NULL) {
+        image = prefetcher_->Get(tile_images_[i], pos_cv.size());
+      } else {
+        image = inputs_[tile_images_[i]].Read(pos_cv.size(), tile_cache_,
+                                              provider_);
+      }
+      if (image.empty()) {
+        COLLAGE_LOG(kLogError) << "OutputCollageImage";
+        continue;
+      }
+      cv::Mat bgr = ToCanvasType(image);
+      if (bgr.empty()) {
+        COLLAGE_LOG(kLogError) << "OutputCollageImage: image "
+                               << tile_images_[i] << " has "
+                               << image.channels() << " channels";
+        continue;
+      }
+      cv::Mat roi(canvas_, pos_cv);
+      ResizeTile(bgr, roi.size(), roi);
+    }
+  }
+private:
+  const std::vector<CollageInput>& inputs_;
+  const std::vector<int>& tile_images_;
+  const std::vector<cv::Rect>& tile_rects_;
+  TileCache* tile_cache_;
+  const PixelProvider& provider_;
+  ImagePrefetcher* prefetcher_;
+  cv::Mat& canvas_;
+};
+
+// A leaf tile of a banded render. image_ holds the resized tile while the
+// bands pass over it.
+class BandTile {
+public:
+  int image_ind_;
+  cv::Rect rect_;
+  cv::Mat image_;
+};
+
+bool BandTileAbove(const BandTile& m, const BandTile& n) {
+  return m.rect_.y < n.rect_.y;
+}
+
+// Decode and resize the tiles tile_inds[range] of a banded render.
+class ResizeTileBody : public cv::ParallelLoopBody {
+public:
+  ResizeTileBody(std::vector<BandTile>& tiles,
+                 const std::vector<int>& tile_inds,
+                 const std::vector<CollageInput>& inputs,
+                 TileCache* tile_cache,
+                 const PixelProvider& provider) : tiles_(tiles),
+      tile_inds_(tile_inds), inputs_(inputs), tile_cache_(tile_cache),
+      provider_(provider) {}
+  virtual void operator()(const cv::Range& range) const {
+    for (int i = range.start; i < range.end; ++i) {
+      BandTile& tile = tiles_[tile_inds_[i]];
+      cv::Mat image = inputs_[tile.image_ind_].Read(tile.rect_.size(),
+                                                    tile_cache_, provider_);
+      if (image.empty()) {
+        COLLAGE_LOG(kLogError) << "OutputCollageBands";
+        continue;
+      }
+      cv::Mat bgr = ToCanvasType(image);
+      if (bgr.empty()) {
+        COLLAGE_LOG(kLogError) << "OutputCollageBands: image "
+                               << tile.image_ind_ << " has "
+                               << image.channels() << " channels";
+        continue;
+      }
+      ResizeTile(bgr, tile.rect_.size(), tile.image_);
+    }
+  }
+private:
+  std::vector<BandTile>& tiles_;
+  const std::vector<int>& tile_inds_;
+  const std::vector<CollageInput>& inputs_;
+  TileCache* tile_cache_;
+  const PixelProvider& provider_;
+};
+
 CollageAdvanced::CollageAdvanced(std::vector<std::string> input_image_list,
-                                 const int canvas_width) {
+                                 const int canvas_width,
+                                 const uint64_t random_seed,
+                                 const ImageIndex* image_index) {
+  image_index_ = image_index;
+  tile_cache_ = NULL;
   for (int i = 0; i < input_image_list.size(); ++i) {
-    std::string img_path = input_image_list[i];
-    cv::Mat img = cv::imread(img_path.c_str());
-    if (img.empty())
+    ReadImageAlpha(CollageInput::FromPath(input_image_list[i]));
+  }
+  layout_.set_canvas_width(canvas_width);
+  layout_.set_random_seed(random_seed);
+}
+
+CollageAdvanced::CollageAdvanced(const std::vector<std::string>& image_paths,
+                                 const std::vector<cv::Size>& image_sizes,
+                                 const int canvas_width,
+                                 const uint64_t random_seed) {
+  image_index_ = NULL;
+  tile_cache_ = NULL;
+  assert(image_paths.size() == image_sizes.size());
+  for (int i = 0; i < image_paths.size(); ++i) {
+    if ((image_sizes[i].width <= 0) || (image_sizes[i].height <= 0))
       continue;
-    AlphaUnit new_unit;
-    new_unit.image_ind_ = i;
-    new_unit.alpha_ = static_cast<float>(img.cols) / img.rows;
-    new_unit.alpha_recip_ = static_cast<float>(img.rows) / img.cols;
-    new_unit.image_path_ = img_path;
-    image_alpha_vec_.push_back(new_unit);
-    image_path_vec_.push_back(img_path);
+    AppendImage(CollageInput::FromPath(image_paths[i]),
+                image_sizes[i].width, image_sizes[i].height);
   }
-  canvas_width_ = canvas_width;
-  canvas_alpha_ = -1;
-  canvas_height_ = -1;
-  image_num_ = static_cast<int>(input_image_list.size());
-  srand(static_cast<unsigned>(time(0)));
-  tree_root_ = new TreeNode();
+  layout_.set_canvas_width(canvas_width);
+  layout_.set_random_seed(random_seed);
+}
+
+CollageAdvanced::CollageAdvanced(const std::vector<CollageInput>& inputs,
+                                 const int canvas_width,
+                                 const uint64_t random_seed,
+                                 const PixelProvider& pixel_provider) {
+  image_index_ = NULL;
+  tile_cache_ = NULL;
+  pixel_provider_ = pixel_provider;
+  for (int i = 0; i < inputs.size(); ++i) {
+    if (!ReadImageAlpha(inputs[i]))
+      COLLAGE_LOG(kLogError) << "cannot read input " << i;
+  }
+  layout_.set_canvas_width(canvas_width);
+  layout_.set_random_seed(random_seed);
 }
 
 // Create collage.
 bool CollageAdvanced::CreateCollage(const float expect_alpha) {
-  assert(expect_alpha > 0);
-  
-  // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
-  std::sort(image_alpha_vec_.begin(), image_alpha_vec_.end(), less_than);
-  // Step 2: Generate a guided binary tree by using divide-and-conquer.
-  GenerateTree(expect_alpha);
-  // Step 3: Calculate the actual aspect ratio for the generated collage.
-  canvas_alpha_ = CalculateAlpha(tree_root_);
-  canvas_height_ = static_cast<int>(canvas_width_ / canvas_alpha_);
-  // Step 4: Get the position for the nodes in the binary tree.
-  tree_root_->position_.x_ = 0;
-  tree_root_->position_.y_ = 0;
-  tree_root_->position_.height_ = canvas_height_;
-  tree_root_->position_.width_ = canvas_width_;
-  if (tree_root_->left_child_)
-    CalculatePositions(tree_root_->left_child_);
-  if (tree_root_->right_child_)
-    CalculatePositions(tree_root_->right_child_);
-  return true;
+  return layout_.CreateLayout(expect_alpha);
 }
 
 // If we use CreateCollage, the generated collage may have strange aspect ratio such as
 // too big or too small, which seems to be difficult to be shown. We let the user to
 // input their expected aspect ratio and fast adjust to make the result aspect ratio
 // close to the user defined one.
-// The thresh here controls the closeness between the result aspect ratio and the expect
-// aspect ratio. e.g. expect_alpha is 1, thresh is 2. The result aspect ratio is around
-// [1 / 2, 1 * 2] = [0.5, 2].
-// We also define MAX_ITER_NUM = 100,
-// If max iteration number is reached and we cannot find a good result aspect ratio,
-// this function returns -1.
 int CollageAdvanced::CreateCollage(const float expect_alpha,
                                    const float thresh,
                                    int& total_tree_generation,
                                    int& total_adjust_iteration) {
-  assert(thresh > 1);
-  assert(expect_alpha > 0);
-  tree_root_->alpha_expect_ = expect_alpha;
-  float lower_bound = expect_alpha / thresh;
-  float upper_bound = expect_alpha * thresh;
-  int total_iter_counter = 1;
-  int iter_counter = 1;
-  int tree_gene_counter = 1;
-  // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
-  std::sort(image_alpha_vec_.begin(), image_alpha_vec_.end(), less_than);
-  // Step 2: Generate a guided binary tree by using divide-and-conquer.
-  GenerateTree(expect_alpha);
-  // Step 3: Calculate the actual aspect ratio for the generated collage.
-  canvas_alpha_ = CalculateAlpha(tree_root_);
-  
-  while ((canvas_alpha_ < lower_bound) || (canvas_alpha_ > upper_bound)) {
-    // Call the following function to adjust the aspect ratio from top to down.
-    
-    /*************************************************************************/
-    tree_root_->alpha_expect_ = expect_alpha;
-    bool changed = false;
-    changed = AdjustAlpha(tree_root_, thresh);
-    // Calculate actual aspect ratio again.
-    canvas_alpha_ = CalculateAlpha(tree_root_);
-    ++iter_counter;
-    ++total_iter_counter;
-    if ((iter_counter > MAX_ITER_NUM) || (!changed)) {
-      std::cout << "********************************************" << std::endl;
-      if (changed) {
-        std::cout << "max iteration number reached..." << std::endl;
-      } else {
-        std::cout << "tree structure unchanged after iteration: "
-        << iter_counter << std::endl;
-      }
-      std::cout << "********************************************" << std::endl;
-      // We should generate binary tree again
-      iter_counter = 1;
-      ++total_iter_counter;
-     /*************************************************************************/
-    
-      GenerateTree(expect_alpha);
-      canvas_alpha_ = CalculateAlpha(tree_root_);
-      ++tree_gene_counter;
-      if (tree_gene_counter > MAX_TREE_GENE_NUM) {
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
-        std::cout << "WE HAVE DONE OUR BEST, BUT COLAAGE GENERATION FAILED...";
-        std::cout << std::endl;
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
-        return -1;
-      }
-    }
+  return CreateCollage(expect_alpha, thresh,
+                       total_tree_generation, total_adjust_iteration, 1);
+}
+
+int CollageAdvanced::CreateCollage(const float expect_alpha,
+                                   const float thresh,
+                                   int& total_tree_generation,
+                                   int& total_adjust_iteration,
+                                   int thread_num,
+                                   bool keep_closest) {
+  return layout_.CreateLayout(expect_alpha, thresh, total_tree_generation,
+                              total_adjust_iteration, thread_num,
+                              keep_closest);
+}
+
+int CollageAdvanced::CreateCollageWithin(const float expect_alpha,
+                                         const float thresh,
+                                         long long time_budget_us,
+                                         int& total_tree_generation,
+                                         int& total_adjust_iteration,
+                                         int thread_num,
+                                         const std::atomic<bool>* cancel) {
+  return layout_.CreateLayoutWithin(expect_alpha, thresh, time_budget_us,
+                                    total_tree_generation,
+                                    total_adjust_iteration, thread_num,
+                                    cancel);
+}
+
+bool CollageAdvanced::AddImage(const CollageInput& input,
+                               std::vector<int>& changed_images) {
+  int width = 0;
+  int height = 0;
+  if (!input.ReadSize(image_index_, width, height)) {
+    COLLAGE_LOG(kLogError) << "AddImage " << input.name();
+    return false;
   }
-  // std::cout << "Canvas generation success!" << std::endl;
-  // std::cout << "Tree generation number is: " << tree_gene_counter << std::endl;
-  // std::cout << "Total iteration number is: " << total_iter_counter << std::endl;
-  // After adjustment, set the position for all the tile images.
-  total_tree_generation = tree_gene_counter;
-  total_adjust_iteration = total_iter_counter;
-  canvas_height_ = static_cast<int>(canvas_width_ / canvas_alpha_);
-  tree_root_->position_.x_ = 0;
-  tree_root_->position_.y_ = 0;
-  tree_root_->position_.height_ = canvas_height_;
-  tree_root_->position_.width_ = canvas_width_;
-  if (tree_root_->left_child_)
-    CalculatePositions(tree_root_->left_child_);
-  if (tree_root_->right_child_)
-    CalculatePositions(tree_root_->right_child_);
-  return 1;
+  if (!layout_.InsertImage(width, height, changed_images)) return false;
+  image_input_vec_.push_back(input);
+  return true;
+}
+
+bool CollageAdvanced::RemoveImage(int image_ind,
+                                  std::vector<int>& changed_images) {
+  if (!layout_.RemoveImage(image_ind, changed_images)) return false;
+  image_input_vec_.erase(image_input_vec_.begin() + image_ind);
+  return true;
 }
 
 // After calling CreateCollage() and FastAdjust(), call this function to save result
 // collage to a image file specified by out_put_image_path.
 cv::Mat CollageAdvanced::OutputCollageImage() const {
-  // Traverse tree_leaves_ vector. Resize tile image and paste it on the canvas.
-  assert(canvas_alpha_ != -1);
-  assert(canvas_width_ != -1);
-  cv::Mat canvas(cv::Size(canvas_width_, canvas_height_),
+  return RenderCollageImage(NULL);
+}
+
+// Decode the images while the layout is searched. Nothing is known about the
+// tile sizes yet, so every image is decoded for a tile kPrefetchAreaMargin
+// times the area it would get on the largest canvas thresh allows if all
+// tiles were equal; the few tiles that end up larger are decoded again when
+// they are composited. The prefetch threads take the cores the search does
+// not use, and keep decoding while the first tiles are composited.
+int CollageAdvanced::CreateCollageImage(const float expect_alpha,
+                                        const float thresh,
+                                        int& total_tree_generation,
+                                        int& total_adjust_iteration,
+                                        cv::Mat& canvas,
+                                        int thread_num) {
+  assert(thresh > 1);
+  assert(expect_alpha > 0);
+  assert(thread_num >= 1);
+  if (image_num() == 0) return -1;
+  float tile_area = kPrefetchAreaMargin * canvas_width() * canvas_width() *
+                    thresh / (expect_alpha * image_num());
+  std::vector<cv::Size> hint_sizes(image_num());
+  for (int i = 0; i < image_num(); ++i) {
+    const AlphaUnit& unit = layout_.image_alpha_vec()[i];
+    int width = static_cast<int>(sqrt(tile_area * unit.alpha_));
+    int height = static_cast<int>(sqrt(tile_area * unit.alpha_recip_));
+    hint_sizes[unit.image_ind_] =
+        cv::Size(std::min(std::max(width, 1), canvas_width()),
+                 std::max(height, 1));
+  }
+  ImagePrefetcher prefetcher(image_input_vec_, hint_sizes, tile_cache_,
+                             pixel_provider_);
+  int core_num = static_cast<int>(std::thread::hardware_concurrency());
+  prefetcher.Start(std::max(core_num - thread_num, 1));
+  if (CreateCollage(expect_alpha, thresh, total_tree_generation,
+                    total_adjust_iteration, thread_num) == -1)
+    return -1;
+  canvas = RenderCollageImage(&prefetcher);
+  return 1;
+}
+
+// Traverse tree_leaves_ vector. Resize tile image and paste it on the canvas.
+cv::Mat CollageAdvanced::RenderCollageImage(ImagePrefetcher* prefetcher) const {
+  assert(canvas_alpha() != -1);
+  assert(canvas_width() != -1);
+  cv::Mat canvas(cv::Size(canvas_width(), canvas_height()),
                  CV_8UC3,
                  cv::Scalar(0, 0, 0));
-  for (int i = 0; i < image_num_; ++i) {
-//    cv::imshow("", canvas);
-//    cv::waitKey();
-    FloatRect pos = tree_leaves_[i]->position_;
+  std::vector<int> tile_images(image_num());
+  std::vector<cv::Rect> tile_rects(image_num());
+  cv::Rect canvas_rect(0, 0, canvas_width(), canvas_height());
+  const CollageTree& tree = layout_.tree();
+  for (int i = 0; i < image_num(); ++i) {
+    const TreeNode& leaf = tree.node(tree.tree_leaves()[i]);
+    FloatRect pos = leaf.position_;
     cv::Rect pos_cv(pos.x_, pos.y_, pos.width_, pos.height_);
-    cv::Mat roi(canvas, pos_cv);
-    cv::Mat resized_img(pos_cv.height, pos_cv.width, CV_8UC3);
-    cv::Mat image = cv::imread(tree_leaves_[i]->img_path_.c_str());
-    assert(image.type() == CV_8UC3);
-    cv::resize(image, resized_img, resized_img.size());
-    resized_img.copyTo(roi);
+    tile_images[i] = leaf.image_ind_;
+    tile_rects[i] = pos_cv & canvas_rect;
   }
+  // Tiles never overlap, so every leaf can be decoded and pasted in parallel.
+  cv::parallel_for_(cv::Range(0, image_num()),
+                    RenderTileBody(image_input_vec_, tile_images, tile_rects,
+                                   tile_cache_, pixel_provider_, prefetcher,
+                                   canvas));
   return canvas;
 }
 
+// Walk the canvas in horizontal bands. Leaves are sorted by their top row;
+// a leaf is decoded when the first band reaches it and released after the
+// last one, so only the band and the tiles crossing it are in memory.
+bool CollageAdvanced::OutputCollageBands(const std::vector<BandWriter*>& writers,
+                                         int band_height) const {
+  assert(canvas_alpha() != -1);
+  assert(canvas_width() != -1);
+  if (band_height <= 0) {
+    band_height = static_cast<int>(kBandBytes / (3 * canvas_width()));
+    band_height = std::max(band_height, 1);
+  }
+  band_height = std::min(band_height, canvas_height());
+  cv::Rect canvas_rect(0, 0, canvas_width(), canvas_height());
+  std::vector<BandTile> tiles;
+  tiles.reserve(image_num());
+  const CollageTree& tree = layout_.tree();
+  for (int i = 0; i < image_num(); ++i) {
+    const TreeNode& leaf = tree.node(tree.tree_leaves()[i]);
+    FloatRect pos = leaf.position_;
+    BandTile tile;
+    tile.rect_ = cv::Rect(pos.x_, pos.y_, pos.width_, pos.height_) &
+                 canvas_rect;
+    if ((tile.rect_.width <= 0) || (tile.rect_.height <= 0)) continue;
+    tile.image_ind_ = leaf.image_ind_;
+    tiles.push_back(tile);
+  }
+  std::sort(tiles.begin(), tiles.end(), BandTileAbove);
+
+  for (int w = 0; w < writers.size(); ++w) {
+    if (!writers[w]->Begin(canvas_width(), canvas_height())) return false;
+  }
+  cv::Mat band_buffer(band_height, canvas_width(), CV_8UC3);
+  std::vector<int> active;
+  std::vector<int> entering;
+  int next_tile = 0;
+  for (int band_y = 0; band_y < canvas_height(); band_y += band_height) {
+    cv::Rect band_rect(0, band_y, canvas_width(),
+                       std::min(band_height, canvas_height() - band_y));
+    // Release the tiles above this band.
+    int kept = 0;
+    for (int i = 0; i < active.size(); ++i) {
+      BandTile& tile = tiles[active[i]];
+      if (tile.rect_.y + tile.rect_.height > band_y) {
+        active[kept++] = active[i];
+      } else {
+        tile.image_.release();
+      }
+    }
+    active.resize(kept);
+    // Decode the tiles starting in this band.
+    entering.clear();
+    while ((next_tile < tiles.size()) &&
+           (tiles[next_tile].rect_.y < band_rect.y + band_rect.height)) {
+      entering.push_back(next_tile);
+      active.push_back(next_tile);
+      ++next_tile;
+    }
+    cv::parallel_for_(cv::Range(0, static_cast<int>(entering.size())),
+                      ResizeTileBody(tiles, entering, image_input_vec_,
+                                     tile_cache_, pixel_provider_));
+    // Composite.
+    cv::Mat band = band_buffer.rowRange(0, band_rect.height);
+    band.setTo(cv::Scalar(0, 0, 0));
+    for (int i = 0; i < active.size(); ++i) {
+      const BandTile& tile = tiles[active[i]];
+      if (tile.image_.empty()) continue;
+      cv::Rect part = tile.rect_ & band_rect;
+      if ((part.width <= 0) || (part.height <= 0)) continue;
+      cv::Rect src(part.x - tile.rect_.x, part.y - tile.rect_.y,
+                   part.width, part.height);
+      cv::Rect dst(part.x, part.y - band_y, part.width, part.height);
+      cv::Mat band_roi(band, dst);
+      tile.image_(src).copyTo(band_roi);
+    }
+    for (int w = 0; w < writers.size(); ++w) {
+      if (!writers[w]->WriteBand(band)) return false;
+    }
+  }
+  for (int w = 0; w < writers.size(); ++w) {
+    if (!writers[w]->Finish()) return false;
+  }
+  return true;
+}
+
+// Write the canvas size, seed and image rectangles of the result as JSON.
+void CollageAdvanced::OutputCollageJson(std::ostream& output) const {
+  assert(canvas_alpha() != -1);
+  std::vector<FloatRect> rects;
+  layout_.LeafRects(rects);
+  output << "{\"canvas_width\":" << canvas_width()
+         << ",\"canvas_height\":" << canvas_height()
+         << ",\"canvas_alpha\":" << canvas_alpha()
+         << ",\"seed\":" << random_seed() << ",\"images\":[";
+  for (int i = 0; i < rects.size(); ++i) {
+    if (i > 0) output << ",";
+    output << "{\"name\":\"";
+    // Names are paths or caller-given labels, escape what JSON requires.
+    const std::string& name = image_input_vec_[i].name();
+    for (int j = 0; j < name.size(); ++j) {
+      unsigned char c = name[j];
+      if ((c == '"') || (c == '\\')) {
+        output << '\\' << c;
+      } else if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        output << buf;
+      } else {
+        output << c;
+      }
+    }
+    output << "\",\"x\":" << rects[i].x_ << ",\"y\":" << rects[i].y_
+           << ",\"width\":" << rects[i].width_
+           << ",\"height\":" << rects[i].height_ << "}";
+  }
+  output << "]}";
+}
+
 // After calling CreateCollage(), call this function to save result
 // collage to a html file specified by out_put_html_path.
 bool CollageAdvanced::OutputCollageHtml(const std::string output_html_path) {
-  assert(canvas_alpha_ != -1);
-  assert(canvas_width_ != -1);
+  assert(canvas_alpha() != -1);
+  assert(canvas_width() != -1);
   std::ofstream output_html(output_html_path.c_str());
   if (!output_html) {
-    std::cout << "Error: OutputCollageHtml" << std::endl;
+    COLLAGE_LOG(kLogError) << "OutputCollageHtml";
   }
   
   output_html << "<!DOCTYPE html>\n";
@@ -190,20 +469,22 @@ bool CollageAdvanced::OutputCollageHtml(const std::string output_html_path) {
   output_html << "\t<body>\n";
   output_html << "<script type=\"text/javascript\" charset=\"utf-8\"> $(document).ready(function(){$(\"a[rel^='prettyPhoto']\").prettyPhoto();});</script>";
   output_html << "\t\t<div style=\"margin:20px auto; width:60%; position:relative;\">\n";
-  for (int i = 0; i < image_num_; ++i) {
+  const CollageTree& tree = layout_.tree();
+  for (int i = 0; i < image_num(); ++i) {
+    const TreeNode& leaf = tree.node(tree.tree_leaves()[i]);
     output_html << "\t\t\t<a href=\"";
-    output_html << tree_leaves_[i]->img_path_;
+    output_html << image_input_vec_[leaf.image_ind_].name();
     output_html << "\" rel=\"prettyPhoto[pp_gal]\">\n";
     output_html << "\t\t\t\t<img src=\"";
-    output_html << tree_leaves_[i]->img_path_;
+    output_html << image_input_vec_[leaf.image_ind_].name();
     output_html << "\" style=\"position:absolute; width:";
-    output_html << tree_leaves_[i]->position_.width_ - 1;
+    output_html << leaf.position_.width_ - 1;
     output_html << "px; height:";
-    output_html << tree_leaves_[i]->position_.height_ - 1;
+    output_html << leaf.position_.height_ - 1;
     output_html << "px; left:";
-    output_html << tree_leaves_[i]->position_.x_ - 1;
+    output_html << leaf.position_.x_ - 1;
     output_html << "px; top:";
-    output_html << tree_leaves_[i]->position_.y_ - 1;
+    output_html << leaf.position_.y_ - 1;
     output_html << "px;\">\n";
     output_html << "\t\t\t</a>\n";
   }
@@ -224,455 +505,37 @@ bool CollageAdvanced::OutputCollageHtml(const std::string output_html_path) {
 // Private member functions:
 // The images are stored in the image list, one image path per row.
 // This function reads the images into image_vec_ and their aspect
-// ratios into image_alpha_vec_.
+// ratios into layout_.
 bool CollageAdvanced::ReadImageList(std::string input_image_list) {
   std::ifstream input_list(input_image_list.c_str());
   if (!input_list) {
-    std::cout << "Error: ReadImageList" << std::endl;
+    COLLAGE_LOG(kLogError) << "ReadImageList";
     return false;
   }
-  int index = 0;
   while (!input_list.eof()) {
     std::string img_path;
     std::getline(input_list, img_path);
     // std::cout << img_path <<std::endl;
-    cv::Mat img = cv::imread(img_path.c_str());
-    if (img.empty())
-      continue;
-    AlphaUnit new_unit;
-    new_unit.image_ind_ = index;
-    new_unit.alpha_ = static_cast<float>(img.cols) / img.rows;
-    new_unit.alpha_recip_ = static_cast<float>(img.rows) / img.cols;
-    new_unit.image_path_ = img_path;
-    image_alpha_vec_.push_back(new_unit);
-    image_path_vec_.push_back(img_path);
-    ++index;
+    ReadImageAlpha(CollageInput::FromPath(img_path));
   }
   input_list.close();
   return true;
 }
 
-// Recursively calculate aspect ratio for all the inner nodes.
-// The return value is the aspect ratio for the node.
-float CollageAdvanced::CalculateAlpha(TreeNode* node) {
-  if (!node->is_leaf_) {
-    float left_alpha = CalculateAlpha(node->left_child_);
-    float right_alpha = CalculateAlpha(node->right_child_);
-    if (node->split_type_ == 'v') {
-      node->alpha_ = left_alpha + right_alpha;
-      return node->alpha_;
-    } else if (node->split_type_ == 'h') {
-      node->alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
-      return node->alpha_;
-    } else {
-      std::cout << "Error: CalculateAlpha" << std::endl;
-      return -1;
-    }
-  } else {
-    // This is a leaf node, just return the image's aspect ratio.
-    return node->alpha_;
-  }
-}
-
-// Top-down Calculate the image positions in the colage.
-bool CollageAdvanced::CalculatePositions(TreeNode* node) {
-  // Step 1: calculate height & width.
-  if (node->parent_->split_type_ == 'v') {
-    // Vertical cut, height unchanged.
-    node->position_.height_ = node->parent_->position_.height_;
-    if (node->child_type_ == 'l') {
-      node->position_.width_ = node->position_.height_ * node->alpha_;
-    } else if (node->child_type_ == 'r') {
-      node->position_.width_ = node->parent_->position_.width_ -
-      node->parent_->left_child_->position_.width_;
-    } else {
-      std::cout << "Error: CalculatePositions step 0" << std::endl;
-      return false;
-    }
-  } else if (node->parent_->split_type_ == 'h') {
-    // Horizontal cut, width unchanged.
-    node->position_.width_ = node->parent_->position_.width_;
-    if (node->child_type_ == 'l') {
-      node->position_.height_ = node->position_.width_ / node->alpha_;
-    } else if (node->child_type_ == 'r') {
-      node->position_.height_ = node->parent_->position_.height_ -
-      node->parent_->left_child_->position_.height_;
-    }
-  } else {
-    std::cout << "Error: CalculatePositions step 1" << std::endl;
-    return false;
-  }
-  
-  // Step 2: calculate x & y.
-  if (node->child_type_ == 'l') {
-    // If it is left child, use its parent's x & y.
-    node->position_.x_ = node->parent_->position_.x_;
-    node->position_.y_ = node->parent_->position_.y_;
-  } else if (node->child_type_ == 'r') {
-    if (node->parent_->split_type_ == 'v') {
-      // y (row) unchanged, x (colmn) changed.
-      node->position_.y_ = node->parent_->position_.y_;
-      node->position_.x_ = node->parent_->position_.x_ +
-      node->parent_->position_.width_ -
-      node->position_.width_;
-    } else if (node->parent_->split_type_ == 'h') {
-      // x (column) unchanged, y (row) changed.
-      node->position_.x_ = node->parent_->position_.x_;
-      node->position_.y_ = node->parent_->position_.y_ +
-      node->parent_->position_.height_ -
-      node->position_.height_;
-    } else {
-      std::cout << "Error: CalculatePositions step 2 - 1" << std::endl;
-    }
-  } else {
-    std::cout << "Error: CalculatePositions step 2 - 2" << std::endl;
+// Only the image size is needed to compute the aspect ratio, so we first try
+// the index and then the file header. Formats the probe does not understand
+// fall back to a full decode.
+bool CollageAdvanced::ReadImageAlpha(const CollageInput& input) {
+  int width = 0;
+  int height = 0;
+  if (!input.ReadSize(image_index_, width, height))
     return false;
-  }
-  
-  // Calculation for children.
-  if (node->left_child_) {
-    bool success = CalculatePositions(node->left_child_);
-    if (!success) return false;
-  }
-  if (node->right_child_) {
-    bool success = CalculatePositions(node->right_child_);
-    if (!success) return false;
-  }
+  AppendImage(input, width, height);
   return true;
 }
 
-
-// Release the memory for binary tree.
-void CollageAdvanced::ReleaseTree(TreeNode* node) {
-  if (node == NULL) return;
-  if (node->left_child_) ReleaseTree(node->left_child_);
-  if (node->right_child_) ReleaseTree(node->right_child_);
-  delete node;
-}
-
-void CollageAdvanced::GenerateTree(float expect_alpha) {
-  if (tree_root_) ReleaseTree(tree_root_);
-  tree_leaves_.clear();
-  // Copy image_alpha_vec_ for local computation.
-  std::vector<AlphaUnit> local_alpha;
-  for (int i = 0; i < image_alpha_vec_.size(); ++i) {
-    local_alpha.push_back(image_alpha_vec_[i]);
-  }
-  
-  // Generate a new tree by using divide-and-conquer.
-  tree_root_ = GuidedTree(NULL, 'N', expect_alpha,
-                          image_num_, local_alpha, expect_alpha);
-  // After guided tree generation, all the images have been dispatched to leaves.
-  assert(local_alpha.size() == 0);
-  return;
-}
-
-// Divide-and-conquer tree generation.
-TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
-                                      char child_type,
-                                      float expect_alpha,
-                                      int img_num,
-                                      std::vector<AlphaUnit>& alpha_array,
-                                      float root_alpha) {
-  if (alpha_array.size() == 0) {
-    std::cout << "Error: GuidedTree 0" << std::endl;
-    return NULL;
-  }
-  
-  // Create a new TreeNode.
-  TreeNode* node = new TreeNode();
-  node->parent_ = parent;
-  node->child_type_ = child_type;
-  
-  if (img_num == 1) {
-    // Set the new node.
-    node->is_leaf_ = true;
-    // Find the best fit aspect ratio.
-    bool success = FindOneImage(expect_alpha,
-                                alpha_array,
-                                node->alpha_,
-                                node->img_path_);
-    if (!success) {
-      std::cout << "Error: GuidedTree 1" << std::endl;
-      return NULL;
-    }
-    tree_leaves_.push_back(node);
-  } else if (img_num == 2) {
-    // Set the new node.
-    node->is_leaf_ = false;
-    TreeNode* l_child = new TreeNode();
-    l_child->child_type_ = 'l';
-    l_child->parent_ = node;
-    l_child->is_leaf_ = true;
-    node->left_child_ = l_child;
-    
-    TreeNode* r_child = new TreeNode();
-    r_child->child_type_ = 'r';
-    r_child->parent_ = node;
-    r_child->is_leaf_ = true;
-    node->right_child_ = r_child;
-    // Find the best fit aspect ratio with two nodes.
-    // As well as the split type for node.
-    bool success = FindTwoImages(expect_alpha,
-                                 alpha_array,
-                                 node->split_type_,
-                                 l_child->alpha_,
-                                 l_child->img_path_,
-                                 r_child->alpha_,
-                                 r_child->img_path_);
-    if (!success) {
-      std::cout << "Error: GuidedTree 2" << std::endl;
-      return NULL;
-    }
-    tree_leaves_.push_back(l_child);
-    tree_leaves_.push_back(r_child);
-  } else {
-    node->is_leaf_ = false;
-    float new_exp_alpha = 0;
-    // Random split type.
-    int v_h = random(2);
-    if (expect_alpha > root_alpha * 2) v_h = 1;
-    if (expect_alpha < root_alpha / 2) v_h = 0;
-    if (v_h == 1) {
-      node->split_type_ = 'v';
-      new_exp_alpha = expect_alpha / 2;
-    } else {
-      node->split_type_ = 'h';
-      new_exp_alpha = expect_alpha * 2;
-    }
-    int new_img_num_1 = static_cast<int>(img_num / 2);
-    int new_img_num_2 = img_num - new_img_num_1;
-    if (new_img_num_1 > 0) {
-      TreeNode* l_child = new TreeNode();
-      l_child = GuidedTree(node, 'l', new_exp_alpha,
-                           new_img_num_1, alpha_array, root_alpha);
-      node->left_child_ = l_child;
-    }
-    if (new_img_num_2 > 0) {
-      TreeNode* r_child = new TreeNode();
-      r_child = GuidedTree(node, 'r', new_exp_alpha,
-                           new_img_num_2, alpha_array, root_alpha);
-      node->right_child_ = r_child;
-    }
-  }
-  return node;
-}
-
-// Find the best-match aspect ratio image in the given array.
-// alpha_array is the array storing aspect ratios.
-// find_img_alpha is the best-match alpha value.
-// After finding the best-match one, the AlphaUnit is removed from alpha_array,
-// which means that we have dispatched one image with a tree leaf.
-bool CollageAdvanced::FindOneImage(float expect_alpha,
-                                   std::vector<AlphaUnit>& alpha_array,
-                                   float& find_img_alpha,
-                                   std::string & find_img_path) {
-  if (alpha_array.size() == 0) return false;
-  // Since alpha_array has already been sorted, we use binary search to find
-  // the best-match result.
-  int finder = -1;
-  int min_ind = 0;
-  int mid_ind = -1;
-  int max_ind = static_cast<int>(alpha_array.size()) - 1;
-  while (min_ind + 1 < max_ind) {
-    mid_ind = (min_ind + max_ind) / 2;
-    if (alpha_array[mid_ind].alpha_ == expect_alpha) {
-      finder = mid_ind;
-      break;
-    } else if (alpha_array[mid_ind].alpha_ > expect_alpha) {
-      max_ind = mid_ind - 1;
-    } else {
-      min_ind = mid_ind + 1;
-    }
-  }
-  if (finder == -1) {
-    if (fabs(alpha_array[max_ind].alpha_ - expect_alpha) >
-        fabs(alpha_array[min_ind].alpha_ - expect_alpha)) finder = min_ind;
-    else finder = max_ind;
-  }
-  
-  // Dispatch image to leaf node.
-  find_img_alpha = alpha_array[finder].alpha_;
-  find_img_path = alpha_array[finder].image_path_;
-  // Remove the find result from alpha_array.
-//  std::cout<< alpha_array[finder].image_ind_ << std::endl;
-  alpha_array.erase(alpha_array.begin() + finder);
-  return true;
-}
-
-// Find the best fit aspect ratio (two images) in the given array.
-// find_split_type returns 'h' or 'v'.
-// If it is 'h', the parent node is horizontally split, and 'v' for vertically
-// split. After finding the two images, the corresponding AlphaUnits are
-// removed, which means we have dispatched two images.
-bool CollageAdvanced::FindTwoImages(float expect_alpha,
-                                    std::vector<AlphaUnit>& alpha_array,
-                                    char& find_split_type,
-                                    float& find_img_alpha_1,
-                                    std::string& find_img_path_1,
-                                    float& find_img_alpha_2,
-                                    std::string& find_img_path_2) {
-  if ((alpha_array.size() == 0) || (alpha_array.size() == 1)) return false;
-  // There are two situations:
-  // [1]: parent node is vertival cut.
-  int i = 0;
-  int j = static_cast<int>(alpha_array.size()) - 1;
-  int best_v_i = i;
-  int best_v_j = j;
-  float min_v_diff = fabs(alpha_array[best_v_i].alpha_ +
-                         alpha_array[best_v_j].alpha_ -
-                         expect_alpha);
-  while (i < j) {
-    if (alpha_array[i].alpha_ + alpha_array[j].alpha_ > expect_alpha) {
-      float diff = fabs(alpha_array[i].alpha_ +
-                       alpha_array[j].alpha_ -
-                       expect_alpha);
-      if (diff < min_v_diff) {
-        min_v_diff = diff;
-        best_v_i = i;
-        best_v_j = j;
-      }
-      --j;
-    } else if (alpha_array[i].alpha_ + alpha_array[j].alpha_ < expect_alpha) {
-      float diff = fabs(alpha_array[i].alpha_ +
-                       alpha_array[j].alpha_ -
-                       expect_alpha);
-      if (diff < min_v_diff) {
-        min_v_diff = diff;
-        best_v_i = i;
-        best_v_j = j;
-      }
-      ++i;
-    } else {
-      best_v_i = i;
-      best_v_j = j;
-      min_v_diff = 0;
-      break;
-    }
-  }
-  // [2]: parent node is horizontal cut;
-  float expect_alpha_recip = 1 / expect_alpha;
-  i = 0;
-  j = static_cast<int>(alpha_array.size()) - 1;
-  int best_h_i = i;
-  int best_h_j = j;
-  float min_h_diff = fabs(alpha_array[best_h_i].alpha_recip_ +
-                         alpha_array[best_h_j].alpha_recip_ -
-                         expect_alpha_recip);
-  while (i < j) {
-    if (alpha_array[i].alpha_recip_ + alpha_array[j].alpha_recip_ >
-        expect_alpha_recip) {
-      float diff = fabs(alpha_array[i].alpha_recip_ +
-                       alpha_array[j].alpha_recip_ -
-                       expect_alpha_recip);
-      if (diff < min_h_diff) {
-        min_h_diff = diff;
-        best_h_i = i;
-        best_h_j = j;
-      }
-      ++i;
-    } else if (alpha_array[i].alpha_recip_  + alpha_array[j].alpha_recip_ <
-        expect_alpha_recip) {
-      float diff = fabs(alpha_array[i].alpha_recip_ +
-                        alpha_array[j].alpha_recip_ -
-                        expect_alpha_recip);
-      if (diff < min_h_diff) {
-        min_h_diff = diff;
-        best_h_i = i;
-        best_h_j = j;
-      }
-      --j;
-    } else {
-      best_h_i = i;
-      best_h_j = j;
-      min_h_diff = 0;
-      break;
-    }
-  }
-  
-  // Find the best-match from the above two situations.
-  float real_alpha_v = alpha_array[best_v_i].alpha_ + alpha_array[best_v_j].alpha_;
-  float real_alpha_h = (alpha_array[best_h_i].alpha_ * alpha_array[best_h_j].alpha_) /
-  (alpha_array[best_h_i].alpha_ + alpha_array[best_h_j].alpha_);
-  
-  float ratio_diff_v = -1;
-  float ratio_diff_h = -1;
-  if (real_alpha_v > expect_alpha) {
-    ratio_diff_v = real_alpha_v / expect_alpha;
-  } else {
-    ratio_diff_v = expect_alpha / real_alpha_v;
-  }
-  if (real_alpha_h > expect_alpha) {
-    ratio_diff_h = real_alpha_h / expect_alpha;
-  } else {
-    ratio_diff_h = expect_alpha / real_alpha_h;
-  }
-
-  assert(best_h_i < best_h_j);
-  assert(best_v_i < best_v_j);
-  
-  if (ratio_diff_v <= ratio_diff_h) {
-    find_split_type = 'v';
-    find_img_path_1 = alpha_array[best_v_i].image_path_;
-    find_img_alpha_1 = alpha_array[best_v_i].alpha_;
-    find_img_alpha_2 = alpha_array[best_v_j].alpha_;
-    find_img_path_2 = alpha_array[best_v_j].image_path_;
-    
-//    std::cout << alpha_array[best_v_i].image_ind_
-//    << ":" << alpha_array[best_v_j].image_ind_ << std::endl;
-    
-    alpha_array.erase(alpha_array.begin() + best_v_j);
-    alpha_array.erase(alpha_array.begin() + best_v_i);
-  } else {
-    find_split_type = 'h';
-    find_img_path_1 = alpha_array[best_h_i].image_path_;
-    find_img_alpha_1 = alpha_array[best_h_i].alpha_;
-    find_img_alpha_2 = alpha_array[best_h_j].alpha_;
-    find_img_path_2 = alpha_array[best_h_j].image_path_;
-//    std::cout << alpha_array[best_h_i].image_ind_
-//    << ":" << alpha_array[best_h_j].image_ind_ << std::endl;
-    
-    alpha_array.erase(alpha_array.begin() + best_h_j);
-    alpha_array.erase(alpha_array.begin() + best_h_i);
-  }
-  return true;
-}
-
-bool CollageAdvanced::AdjustAlpha(TreeNode *node, float thresh) {
-  assert(thresh > 1);
-  if (node->is_leaf_) return false;
-  if (node == NULL) return false;
-  
-  bool changed = false;
-  
-  float thresh_2 = 1 + (thresh - 1) / 2;
-  
-  if (node->alpha_ > node->alpha_expect_ * thresh_2) {
-    // Too big actual aspect ratio.
-    if (node->split_type_ == 'v') changed = true;
-    node->split_type_ = 'h';
-    node->left_child_->alpha_expect_ = node->alpha_expect_ * 2;
-    node->right_child_->alpha_expect_ = node->alpha_expect_ * 2;
-  } else if (node->alpha_ < node->alpha_expect_ / thresh_2 ) {
-    // Too small actual aspect ratio.
-    if (node->split_type_ == 'h') changed = true;
-    node->split_type_ = 'v';
-    node->left_child_->alpha_expect_ = node->alpha_expect_ / 2;
-    node->right_child_->alpha_expect_ = node->alpha_expect_ / 2;
-  } else {
-    // Aspect ratio is okay.
-    if (node->split_type_ == 'h') {
-      node->left_child_->alpha_expect_ = node->alpha_expect_ * 2;
-      node->right_child_->alpha_expect_ = node->alpha_expect_ * 2;
-    } else if (node->split_type_ == 'v') {
-      node->left_child_->alpha_expect_ = node->alpha_expect_ / 2;
-      node->right_child_->alpha_expect_ = node->alpha_expect_ / 2;
-    } else {
-      std::cout << "Error: AdjustAlpha" << std::endl;
-      return false;
-    }
-  }
-  bool changed_l = AdjustAlpha(node->left_child_, thresh);
-  bool changed_r = AdjustAlpha(node->right_child_, thresh);
-  return changed||changed_l||changed_r;
+void CollageAdvanced::AppendImage(const CollageInput& input,
+                                  int width, int height) {
+  layout_.AddImage(width, height);
+  image_input_vec_.push_back(input);
 }
@@ -9,64 +9,23 @@
 #ifndef __wu_collage_advanced__wu_collage_advanced__
 #define __wu_collage_advanced__wu_collage_advanced__
 
+#include "band_writer.h"
+#include "collage_input.h"
+#include "collage_layout.h"
+#include "image_index.h"
+#include "tile_cache.h"
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <vector>
-#include <time.h>
-#define random(x) (rand() % x)
-#define MAX_ITER_NUM 100      // Max number of aspect ratio adjustment.
-#define MAX_TREE_GENE_NUM 10000  // Max number of tree re-generation.
 
-class FloatRect {
-public:
-  FloatRect () {
-    x_ = 0;
-    y_ = 0;
-    width_ = 0;
-    height_ = 0;
-  }
-  float x_;
-  float y_;
-  float width_;
-  float height_;
-};
-
-class TreeNode {
-public:
-  TreeNode() {
-    child_type_ = 'N';
-    split_type_ = 'N';
-    is_leaf_ = true;
-    alpha_ = 0;
-    alpha_expect_ = 0;
-    position_ = FloatRect();
-    left_child_ = NULL;
-    right_child_ = NULL;
-    parent_ = NULL;
-    img_path_ = "";
-  }
-  char child_type_;      // Is this node left child "l" or right child "r".
-  char split_type_;      // If this node is a inner node, we set 'v' or 'h', which indicate
-  // vertical cut or horizontal cut.
-  bool is_leaf_;         // Is this node a leaf node or a inner node.
-  float alpha_expect_;   // If this node is a leaf, we set expected aspect ratio of this node.
-  float alpha_;          // If this node is a leaf, we set actual aspect ratio of this node.
-  FloatRect position_;    // The position of the node on canvas.
-  TreeNode* left_child_;
-  TreeNode* right_child_;
-  TreeNode* parent_;
-  std::string img_path_;
-};
+// Default size of one band in OutputCollageBands.
+static const size_t kBandBytes = 64 << 20;
+// CreateCollageImage decodes every image for a tile this many times the
+// average tile area, so that few tiles need a second decode.
+static const float kPrefetchAreaMargin = 8;
 
-
-class AlphaUnit {
-public:
-  int image_ind_;          // The related image index.
-  float alpha_;            // Aspect ratio value.
-  float alpha_recip_;      // Reciprocal sapect ratio value.
-  std::string image_path_; // The related image path.
-};
+class ImagePrefetcher;
 
 // Collage with pre-defined aspect ratio
 class CollageAdvanced {
@@ -75,18 +34,36 @@ public:
   // We need to let the user decide the canvas height.
   // Since the aspect ratio will be calculate by our program, we can compute
   // canvas width accordingly.
-  CollageAdvanced(const std::string input_image_list, const int canvas_width) : canvas_alpha_(-1),
-      canvas_width_(canvas_width), canvas_height_(-1) {
+  // Tree generation is driven by random_seed. The same images, parameters
+  // and seed give the same collage; by default every instance gets a
+  // different seed.
+  // Image sizes are looked up in image_index first, if given. Only the images
+  // missing from it (or changed since indexing) are opened.
+  CollageAdvanced(const std::string input_image_list, const int canvas_width,
+                  const uint64_t random_seed = CollageRandom::DefaultSeed(),
+                  const ImageIndex* image_index = NULL)
+      : layout_(canvas_width, random_seed),
+        image_index_(image_index), tile_cache_(NULL) {
     ReadImageList(input_image_list);
-    image_num_ = static_cast<int>(image_path_vec_.size());
-    srand(static_cast<unsigned>(time(0)));
-    tree_root_ = new TreeNode();
   }
-  CollageAdvanced(const std::vector<std::string> input_image_list, const int canvas_width);
+  CollageAdvanced(const std::vector<std::string> input_image_list, const int canvas_width,
+                  const uint64_t random_seed = CollageRandom::DefaultSeed(),
+                  const ImageIndex* image_index = NULL);
+  // Images whose sizes are already known (e.g. from a metadata store) are
+  // not opened at all; image_sizes[i] is the size of image_paths[i].
+  CollageAdvanced(const std::vector<std::string>& image_paths,
+                  const std::vector<cv::Size>& image_sizes,
+                  const int canvas_width,
+                  const uint64_t random_seed = CollageRandom::DefaultSeed());
+  // Images held in memory by the caller: encoded buffers, decoded Mats, or
+  // handles whose pixels pixel_provider returns when the collage is
+  // rendered. Inputs whose size cannot be read are left out.
+  CollageAdvanced(const std::vector<CollageInput>& inputs,
+                  const int canvas_width,
+                  const uint64_t random_seed = CollageRandom::DefaultSeed(),
+                  const PixelProvider& pixel_provider = PixelProvider());
   ~CollageAdvanced() {
-    ReleaseTree(tree_root_);
-    image_alpha_vec_.clear();
-    image_path_vec_.clear();
+    image_input_vec_.clear();
   }
   
   // Create collage.
@@ -105,85 +82,139 @@ public:
   int CreateCollage(const float expect_alpha, const float thresh,
                     int& total_tree_generation,
                     int& total_adjust_iteration);
+  // Multi-start version of the above. thread_num trees are generated and
+  // adjusted independently on their own threads, sharing the
+  // MAX_TREE_GENE_NUM budget. By default the first tree that reaches
+  // [expect_alpha / thresh, expect_alpha * thresh] wins and the other threads
+  // stop. If keep_closest is set, every thread runs until it finds its own
+  // result, and the one closest to expect_alpha is kept.
+  // The counters are summed over all threads.
+  int CreateCollage(const float expect_alpha, const float thresh,
+                    int& total_tree_generation,
+                    int& total_adjust_iteration,
+                    int thread_num,
+                    bool keep_closest = false);
+  // Latency-bounded version: the search stops time_budget_us after the call,
+  // or once *cancel is raised, and the tree closest to expect_alpha seen so
+  // far is laid out. Returns 1 if it is within thresh, 0 if not, and -1 if
+  // no tree was generated at all.
+  int CreateCollageWithin(const float expect_alpha, const float thresh,
+                          long long time_budget_us,
+                          int& total_tree_generation,
+                          int& total_adjust_iteration,
+                          int thread_num = 1,
+                          const std::atomic<bool>* cancel = NULL);
+  
+  // CreateCollage and OutputCollageImage in one call, with the images
+  // decoded in the background while the layout is searched. Returns -1 if
+  // no layout was found, in which case canvas is left untouched.
+  int CreateCollageImage(const float expect_alpha, const float thresh,
+                         int& total_tree_generation,
+                         int& total_adjust_iteration,
+                         cv::Mat& canvas,
+                         int thread_num = 1);
+  
+  // Add or remove one image of a created collage without searching a new
+  // layout, see CollageLayout::InsertImage and RemoveImage. changed_images
+  // lists the images whose tile moved or was resized, the others can be
+  // left as they are on a canvas drawn before (if canvas_height() did not
+  // change). AddImage returns false if the size of input cannot be read.
+  bool AddImage(const CollageInput& input, std::vector<int>& changed_images);
+  bool RemoveImage(int image_ind, std::vector<int>& changed_images);
   
   // Output collage into a single image.
+  // Tile images come from the tile cache if one is set.
   cv::Mat OutputCollageImage() const;
+  // Render the collage band by band, from top to bottom, and hand every band
+  // to all the writers (e.g. a PpmBandWriter and a DziBandWriter in the same
+  // pass). Peak memory is one band plus the tiles crossing it, whatever the
+  // canvas size. band_height <= 0 picks bands of about kBandBytes.
+  bool OutputCollageBands(const std::vector<BandWriter*>& writers,
+                          int band_height = 0) const;
   // Output collage into a html page.
   bool OutputCollageHtml (const std::string output_html_path);
+  // Write the layout as one JSON object: the canvas size and aspect ratio,
+  // the seed, and for every image (in input order) its name and rectangle.
+  void OutputCollageJson(std::ostream& output) const;
   
   // Accessors:
   int image_num() const {
-    return image_num_;
+    return layout_.image_num();
   }
   int canvas_height() const {
-    return canvas_height_;
+    return layout_.canvas_height();
   }
   int canvas_width() const {
-    return canvas_width_;
+    return layout_.canvas_width();
   }
   float canvas_alpha() const {
-    return canvas_alpha_;
+    return layout_.canvas_alpha();
+  }
+  uint64_t random_seed() const {
+    return layout_.random_seed();
+  }
+  // Number of inner node aspect ratio computations done by the last
+  // CreateCollage, over all threads. A full recomputation costs
+  // image_num() - 1 per tree generation or adjustment iteration.
+  long long alpha_update_num() const {
+    return layout_.alpha_update_num();
+  }
+  // The layout alone, e.g. for its leaf rectangles.
+  const CollageLayout& layout() const {
+    return layout_;
+  }
+  void set_random_seed(const uint64_t random_seed) {
+    layout_.set_random_seed(random_seed);
+  }
+  // Cache (not owned) of decoded tile images used by OutputCollageImage,
+  // typically shared by many collages. NULL decodes every tile each time.
+  void set_tile_cache(TileCache* tile_cache) {
+    tile_cache_ = tile_cache;
+  }
+  // Cache (not owned) of layouts, see CollageLayout::set_layout_cache.
+  void set_layout_cache(LayoutCache* layout_cache) {
+    layout_.set_layout_cache(layout_cache);
+  }
+  // See CollageLayout::set_use_topology_table.
+  void set_use_topology_table(bool use_topology_table) {
+    layout_.set_use_topology_table(use_topology_table);
+  }
+  // See CollageLayout::set_use_refinement.
+  void set_use_refinement(bool use_refinement) {
+    layout_.set_use_refinement(use_refinement);
+  }
+  // See CollageLayout::set_build_thread_num.
+  void set_build_thread_num(int build_thread_num) {
+    layout_.set_build_thread_num(build_thread_num);
+  }
+  // See CollageLayout::set_approximate_pairs.
+  void set_approximate_pairs(bool approximate_pairs) {
+    layout_.set_approximate_pairs(approximate_pairs);
   }
   
 private:
   // Read input images from image list.
   bool ReadImageList(std::string input_image_list);
-  // Recursively calculate aspect ratio for all the inner nodes.
-  // The return value is the aspect ratio for the node.
-  float CalculateAlpha(TreeNode* node);
-  // Top-down Calculate the image positions in the colage.
-  bool CalculatePositions(TreeNode* node);
-  // Clean and release the binary_tree.
-  void ReleaseTree(TreeNode* node);
-  // Guided binary tree generation.
-  void GenerateTree(float expect_alpha);
-  // Divide-and-conquer tree generation.
-  TreeNode* GuidedTree(TreeNode* parent,
-                       char child_type,
-                       float expect_alpha,
-                       int image_num,
-                       std::vector<AlphaUnit>& alpha_array,
-                       float root_alpha);
-  // Find the best-match aspect ratio image in the given array.
-  // alpha_array is the array storing aspect ratios.
-  // find_img_alpha is the best-match alpha value.
-  // After finding the best-match one, the AlphaUnit is removed from alpha_array,
-  // which means that we have dispatched one image with a tree leaf.
-  bool FindOneImage(float expect_alpha,
-                    std::vector<AlphaUnit>& alpha_array,
-                    float& find_img_alpha,
-                    std::string& find_img_path);
-  // Find the best fit aspect ratio (two images) in the given array.
-  // find_split_type returns 'h' or 'v'.
-  // If it is 'h', the parent node is horizontally split, and 'v' for vertically
-  // split. After finding the two images, the corresponding AlphaUnits are
-  // removed, which means we have dispatched two images.
-  bool FindTwoImages(float expect_alpha,
-                     std::vector<AlphaUnit>& alpha_array,
-                     char& find_split_type,
-                     float& find_img_alpha_1,
-                     std::string& find_img_path_1,
-                     float& find_img_alpha_2,
-                     std::string& find_img_path_2);
-  // Top-down adjust aspect ratio for the final collage.
-  bool AdjustAlpha(TreeNode* node, float thresh);
+  // Read one image's size (from image_index_, or the header only when
+  // possible) and add it to layout_. Returns false if it cannot be read.
+  bool ReadImageAlpha(const CollageInput& input);
+  // Append an image of known size to image_input_vec_ and layout_.
+  void AppendImage(const CollageInput& input, int width, int height);
+  // Render the laid out collage, taking the images from prefetcher if it is
+  // not NULL.
+  cv::Mat RenderCollageImage(ImagePrefetcher* prefetcher) const;
   
-  // Vector containing input image paths.
-  std::vector<std::string> image_path_vec_;
-  // Vector containing input images' aspect ratios.
-  std::vector<AlphaUnit> image_alpha_vec_;
-  // Vector containing leaf nodes of the tree.
-  std::vector<TreeNode*> tree_leaves_;
-  // Number of images in the collage. (number of leaf nodes in the tree)
-  int image_num_;
-  // Full balanced binary for collage generation.
-  TreeNode* tree_root_;
-  // Canvas height, this is decided by the user.
-  int canvas_height_;
-  // Canvas aspect ratio, return by CalculateAspectRatio ().
-  float canvas_alpha_;
-  // Canvas width, this is computed according to canvas_aspect_ratio_.
-  int canvas_width_;
+  // Vector containing input images (paths or in-memory images).
+  std::vector<CollageInput> image_input_vec_;
+  // Images' aspect ratios and the resulting layout tree. Image i of the
+  // layout is image_input_vec_[i].
+  CollageLayout layout_;
+  // Optional index consulted by ReadImageAlpha, not owned.
+  const ImageIndex* image_index_;
+  // See set_tile_cache().
+  TileCache* tile_cache_;
+  // Pixels of CollageInput::kHandle inputs, may be empty.
+  PixelProvider pixel_provider_;
   
 };
 
@@ -0,0 +1,145 @@
+//
+//  alpha_index_test.cc
+//  wu_collage_advanced
+//
+//  AlphaIndex lookups against the original searches over a plain vector.
+//
+
+#include "alpha_index.h"
+#include "collage_random.h"
+#include "test_check.h"
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+namespace {
+
+// The original FindTwoImages search for one cut: two pointers over the
+// images left, sorted by aspect ratio. Returns positions in values.
+void BaselinePair(const std::vector<float>& values, bool use_recip,
+                  float target, int& best_i, int& best_j) {
+  int n = static_cast<int>(values.size());
+  std::vector<float> value(n);
+  for (int k = 0; k < n; ++k) {
+    value[k] = use_recip ? 1 / values[k] : values[k];
+  }
+  int i = 0;
+  int j = n - 1;
+  best_i = i;
+  best_j = j;
+  float min_diff = fabs(value[i] + value[j] - target);
+  while (i < j) {
+    float sum = value[i] + value[j];
+    float diff = fabs(sum - target);
+    if (sum == target) {
+      best_i = i;
+      best_j = j;
+      break;
+    }
+    if (diff < min_diff) {
+      min_diff = diff;
+      best_i = i;
+      best_j = j;
+    }
+    // Reciprocals descend with the position.
+    if ((sum > target) != use_recip) {
+      --j;
+    } else {
+      ++i;
+    }
+  }
+}
+
+// The original FindOneImage: the first closest aspect ratio.
+int BaselineNearest(const std::vector<float>& values, float target) {
+  int best = 0;
+  for (int k = 1; k < values.size(); ++k) {
+    if (fabs(values[k] - target) < fabs(values[best] - target)) best = k;
+  }
+  return best;
+}
+
+// Dispatch every image of a random set in pairs and single images, as the
+// tree generation does, and compare each choice with the baseline.
+void TestAgainstBaseline(bool approximate) {
+  CollageRandom random(7);
+  for (int round = 0; round < 60; ++round) {
+    int n = 2 + round * 7;
+    std::vector<float> sorted(n);
+    for (int k = 0; k < n; ++k) {
+      sorted[k] = 0.3f + 2.5f * random.UniformFloat();
+    }
+    std::sort(sorted.begin(), sorted.end());
+    AlphaIndex index;
+    index.Build(sorted);
+    index.set_approximate_pairs(approximate);
+    // The images left, and their ranks in the index.
+    std::vector<float> left = sorted;
+    std::vector<int> ranks(n);
+    for (int k = 0; k < n; ++k) {
+      ranks[k] = k;
+    }
+    while (index.remain_num() > 0) {
+      CHECK(index.remain_num() == left.size());
+      float target = 0.5f + 3 * random.UniformFloat();
+      if ((index.remain_num() == 1) || (random.UniformFloat() < 0.2f)) {
+        int rank = index.FindNearest(target);
+        int pos = BaselineNearest(left, target);
+        CHECK(fabs(index.alpha(rank) - target) == fabs(left[pos] - target));
+        pos = static_cast<int>(std::find(ranks.begin(), ranks.end(), rank) -
+                               ranks.begin());
+        CHECK(pos < ranks.size());
+        index.Remove(rank);
+        left.erase(left.begin() + pos);
+        ranks.erase(ranks.begin() + pos);
+        continue;
+      }
+      bool use_recip = (random.UniformFloat() < 0.5f);
+      int rank_1 = -1;
+      int rank_2 = -1;
+      bool found = use_recip ?
+          index.FindPairRecipSum(1 / target, rank_1, rank_2) :
+          index.FindPairSum(target, rank_1, rank_2);
+      CHECK(found);
+      CHECK((rank_1 >= 0) && (rank_1 < rank_2) && (rank_2 < n));
+      int pos_1 = static_cast<int>(
+          std::find(ranks.begin(), ranks.end(), rank_1) - ranks.begin());
+      int pos_2 = static_cast<int>(
+          std::find(ranks.begin(), ranks.end(), rank_2) - ranks.begin());
+      // Both must still be available.
+      CHECK((pos_1 < ranks.size()) && (pos_2 < ranks.size()));
+      if ((pos_1 == ranks.size()) || (pos_2 == ranks.size())) return;
+      if (!approximate || (left.size() <= 64)) {
+        int best_i = -1;
+        int best_j = -1;
+        BaselinePair(left, use_recip, use_recip ? 1 / target : target,
+                     best_i, best_j);
+        CHECK((pos_1 == std::min(best_i, best_j)) &&
+              (pos_2 == std::max(best_i, best_j)));
+      }
+      index.Remove(rank_1);
+      index.Remove(rank_2);
+      left.erase(left.begin() + pos_2);
+      ranks.erase(ranks.begin() + pos_2);
+      left.erase(left.begin() + pos_1);
+      ranks.erase(ranks.begin() + pos_1);
+    }
+    CHECK(index.FindNearest(1) == -1);
+    int rank_1 = -1;
+    int rank_2 = -1;
+    CHECK(!index.FindPairSum(1, rank_1, rank_2));
+    // Reset makes everything available again.
+    index.Reset();
+    CHECK(index.remain_num() == n);
+    CHECK(index.FindNearest(0) == 0);
+    CHECK(index.FindNearest(100) == n - 1);
+  }
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestAgainstBaseline(false);
+  TestAgainstBaseline(true);
+  return TestResult();
+}
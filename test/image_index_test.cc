@@ -0,0 +1,132 @@
+//
+//  image_index_test.cc
+//  wu_collage_advanced
+//
+//  ImageIndex build, lookup, refresh, and corrupt index files.
+//
+
+#include "image_index.h"
+#include "image_probe.h"
+#include "test_check.h"
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+// Work files go to the current directory, the test's build directory.
+const char kImageDir[] = "image_index_test_images";
+const char kIndexPath[] = "image_index_test.idx";
+const char kCorruptPath[] = "image_index_test_corrupt.idx";
+
+// Offsets in the index file: a 24-byte header (magic, version, entry
+// number, pool size), then 40-byte entries (path offset, mtime, file size,
+// path length, ...).
+const size_t kPoolSizePos = 16;
+const size_t kEntryPos = 24;
+const size_t kPathLengthPos = kEntryPos + 24;
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+}
+
+void WriteFile(const std::string& path, const std::string& data) {
+  std::ofstream file(path.c_str(),
+                     std::ios::out | std::ios::binary | std::ios::trunc);
+  file.write(data.data(), data.size());
+}
+
+bool SetMtime(const std::string& path, long nanoseconds) {
+  struct timespec times[2];
+  times[0].tv_sec = 1500000000;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec = 1500000000;
+  times[1].tv_nsec = nanoseconds;
+  return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+// An index file whose bytes at pos are replaced by value.
+bool OpensPatched(const std::string& data, size_t pos, const void* value,
+                  size_t size) {
+  std::string patched = data;
+  memcpy(&patched[pos], value, size);
+  WriteFile(kCorruptPath, patched);
+  ImageIndex index;
+  return index.Open(kCorruptPath);
+}
+
+void TestBuildAndLookup(const std::string& image_path) {
+  std::vector<std::string> roots(1, kImageDir);
+  int probed_num = -1;
+  CHECK(ImageIndex::Build(roots, kIndexPath, 2, NULL, &probed_num));
+  CHECK(probed_num == 1);
+  ImageIndex index;
+  CHECK(index.Open(kIndexPath));
+  CHECK(index.entry_num() == 1);
+  int width = 0;
+  int height = 0;
+  CHECK(index.Lookup(image_path, width, height));
+  CHECK((width == 300) && (height == 200));
+  CHECK(!index.Lookup(image_path + "x", width, height));
+
+  // A refresh reuses the unchanged entry.
+  CHECK(ImageIndex::Build(roots, kIndexPath, 1, &index, &probed_num));
+  CHECK(probed_num == 0);
+
+  // Modification times are compared to the nanosecond.
+  CHECK(SetMtime(image_path, 2));
+  CHECK(!index.Lookup(image_path, width, height));
+  index.set_validate(false);
+  CHECK(index.Lookup(image_path, width, height));
+}
+
+void TestCorrupt() {
+  std::string data = ReadFile(kIndexPath);
+  CHECK(data.size() > kPathLengthPos + 4);
+  if (data.size() <= kPathLengthPos + 4) return;
+  {
+    ImageIndex index;
+    WriteFile(kCorruptPath, data);
+    CHECK(index.Open(kCorruptPath));
+  }
+  uint64_t offset = 1ULL << 40;
+  CHECK(!OpensPatched(data, kEntryPos, &offset, sizeof(offset)));
+  offset = ~0ULL;
+  CHECK(!OpensPatched(data, kEntryPos, &offset, sizeof(offset)));
+  uint32_t length = 0xFFFFFFFFu;
+  CHECK(!OpensPatched(data, kPathLengthPos, &length, sizeof(length)));
+  uint64_t pool_size = ~0ULL;
+  CHECK(!OpensPatched(data, kPoolSizePos, &pool_size, sizeof(pool_size)));
+  uint64_t entry_num = 1ULL << 60;
+  CHECK(!OpensPatched(data, 8, &entry_num, sizeof(entry_num)));
+  uint32_t version = 1;
+  CHECK(!OpensPatched(data, 4, &version, sizeof(version)));
+  CHECK(!OpensPatched(data, 0, "XXXX", 4));
+
+  ImageIndex index;
+  for (size_t size = 0; size < data.size(); ++size) {
+    WriteFile(kCorruptPath, data.substr(0, size));
+    CHECK(!index.Open(kCorruptPath));
+  }
+  CHECK(!index.Open("no_such_index.idx"));
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  mkdir(kImageDir, 0755);
+  std::string image_path = std::string(kImageDir) + "/photo.jpg";
+  WriteFile(image_path, ReadFile(std::string(COLLAGE_TEST_DIR) +
+                                 "/images/-Male-totaljpg1.jpg"));
+  CHECK(SetMtime(image_path, 1));
+  TestBuildAndLookup(image_path);
+  TestCorrupt();
+  return TestResult();
+}
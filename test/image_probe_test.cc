@@ -0,0 +1,145 @@
+//
+//  image_probe_test.cc
+//  wu_collage_advanced
+//
+//  Header probes on real, truncated and hostile images.
+//
+
+#include "image_probe.h"
+#include "test_check.h"
+#include <fstream>
+#include <iterator>
+#include <limits.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::vector<unsigned char> Bytes;
+
+void PutLE32(Bytes& bytes, size_t pos, unsigned int value) {
+  for (int i = 0; i < 4; ++i) {
+    bytes[pos + i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+bool Probe(const Bytes& bytes, int& width, int& height) {
+  width = 0;
+  height = 0;
+  return ProbeImageSize(bytes.empty() ? NULL : &bytes[0], bytes.size(),
+                        width, height);
+}
+
+// A JPEG made of SOI, an APP1 EXIF segment whose IFD starts at ifd_offset
+// and holds one orientation entry, and a 20x10 SOF0 frame header.
+Bytes ExifJpeg(unsigned int ifd_offset, unsigned int orientation) {
+  unsigned char data[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE1, 0, 32, 'E', 'x', 'i', 'f', 0, 0,
+    'I', 'I', 42, 0, 0, 0, 0, 0,
+    1, 0, 0x12, 0x01, 3, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xFF, 0xC0, 0, 11, 8, 0, 10, 0, 20, 3, 1, 0x11, 0, 2, 0x11,
+  };
+  Bytes bytes(data, data + sizeof(data));
+  PutLE32(bytes, 16, ifd_offset);
+  bytes[30] = static_cast<unsigned char>(orientation);
+  return bytes;
+}
+
+// A BMP file header plus the start of a BITMAPINFOHEADER.
+Bytes Bmp(int width, int height) {
+  Bytes bytes(26, 0);
+  bytes[0] = 'B';
+  bytes[1] = 'M';
+  PutLE32(bytes, 14, 40);
+  PutLE32(bytes, 18, static_cast<unsigned int>(width));
+  PutLE32(bytes, 22, static_cast<unsigned int>(height));
+  return bytes;
+}
+
+void TestFixture() {
+  std::string path = std::string(COLLAGE_TEST_DIR) +
+                     "/images/-Male-totaljpg1.jpg";
+  int width = 0;
+  int height = 0;
+  CHECK(ProbeImageSize(path, width, height));
+  CHECK((width == 300) && (height == 200));
+
+  // Every truncation either fails or still finds the frame header.
+  std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+  Bytes bytes((std::istreambuf_iterator<char>(file)),
+              std::istreambuf_iterator<char>());
+  CHECK(!bytes.empty());
+  for (size_t size = 0; size < bytes.size(); ++size) {
+    Bytes prefix(bytes.begin(), bytes.begin() + size);
+    if (Probe(prefix, width, height)) CHECK((width == 300) && (height == 200));
+  }
+  CHECK(!ProbeImageSize(std::string(COLLAGE_TEST_DIR) + "/no_such.jpg",
+                        width, height));
+}
+
+void TestExif() {
+  int width = 0;
+  int height = 0;
+  CHECK(Probe(ExifJpeg(8, 1), width, height));
+  CHECK((width == 20) && (height == 10));
+  // Orientations 5 ~ 8 transpose the image.
+  CHECK(Probe(ExifJpeg(8, 6), width, height));
+  CHECK((width == 10) && (height == 20));
+  // IFD offsets past the segment, including ones that wrap a 32-bit sum,
+  // are ignored rather than read.
+  unsigned int bad_offsets[] = {
+    0xFFFFFFFEu, 0xFFFFFFFFu, 0xFFFFFFF4u, 0x80000000u, 27, 1000
+  };
+  for (int i = 0; i < sizeof(bad_offsets) / sizeof(bad_offsets[0]); ++i) {
+    CHECK(Probe(ExifJpeg(bad_offsets[i], 6), width, height));
+    CHECK((width == 20) && (height == 10));
+  }
+}
+
+void TestHeaders() {
+  int width = 0;
+  int height = 0;
+  CHECK(Probe(Bmp(7, 5), width, height));
+  CHECK((width == 7) && (height == 5));
+  // Negative heights are top-down bitmaps.
+  CHECK(Probe(Bmp(7, -5), width, height));
+  CHECK((width == 7) && (height == 5));
+  CHECK(!Probe(Bmp(7, INT_MIN), width, height));
+  CHECK(!Probe(Bmp(-7, 5), width, height));
+  CHECK(!Probe(Bmp(0, 5), width, height));
+
+  unsigned char png[] = {
+    0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A, 0, 0, 0, 13,
+    'I', 'H', 'D', 'R', 0, 0, 1, 0, 0, 0, 0, 200,
+  };
+  Bytes png_bytes(png, png + sizeof(png));
+  CHECK(Probe(png_bytes, width, height));
+  CHECK((width == 256) && (height == 200));
+  png_bytes.pop_back();
+  CHECK(!Probe(png_bytes, width, height));
+  // Sizes above INT_MAX are not images.
+  png_bytes.push_back(200);
+  png_bytes[16] = 0x80;
+  CHECK(!Probe(png_bytes, width, height));
+
+  // Truncated WebP and JPEG headers, garbage and nothing at all.
+  unsigned char webp[] = {'R', 'I', 'F', 'F', 0, 0, 0, 0,
+                          'W', 'E', 'B', 'P', 'V', 'P', '8', ' '};
+  CHECK(!Probe(Bytes(webp, webp + sizeof(webp)), width, height));
+  unsigned char jpeg[] = {0xFF, 0xD8, 0xFF, 0xC0, 0, 11, 8, 0};
+  CHECK(!Probe(Bytes(jpeg, jpeg + sizeof(jpeg)), width, height));
+  unsigned char jpeg_len[] = {0xFF, 0xD8, 0xFF, 0xE0, 0xFF, 0xFF, 0};
+  CHECK(!Probe(Bytes(jpeg_len, jpeg_len + sizeof(jpeg_len)), width, height));
+  CHECK(!Probe(Bytes(64, 0xAB), width, height));
+  CHECK(!Probe(Bytes(), width, height));
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestFixture();
+  TestExif();
+  TestHeaders();
+  return TestResult();
+}
@@ -0,0 +1,149 @@
+//
+//  incremental_test.cc
+//  wu_collage_advanced
+//
+//  Random sequences of CollageLayout::InsertImage and RemoveImage against
+//  full recomputations.
+//
+
+#include "collage_layout.h"
+#include "test_check.h"
+#include <vector>
+
+namespace {
+
+bool SameRect(const FloatRect& a, const FloatRect& b) {
+  return (a.x_ == b.x_) && (a.y_ == b.y_) && (a.width_ == b.width_) &&
+         (a.height_ == b.height_);
+}
+
+// The tree of layout holds one leaf per image of alphas (numbered as there),
+// links agree both ways, parents come before their children in the pool, and
+// the aspect ratios and positions are what full passes recompute.
+void CheckLayout(const CollageLayout& layout,
+                 const std::vector<float>& alphas) {
+  const CollageTree& tree = layout.tree();
+  int image_num = static_cast<int>(alphas.size());
+  CHECK(layout.image_num() == image_num);
+  CHECK(tree.tree_leaves().size() == image_num);
+  CHECK(tree.node(tree.tree_root()).parent_ == -1);
+  std::vector<int> image_count(image_num, 0);
+  std::vector<int> stack(1, tree.tree_root());
+  int node_num = 0;
+  while (!stack.empty() && (node_num < 2 * image_num)) {
+    int ind = stack.back();
+    stack.pop_back();
+    ++node_num;
+    const TreeNode& cur = tree.node(ind);
+    if (cur.is_leaf_) {
+      CHECK((cur.image_ind_ >= 0) && (cur.image_ind_ < image_num));
+      if ((cur.image_ind_ < 0) || (cur.image_ind_ >= image_num)) continue;
+      ++image_count[cur.image_ind_];
+      CHECK(cur.alpha_ == alphas[cur.image_ind_]);
+      continue;
+    }
+    const TreeNode& left = tree.node(cur.left_child_);
+    const TreeNode& right = tree.node(cur.right_child_);
+    CHECK((left.parent_ == ind) && (left.child_type_ == 'l'));
+    CHECK((right.parent_ == ind) && (right.child_type_ == 'r'));
+    CHECK((ind < cur.left_child_) && (ind < cur.right_child_));
+    stack.push_back(cur.right_child_);
+    stack.push_back(cur.left_child_);
+  }
+  CHECK(node_num == 2 * image_num - 1);
+  for (int i = 0; i < image_num; ++i) {
+    CHECK(image_count[i] == 1);
+  }
+  // RemoveImage keeps the unused share of the pool bounded.
+  CHECK(tree.pool_size() - node_num <=
+        tree.pool_size() / POOL_COMPACT_FRACTION);
+
+  CollageTree full = tree;
+  CHECK(full.CalculateAlpha(full.tree_root()) == layout.canvas_alpha());
+  CHECK(full.CalculateAllPositions());
+  for (int i = 0; i < tree.tree_leaves().size(); ++i) {
+    int leaf = tree.tree_leaves()[i];
+    CHECK(SameRect(full.node(leaf).position_, tree.node(leaf).position_));
+  }
+}
+
+// changed_images must list exactly the images whose rectangle differs from
+// before, old_rects being renumbered as the operation renumbered the images.
+void CheckChanged(const CollageLayout& layout,
+                  const std::vector<FloatRect>& old_rects,
+                  const std::vector<int>& changed_images) {
+  std::vector<FloatRect> rects;
+  layout.LeafRects(rects);
+  std::vector<int> expected;
+  for (int i = 0; i < rects.size(); ++i) {
+    if ((i >= old_rects.size()) || !SameRect(rects[i], old_rects[i]))
+      expected.push_back(i);
+  }
+  CHECK(changed_images == expected);
+}
+
+void TestSequence(int image_num, int step_num, float insert_share,
+                  uint64_t seed) {
+  CollageRandom random(seed);
+  CollageLayout layout(1000, seed);
+  std::vector<float> alphas(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    alphas[i] = 0.5f + 1.5f * random.UniformFloat();
+    layout.AddImage(alphas[i]);
+  }
+  int tree_generation = 0;
+  int adjust_iteration = 0;
+  CHECK(layout.CreateLayout(1.0f, 1.5f, tree_generation,
+                            adjust_iteration) == 1);
+  CheckLayout(layout, alphas);
+  std::vector<int> changed_images;
+  for (int step = 0; step < step_num; ++step) {
+    std::vector<FloatRect> old_rects;
+    layout.LeafRects(old_rects);
+    if ((alphas.size() == 1) || (random.UniformFloat() < insert_share)) {
+      float alpha = 0.5f + 1.5f * random.UniformFloat();
+      CHECK(layout.InsertImage(alpha, changed_images));
+      alphas.push_back(alpha);
+      // The new image always gets a rectangle.
+      CHECK(!changed_images.empty() &&
+            (changed_images.back() == alphas.size() - 1));
+    } else {
+      int image_ind = random.Uniform(static_cast<int>(alphas.size()));
+      CHECK(layout.RemoveImage(image_ind, changed_images));
+      alphas.erase(alphas.begin() + image_ind);
+      old_rects.erase(old_rects.begin() + image_ind);
+    }
+    CheckLayout(layout, alphas);
+    CheckChanged(layout, old_rects, changed_images);
+  }
+}
+
+void TestErrors() {
+  std::vector<int> changed_images;
+  CollageLayout empty(1000, 1);
+  empty.AddImage(1.0f);
+  CHECK(!empty.InsertImage(1.0f, changed_images));
+  CHECK(!empty.RemoveImage(0, changed_images));
+
+  CollageLayout single(1000, 1);
+  single.AddImage(1.0f);
+  int tree_generation = 0;
+  int adjust_iteration = 0;
+  CHECK(single.CreateLayout(1.0f, 1.5f, tree_generation,
+                            adjust_iteration) == 1);
+  CHECK(!single.RemoveImage(0, changed_images));
+  CHECK(!single.RemoveImage(1, changed_images));
+  CHECK(!single.RemoveImage(-1, changed_images));
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestErrors();
+  // Growing, steady (a live feed replacing its images) and shrinking.
+  TestSequence(1, 200, 0.8f, 1);
+  TestSequence(40, 600, 0.5f, 2);
+  TestSequence(300, 250, 0.2f, 3);
+  TestSequence(20, 2000, 0.5f, 4);
+  return TestResult();
+}
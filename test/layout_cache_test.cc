@@ -0,0 +1,196 @@
+//
+//  layout_cache_test.cc
+//  wu_collage_advanced
+//
+//  Tree encoding round trip, LayoutCache hits and misses, and cached layouts
+//  in CollageLayout.
+//
+
+#include "collage_layout.h"
+#include "layout_cache.h"
+#include "test_check.h"
+#include <algorithm>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+bool AlphaLess(const AlphaUnit& m, const AlphaUnit& n) {
+  return m.alpha_ < n.alpha_;
+}
+
+// image_num random images sorted by aspect ratio, their index, and the
+// rank of every image.
+void MakeImages(int image_num, uint64_t seed, std::vector<AlphaUnit>& images,
+                AlphaIndex& index, std::vector<int>& ranks) {
+  CollageRandom random(seed);
+  images.resize(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    images[i].image_ind_ = i;
+    images[i].alpha_ = 0.4f + 2 * random.UniformFloat();
+    images[i].alpha_recip_ = 1 / images[i].alpha_;
+  }
+  std::sort(images.begin(), images.end(), AlphaLess);
+  std::vector<float> sorted(image_num);
+  ranks.resize(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    sorted[i] = images[i].alpha_;
+    ranks[images[i].image_ind_] = i;
+  }
+  index.Build(sorted);
+}
+
+void TestEncodeDecode() {
+  int sizes[] = {1, 2, 3, 17, 500};
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    std::vector<AlphaUnit> images;
+    AlphaIndex index;
+    std::vector<int> ranks;
+    MakeImages(sizes[s], 11 + s, images, index, ranks);
+    CollageTree tree;
+    tree.Init(&images, index, 5);
+    tree.GenerateTree(1.3f);
+    float alpha = tree.CalculateAlpha(tree.tree_root());
+    std::vector<int> code;
+    tree.Encode(ranks, code);
+    CHECK(code.size() == 2 * sizes[s] - 1);
+
+    CollageTree decoded;
+    decoded.Init(&images, index, 6);
+    CHECK(decoded.Decode(code));
+    CHECK(decoded.CalculateAlpha(decoded.tree_root()) == alpha);
+    std::vector<int> recoded;
+    decoded.Encode(ranks, recoded);
+    CHECK(recoded == code);
+    // Same image in the same place, leaf by leaf.
+    CHECK(decoded.tree_leaves().size() == tree.tree_leaves().size());
+    for (int i = 0; i < decoded.tree_leaves().size(); ++i) {
+      CHECK(decoded.node(decoded.tree_leaves()[i]).image_ind_ ==
+            tree.node(tree.tree_leaves()[i]).image_ind_);
+    }
+
+    // Codes that are not a tree with one leaf per image.
+    std::vector<int> bad = code;
+    bad.pop_back();
+    CHECK(!decoded.Decode(bad));
+    bad = code;
+    bad.push_back(0);
+    CHECK(!decoded.Decode(bad));
+    CHECK(!decoded.Decode(std::vector<int>()));
+    if (sizes[s] >= 2) {
+      bad.assign(code.size(), 0);
+      CHECK(!decoded.Decode(bad));
+      bad = code;
+      bad[0] = -3;
+      CHECK(!decoded.Decode(bad));
+    }
+    bad = code;
+    bad.back() = sizes[s];
+    CHECK(!decoded.Decode(bad));
+  }
+}
+
+void TestCache() {
+  std::vector<float> alphas;
+  alphas.push_back(0.75f);
+  alphas.push_back(1.0f);
+  alphas.push_back(1.5f);
+  LayoutKey key(alphas, 800, 1.0f, 1.1f);
+  // Aspect ratios within a quantization step share the key.
+  std::vector<float> close = alphas;
+  close[1] = 1.0001f;
+  CHECK(LayoutKey(close, 800, 1.0f, 1.1f) == key);
+  std::vector<float> far = alphas;
+  far[1] = 1.1f;
+  CHECK(!(LayoutKey(far, 800, 1.0f, 1.1f) == key));
+  CHECK(!(LayoutKey(alphas, 801, 1.0f, 1.1f) == key));
+  CHECK(!(LayoutKey(alphas, 800, 1.0f, 1.2f) == key));
+
+  std::vector<int> code;
+  code.push_back(-1);
+  code.push_back(0);
+  code.push_back(-2);
+  code.push_back(1);
+  code.push_back(2);
+  std::vector<int> found;
+  LayoutCache cache(1 << 20);
+  CHECK(!cache.Get(key, found));
+  CHECK(cache.miss_num() == 1);
+  cache.Put(key, code);
+  CHECK(cache.Get(LayoutKey(close, 800, 1.0f, 1.1f), found));
+  CHECK(found == code);
+  CHECK(cache.hit_num() == 1);
+  CHECK(!cache.Get(LayoutKey(far, 800, 1.0f, 1.1f), found));
+  cache.Clear();
+  CHECK(!cache.Get(key, found));
+
+  // A tiny capacity keeps the most recent layout only.
+  LayoutCache small(1);
+  small.Put(key, code);
+  small.Put(LayoutKey(far, 800, 1.0f, 1.1f), code);
+  CHECK(!small.Get(key, found));
+  CHECK(small.Get(LayoutKey(far, 800, 1.0f, 1.1f), found));
+
+  // Layouts on disk outlive the cache object.
+  const char kDiskDir[] = "layout_cache_test_dir";
+  mkdir(kDiskDir, 0755);
+  {
+    LayoutCache writer(1 << 20, kDiskDir);
+    writer.Put(key, code);
+  }
+  LayoutCache reader(1 << 20, kDiskDir);
+  found.clear();
+  CHECK(reader.Get(key, found));
+  CHECK(found == code);
+  CHECK(reader.disk_hit_num() == 1);
+  CHECK(reader.Get(key, found));
+  CHECK(reader.hit_num() == 1);
+}
+
+// A repeated request with another seed skips the search.
+void TestCachedLayout() {
+  LayoutCache cache(1 << 20);
+  CollageRandom random(3);
+  std::vector<float> alphas(40);
+  for (int i = 0; i < alphas.size(); ++i) {
+    alphas[i] = 0.5f + 1.5f * random.UniformFloat();
+  }
+  std::vector<FloatRect> first_rects;
+  for (int run = 0; run < 2; ++run) {
+    CollageLayout layout(1000, 100 + run);
+    layout.set_layout_cache(&cache);
+    layout.set_use_topology_table(false);
+    for (int i = 0; i < alphas.size(); ++i) {
+      layout.AddImage(alphas[i]);
+    }
+    int tree_generation = -1;
+    int adjust_iteration = -1;
+    CHECK(layout.CreateLayout(1.0f, 1.1f, tree_generation,
+                              adjust_iteration) == 1);
+    std::vector<FloatRect> rects;
+    layout.LeafRects(rects);
+    if (run == 0) {
+      CHECK(tree_generation > 0);
+      first_rects = rects;
+    } else {
+      CHECK(tree_generation == 0);
+      CHECK(cache.hit_num() == 1);
+      CHECK(rects.size() == first_rects.size());
+      for (int i = 0; (i < rects.size()) && (i < first_rects.size()); ++i) {
+        CHECK((rects[i].x_ == first_rects[i].x_) &&
+              (rects[i].y_ == first_rects[i].y_) &&
+              (rects[i].width_ == first_rects[i].width_) &&
+              (rects[i].height_ == first_rects[i].height_));
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestEncodeDecode();
+  TestCache();
+  TestCachedLayout();
+  return TestResult();
+}
@@ -0,0 +1,110 @@
+//
+//  refine_test.cc
+//  wu_collage_advanced
+//
+//  Tree invariants after CollageTree::Refine and its rotations.
+//
+
+#include "collage_layout.h"
+#include "test_check.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// Links agree both ways, parents come before their children in the pool,
+// every image is in exactly one leaf with its aspect ratio, tree_leaves()
+// lists the leaves from left to right, and the aspect ratios of the inner
+// nodes are those CalculateAlpha recomputes.
+void CheckTree(CollageTree& tree, const std::vector<AlphaUnit>& images) {
+  int image_num = static_cast<int>(images.size());
+  int root = tree.tree_root();
+  CHECK(tree.node(root).parent_ == -1);
+  std::vector<int> image_count(image_num, 0);
+  std::vector<int> visited;
+  std::vector<int> leaves;
+  std::vector<int> stack(1, root);
+  while (!stack.empty() && (visited.size() < 2 * image_num)) {
+    int ind = stack.back();
+    stack.pop_back();
+    visited.push_back(ind);
+    const TreeNode& cur = tree.node(ind);
+    if (cur.is_leaf_) {
+      leaves.push_back(ind);
+      CHECK((cur.image_ind_ >= 0) && (cur.image_ind_ < image_num));
+      if ((cur.image_ind_ < 0) || (cur.image_ind_ >= image_num)) continue;
+      ++image_count[cur.image_ind_];
+      CHECK(cur.alpha_ == images[cur.image_ind_].alpha_);
+      continue;
+    }
+    CHECK((cur.split_type_ == 'v') || (cur.split_type_ == 'h'));
+    const TreeNode& left = tree.node(cur.left_child_);
+    const TreeNode& right = tree.node(cur.right_child_);
+    CHECK((left.parent_ == ind) && (left.child_type_ == 'l'));
+    CHECK((right.parent_ == ind) && (right.child_type_ == 'r'));
+    CHECK((ind < cur.left_child_) && (ind < cur.right_child_));
+    stack.push_back(cur.right_child_);
+    stack.push_back(cur.left_child_);
+  }
+  CHECK(visited.size() == 2 * image_num - 1);
+  for (int i = 0; i < image_num; ++i) {
+    CHECK(image_count[i] == 1);
+  }
+  CHECK(leaves == tree.tree_leaves());
+
+  std::vector<float> alphas(visited.size());
+  for (int i = 0; i < visited.size(); ++i) {
+    alphas[i] = tree.node(visited[i]).alpha_;
+  }
+  tree.CalculateAlpha(root);
+  for (int i = 0; i < visited.size(); ++i) {
+    CHECK(tree.node(visited[i]).alpha_ == alphas[i]);
+  }
+}
+
+void TestRefine(int image_num, uint64_t seed) {
+  CollageRandom random(seed);
+  std::vector<AlphaUnit> images(image_num);
+  std::vector<float> sorted(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    sorted[i] = 0.4f + 2 * random.UniformFloat();
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < image_num; ++i) {
+    images[i].image_ind_ = i;
+    images[i].alpha_ = sorted[i];
+    images[i].alpha_recip_ = 1 / sorted[i];
+  }
+  AlphaIndex index;
+  index.Build(sorted);
+  CollageTree tree;
+  tree.Init(&images, index, seed);
+  // Far from anything the tree gives, so every move is tried.
+  float expect_alpha = 1.3f;
+  tree.GenerateTree(expect_alpha);
+  tree.CalculateAlpha(tree.tree_root());
+  for (int round = 0; round < 4; ++round) {
+    float thresh = (round < 3) ? 1.0001f : 1.5f;
+    bool success = tree.Refine(expect_alpha, thresh, 300);
+    CheckTree(tree, images);
+    float alpha = tree.node(tree.tree_root()).alpha_;
+    CHECK(success == ((alpha >= expect_alpha / thresh) &&
+                      (alpha <= expect_alpha * thresh)));
+  }
+  // A tree already within thresh is left alone.
+  float alpha = tree.node(tree.tree_root()).alpha_;
+  CHECK(tree.Refine(alpha, 1.01f, 300));
+  CHECK(tree.node(tree.tree_root()).alpha_ == alpha);
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  int image_nums[] = {1, 2, 3, 5, 16, 100, 1000};
+  for (int i = 0; i < sizeof(image_nums) / sizeof(image_nums[0]); ++i) {
+    for (int seed = 1; seed <= 5; ++seed) {
+      TestRefine(image_nums[i], seed * 31 + i);
+    }
+  }
+  return TestResult();
+}
@@ -0,0 +1,106 @@
+//
+//  server_request_test.cc
+//  wu_collage_advanced
+//
+//  CollageServer request parsing, valid and out of range requests.
+//
+
+#include "collage_server.h"
+#include "test_check.h"
+#include <sstream>
+#include <string>
+
+namespace {
+
+bool Parse(const std::string& text, ServerRequest& request,
+           std::string& error) {
+  std::istringstream input(text);
+  request = ServerRequest();
+  error.clear();
+  return CollageServer::ParseRequest(input, request, error);
+}
+
+bool Accepts(const std::string& text) {
+  ServerRequest request;
+  std::string error;
+  bool success = Parse(text, request, error);
+  // Rejections always say why.
+  CHECK(success || !error.empty());
+  return success;
+}
+
+void TestValid() {
+  ServerRequest request;
+  std::string error;
+  CHECK(Parse("json 800 1.5 1.1\na.jpg\nb b.jpg\r\n\nignored.jpg\n",
+              request, error));
+  CHECK(request.format_ == "json");
+  CHECK(request.canvas_width_ == 800);
+  CHECK((request.expect_alpha_ == 1.5f) && (request.thresh_ == 1.1f));
+  CHECK(!request.has_seed_);
+  // Paths end at the empty line and may hold spaces, CRs are dropped.
+  CHECK((request.image_paths_.size() == 2) &&
+        (request.image_paths_[0] == "a.jpg") &&
+        (request.image_paths_[1] == "b b.jpg"));
+
+  CHECK(Parse("png 1000 1 1.2 18446744073709551615\na.jpg", request, error));
+  CHECK(request.has_seed_);
+  CHECK(request.random_seed_ == 18446744073709551615ULL);
+  CHECK(request.image_paths_.size() == 1);
+  CHECK(Parse("json 800 1 1.1 0\na.jpg", request, error));
+  CHECK(request.has_seed_ && (request.random_seed_ == 0));
+
+  std::string many = "jpg 500 1 1.1\n";
+  for (int i = 0; i < kServerMaxImages; ++i) {
+    many += "x.jpg\n";
+  }
+  CHECK(Accepts(many));
+  CHECK(Accepts("bmp 16384 1.1 1.05\na.jpg\n"));
+}
+
+void TestRejected() {
+  CHECK(!Accepts(""));
+  CHECK(!Accepts("json 800 1 1.1\n"));
+  CHECK(!Accepts("json 800 1 1.1\n\na.jpg\n"));
+  CHECK(!Accepts("gif 800 1 1.1\na.jpg\n"));
+  // Missing, malformed and out of range numbers.
+  CHECK(!Accepts("json\na.jpg\n"));
+  CHECK(!Accepts("json 800 1\na.jpg\n"));
+  CHECK(!Accepts("json wide 1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 one 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 0 1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json -800 1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 99999999999 1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 0 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 -1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 0.5\na.jpg\n"));
+  CHECK(!Accepts("json 800 1e-30 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1e30 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1e30\na.jpg\n"));
+  // Seeds are decimal numbers that fit in 64 bits.
+  CHECK(!Accepts("json 800 1 1.1 abc\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1.1 12abc\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1.1 -1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1.1 +1\na.jpg\n"));
+  CHECK(!Accepts("json 800 1 1.1 18446744073709551616\na.jpg\n"));
+  // Canvases beyond kServerMaxCanvasSide, in width or in the tallest
+  // height within thresh.
+  CHECK(!Accepts("json 16385 1 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 16384 1.0 1.1\na.jpg\n"));
+  CHECK(!Accepts("json 1000 0.05 1.1\na.jpg\n"));
+
+  std::string many = "jpg 500 1 1.1\n";
+  for (int i = 0; i <= kServerMaxImages; ++i) {
+    many += "x.jpg\n";
+  }
+  CHECK(!Accepts(many));
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestValid();
+  TestRejected();
+  return TestResult();
+}
@@ -0,0 +1,32 @@
+//
+//  test_check.h
+//  wu_collage_advanced
+//
+//  Minimal checking for the behavior tests run by ctest.
+//
+
+#ifndef __wu_collage_advanced__test_check__
+#define __wu_collage_advanced__test_check__
+
+#include <stdio.h>
+
+// Number of failed CHECKs so far. main() returns TestResult().
+static int test_failure_num = 0;
+
+// Report a failed condition with its location and go on, so that one run
+// lists every failure.
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    if (!(cond)) {                                                         \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                      \
+      ++test_failure_num;                                                  \
+    }                                                                      \
+  } while (0)
+
+inline int TestResult() {
+  if (test_failure_num > 0) fprintf(stderr, "%d failed\n", test_failure_num);
+  return (test_failure_num == 0) ? 0 : 1;
+}
+
+#endif /* defined(__wu_collage_advanced__test_check__) */
@@ -0,0 +1,127 @@
+//
+//  topology_table_test.cc
+//  wu_collage_advanced
+//
+//  TopologyTable entries against trees decoded from them.
+//
+
+#include "collage_layout.h"
+#include "test_check.h"
+#include "topology_table.h"
+#include <algorithm>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace {
+
+void TestCounts() {
+  CHECK(TopologyTable::Count(0) == 0);
+  CHECK(TopologyTable::Count(1) == 1);
+  CHECK(TopologyTable::Count(2) == 2);
+  CHECK(TopologyTable::Count(12) == 106);
+  CHECK(TopologyTable::Count(16) == 514);
+  CHECK(TopologyTable::Count(kMaxTableImages + 1) == 0);
+  CHECK(TopologyTable::Entries(0) == NULL);
+  CHECK(TopologyTable::Entries(kMaxTableImages + 1) == NULL);
+  float alpha = 0;
+  CHECK(TopologyTable::Closest(kMaxTableImages + 1, NULL, 1, alpha) == -1);
+}
+
+// Every entry is a distinct tree with one leaf per rank, and Evaluate gives
+// what CalculateAlpha gives for the tree decoded from its code.
+void TestEntries(int image_num, CollageRandom& random) {
+  std::vector<AlphaUnit> images(image_num);
+  std::vector<float> sorted(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    sorted[i] = 0.4f + 2 * random.UniformFloat();
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < image_num; ++i) {
+    images[i].image_ind_ = i;
+    images[i].alpha_ = sorted[i];
+    images[i].alpha_recip_ = 1 / sorted[i];
+  }
+  AlphaIndex index;
+  index.Build(sorted);
+  CollageTree tree;
+  tree.Init(&images, index, 1);
+
+  int count = TopologyTable::Count(image_num);
+  const Topology* entries = TopologyTable::Entries(image_num);
+  CHECK(entries != NULL);
+  if (entries == NULL) return;
+  std::set<std::pair<uint64_t, uint64_t> > seen;
+  for (int e = 0; e < count; ++e) {
+    CHECK(seen.insert(std::make_pair(entries[e].nodes_,
+                                     entries[e].ranks_)).second);
+    std::vector<int> code;
+    TopologyTable::Code(entries[e], image_num, code);
+    CHECK(code.size() == 2 * image_num - 1);
+    std::vector<int> leaf_ranks;
+    for (int i = 0; i < code.size(); ++i) {
+      if (code[i] >= 0) leaf_ranks.push_back(code[i]);
+    }
+    std::sort(leaf_ranks.begin(), leaf_ranks.end());
+    CHECK(leaf_ranks.size() == image_num);
+    for (int i = 0; i < leaf_ranks.size(); ++i) {
+      CHECK(leaf_ranks[i] == i);
+    }
+    CHECK(tree.Decode(code));
+    CHECK(TopologyTable::Evaluate(entries[e], image_num, &sorted[0]) ==
+          tree.CalculateAlpha(tree.tree_root()));
+  }
+
+  // Closest is the first entry with the smallest factor to expect_alpha.
+  float expect_alphas[] = {0.2f, 0.75f, 1, 1.6f, 9};
+  for (int t = 0; t < sizeof(expect_alphas) / sizeof(expect_alphas[0]); ++t) {
+    float expect_alpha = expect_alphas[t];
+    int best = -1;
+    float best_factor = 0;
+    for (int e = 0; e < count; ++e) {
+      float alpha = TopologyTable::Evaluate(entries[e], image_num, &sorted[0]);
+      float factor = (alpha > expect_alpha) ? alpha / expect_alpha :
+                                              expect_alpha / alpha;
+      if ((best == -1) || (factor < best_factor)) {
+        best = e;
+        best_factor = factor;
+      }
+    }
+    float alpha = 0;
+    CHECK(TopologyTable::Closest(image_num, &sorted[0], expect_alpha,
+                                 alpha) == best);
+    CHECK(alpha ==
+          TopologyTable::Evaluate(entries[best], image_num, &sorted[0]));
+  }
+}
+
+// Small collages take their layout from the table, without a tree search.
+void TestLayout() {
+  CollageLayout layout(600, 9);
+  layout.AddImage(0.75f);
+  layout.AddImage(1.5f);
+  layout.AddImage(1.0f);
+  layout.AddImage(1.33f);
+  int tree_generation = -1;
+  int adjust_iteration = -1;
+  CHECK(layout.CreateLayout(1.0f, 1.2f, tree_generation,
+                            adjust_iteration) == 1);
+  CHECK(tree_generation == 0);
+  CHECK((layout.canvas_alpha() >= 1.0f / 1.2f) &&
+        (layout.canvas_alpha() <= 1.2f));
+  std::vector<FloatRect> rects;
+  layout.LeafRects(rects);
+  CHECK(rects.size() == 4);
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  TestCounts();
+  CollageRandom random(5);
+  for (int image_num = 1; image_num <= kMaxTableImages; ++image_num) {
+    TestEntries(image_num, random);
+  }
+  TestLayout();
+  return TestResult();
+}
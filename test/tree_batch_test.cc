@@ -0,0 +1,160 @@
+//
+//  tree_batch_test.cc
+//  wu_collage_advanced
+//
+//  TreeBatch evaluations against CalculateAlpha on each candidate, and
+//  CollageTree::PickCuts.
+//
+
+#include "collage_layout.h"
+#include "test_check.h"
+#include "tree_batch.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+bool AlphaLess(const AlphaUnit& m, const AlphaUnit& n) {
+  return m.alpha_ < n.alpha_;
+}
+
+// Candidates of a random tree with random cuts flipped and leaf aspect
+// ratios changed: Evaluate must give, bit for bit, what CalculateAlpha gives
+// on a copy of the tree with the same changes.
+void TestAgainstTree(int image_num, int candidate_num, uint64_t seed) {
+  CollageRandom random(seed);
+  std::vector<AlphaUnit> images(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    images[i].image_ind_ = i;
+    images[i].alpha_ = 0.4f + 2 * random.UniformFloat();
+    images[i].alpha_recip_ = 1 / images[i].alpha_;
+  }
+  std::sort(images.begin(), images.end(), AlphaLess);
+  std::vector<float> sorted(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    sorted[i] = images[i].alpha_;
+  }
+  AlphaIndex index;
+  index.Build(sorted);
+  CollageTree tree;
+  tree.Init(&images, index, seed);
+  tree.GenerateTree(1.2f);
+  float tree_alpha = tree.CalculateAlpha(tree.tree_root());
+
+  TreeBatch batch;
+  batch.Init(tree, candidate_num);
+  CHECK(batch.candidate_num() == candidate_num);
+  CHECK(batch.leaf_nodes().size() == image_num);
+  CHECK(batch.inner_nodes().size() == image_num - 1);
+  std::vector<float> root_alphas;
+  batch.Evaluate(root_alphas);
+  CHECK(root_alphas.size() == candidate_num);
+  for (int c = 0; c < root_alphas.size(); ++c) {
+    CHECK(root_alphas[c] == tree_alpha);
+  }
+
+  std::vector<CollageTree> copies(candidate_num, tree);
+  for (int c = 0; c < candidate_num; ++c) {
+    for (int i = 0; i < batch.inner_nodes().size(); ++i) {
+      if (random.UniformFloat() < 0.3f) {
+        char flipped = (batch.split_type(c, i) == 'v') ? 'h' : 'v';
+        batch.set_split_type(c, i, flipped);
+      }
+    }
+    for (int i = 0; i < batch.leaf_nodes().size(); ++i) {
+      if (random.UniformFloat() < 0.1f) {
+        float alpha = 0.4f + 2 * random.UniformFloat();
+        batch.set_leaf_alpha(c, i, alpha);
+        copies[c].node(batch.leaf_nodes()[i]).alpha_ = alpha;
+      }
+    }
+    batch.Store(c, copies[c]);
+  }
+  batch.Evaluate(root_alphas);
+  for (int c = 0; c < candidate_num; ++c) {
+    CHECK(root_alphas[c] ==
+          copies[c].CalculateAlpha(copies[c].tree_root()));
+  }
+
+  // Load puts a tree back into a candidate.
+  batch.Load(0, tree);
+  for (int i = 0; i < batch.inner_nodes().size(); ++i) {
+    CHECK(batch.split_type(0, i) ==
+          tree.node(batch.inner_nodes()[i]).split_type_);
+  }
+  batch.Evaluate(root_alphas);
+  CHECK(root_alphas[0] == tree_alpha);
+}
+
+// PickCuts never moves a tree away from expect_alpha, and leaves its aspect
+// ratios up to date.
+void TestPickCuts(int image_num, uint64_t seed) {
+  CollageRandom random(seed);
+  std::vector<AlphaUnit> images(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    images[i].image_ind_ = i;
+    images[i].alpha_ = 0.4f + 2 * random.UniformFloat();
+    images[i].alpha_recip_ = 1 / images[i].alpha_;
+  }
+  std::sort(images.begin(), images.end(), AlphaLess);
+  std::vector<float> sorted(image_num);
+  for (int i = 0; i < image_num; ++i) {
+    sorted[i] = images[i].alpha_;
+  }
+  AlphaIndex index;
+  index.Build(sorted);
+  CollageTree tree;
+  tree.Init(&images, index, seed);
+  TreeBatch batch;
+  float expect_alphas[] = {0.3f, 1, 4};
+  for (int t = 0; t < sizeof(expect_alphas) / sizeof(expect_alphas[0]); ++t) {
+    float expect_alpha = expect_alphas[t];
+    tree.GenerateTree(expect_alpha);
+    float alpha = tree.CalculateAlpha(tree.tree_root());
+    std::vector<float> root_alphas(1, alpha);
+    float ratio = 0;
+    TreeBatch::Closest(root_alphas, expect_alpha, ratio);
+    float picked = tree.PickCuts(expect_alpha, 32, batch);
+    root_alphas[0] = picked;
+    float picked_ratio = 0;
+    TreeBatch::Closest(root_alphas, expect_alpha, picked_ratio);
+    CHECK(picked_ratio <= ratio);
+    CHECK(picked == tree.node(tree.tree_root()).alpha_);
+    CHECK(picked == tree.CalculateAlpha(tree.tree_root()));
+  }
+}
+
+void TestClosest() {
+  std::vector<float> root_alphas;
+  float ratio = -1;
+  CHECK(TreeBatch::Closest(root_alphas, 1, ratio) == -1);
+  CHECK(ratio == 0);
+  root_alphas.push_back(0.5f);
+  root_alphas.push_back(3.0f);
+  root_alphas.push_back(1.6f);
+  root_alphas.push_back(0.8f);
+  // 0.8 is 1.25 away from 1 as a factor, 1.6 is 1.6 away.
+  CHECK(TreeBatch::Closest(root_alphas, 1, ratio) == 3);
+  CHECK(ratio == 1.25f);
+  CHECK(TreeBatch::Closest(root_alphas, 2, ratio) == 2);
+  CHECK(TreeBatch::Closest(root_alphas, 0.5f, ratio) == 0);
+  CHECK(ratio == 1);
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  int image_nums[] = {1, 2, 3, 10, 257};
+  int candidate_nums[] = {1, 3, 8, 13, 64};
+  for (int i = 0; i < sizeof(image_nums) / sizeof(image_nums[0]); ++i) {
+    for (int c = 0; c < sizeof(candidate_nums) / sizeof(candidate_nums[0]);
+         ++c) {
+      TestAgainstTree(image_nums[i], candidate_nums[c], 17 + i * 5 + c);
+    }
+  }
+  for (int i = 0; i < sizeof(image_nums) / sizeof(image_nums[0]); ++i) {
+    TestPickCuts(image_nums[i], 3 + i);
+  }
+  TestClosest();
+  return TestResult();
+}